@@ -3,10 +3,12 @@ ORIGIN_WORK_DIR="$PWD"
 
 KERNEL_DDRIVER="./kernel_ddriver"
 KERNEL_DEV_PATH="/dev/ddriver"
+KERNEL_BLK_PATH="/dev/ddriver_blk"
 
 USER_DDRIVER="./user_ddriver"
 USER_LOG_PATH="$HOME/ddriver_log"
 USER_DEV_PATH="$HOME/ddriver"
+USER_META_PATH="$HOME/ddriver.meta"
 
 
 if [ -L "$0" ]; then
@@ -34,7 +36,9 @@ function usage(){
     '''
     echo "用法: ddriver [options]"
     echo "options: "
-    echo "-i [k|u]      安装ddriver: [k] - kernel / [u] - user"
+    echo "-i [k|u|b]    安装ddriver: [k] - kernel / [u] - user / [b] - kernel块设备"
+    echo "              [b]的参数: DDRIVER_DISK_MB, DDRIVER_NR_HW_QUEUES, DDRIVER_QUEUE_DEPTH"
+    echo "              newfs以--device=$KERNEL_BLK_PATH使用, 需先安装[u]的静态链接库"
     echo "-t            测试ddriver[请忽略]"
     echo "-d            导出ddriver至当前工作目录[PWD]"
     echo "-r            擦除ddriver"
@@ -44,6 +48,15 @@ function usage(){
     echo "===================================================================="
 }
 
+# 用户态镜像的大小记录在ddriver.meta中，首次打开前为默认4MB
+function user_disk_size() {
+    if [ -f "$USER_META_PATH" ]; then
+        awk '/disk_sz/ {print $2}' "$USER_META_PATH"
+    else
+        echo $((CONFIG_BLOCK_SZ * BLOCK_COUNT))
+    fi
+}
+
 function restore_bashrc() {
     cp "$HOME"/.bashrc_copy "$HOME"/.bashrc -f  
 }
@@ -77,16 +90,21 @@ function install() {
 
         cd $KERNEL_DDRIVER || exit
         make -f ./Makefile 
-        sudo rm $KERNEL_DEV_PATH>/dev/null 2>&1 
+        sudo rm $KERNEL_DEV_PATH $KERNEL_DEV_PATH[0-9]*>/dev/null 2>&1 
         sudo rmmod ddriver>/dev/null 2>&1 
         sudo dmesg -C
-        sudo insmod ./ddriver.ko
+        sudo insmod ./ddriver.ko ndevs="${DDRIVER_NDEVS:-1}"
         in=$(dmesg | tail -n 1)
         tokens=("$in")
         major_number=${tokens[${#tokens[*]}-1]}
         echo Major Number: "$major_number"
         sudo mknod $KERNEL_DEV_PATH c "$major_number" 0
         sudo chmod 777 $KERNEL_DEV_PATH
+        ndevs=$(cat /sys/module/ddriver/parameters/ndevs 2>/dev/null || echo 1)
+        for ((minor = 1; minor < ndevs; minor++)); do     # 额外设备: /dev/ddriver1 ...
+            sudo mknod $KERNEL_DEV_PATH$minor c "$major_number" $minor
+            sudo chmod 777 $KERNEL_DEV_PATH$minor
+        done
         sudo rm /usr/bin/ddriver>/dev/null 2>&1
         sudo ln -s "$WORK_DIR"/ddriver.sh /usr/bin/ddriver>/dev/null 2>&1
         echo "" >>"$HOME"/.bashrc
@@ -95,6 +113,23 @@ function install() {
         echo "export DDRIVER_TYPE='k'" >>"$HOME"/.bashrc
         source "$HOME"/.bashrc
         cd ..
+    elif [ "$DDRIVER_TYPE" == "b" ]; then
+
+        root_permission_check
+
+        cd $KERNEL_DDRIVER || exit
+        make -f ./Makefile
+        sudo rmmod ddriver_blk>/dev/null 2>&1
+        sudo insmod ./ddriver_blk.ko capacity_mb="${DDRIVER_DISK_MB:-4}" \
+                                     nr_hw_queues="${DDRIVER_NR_HW_QUEUES:-4}" \
+                                     queue_depth="${DDRIVER_QUEUE_DEPTH:-64}"
+        sudo chmod 666 $KERNEL_BLK_PATH
+        sudo rm /usr/bin/ddriver>/dev/null 2>&1
+        sudo ln -s "$WORK_DIR"/ddriver.sh /usr/bin/ddriver>/dev/null 2>&1
+
+        echo "export DDRIVER_TYPE='b'" >>"$HOME"/.bashrc
+        source "$HOME"/.bashrc
+        cd ..
     else 
         touch -f "$USER_DEV_PATH"
         
@@ -134,7 +169,7 @@ function test(){
 }
 
 function log() {
-    if [ "$DDRIVER_TYPE" == "k" ]; then  
+    if [ "$DDRIVER_TYPE" == "k" ] || [ "$DDRIVER_TYPE" == "b" ]; then  
         dmesg | grep ddriver
     else 
         cat "$USER_LOG_PATH"
@@ -146,9 +181,12 @@ function dump(){
     if [ "$DDRIVER_TYPE" == "k" ]; then  
         echo "目标设备 $KERNEL_DEV_PATH"
         sudo dd if=$KERNEL_DEV_PATH of="$ORIGIN_WORK_DIR"/ddriver_dump bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+    elif [ "$DDRIVER_TYPE" == "b" ]; then
+        echo "目标设备 $KERNEL_BLK_PATH"
+        sudo dd if=$KERNEL_BLK_PATH of="$ORIGIN_WORK_DIR"/ddriver_dump bs=1M conv=sparse
     else 
         echo "目标设备 $USER_DEV_PATH"
-        dd if="$USER_DEV_PATH" of="$ORIGIN_WORK_DIR"/ddriver_dump bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        dd if="$USER_DEV_PATH" of="$ORIGIN_WORK_DIR"/ddriver_dump bs=$CONFIG_BLOCK_SZ count=$(($(user_disk_size) / CONFIG_BLOCK_SZ)) conv=sparse
     fi
     echo "文件已导出至$ORIGIN_WORK_DIR/ddriver_dump，请安装HexEditor插件查看其内容"
 }
@@ -157,15 +195,21 @@ function clean(){
     if [ "$DDRIVER_TYPE" == "k" ]; then  
         echo "目标设备 $KERNEL_DEV_PATH"
         sudo dd if=/dev/zero of=$KERNEL_DEV_PATH bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+    elif [ "$DDRIVER_TYPE" == "b" ]; then
+        echo "目标设备 $KERNEL_BLK_PATH"
+        sudo blkdiscard $KERNEL_BLK_PATH
     else
         echo "目标设备 $USER_DEV_PATH"
-        dd if=/dev/zero of="$USER_DEV_PATH" bs=$CONFIG_BLOCK_SZ count=$BLOCK_COUNT
+        DISK_SZ=$(user_disk_size)
+        truncate -s 0 "$USER_DEV_PATH" && truncate -s "$DISK_SZ" "$USER_DEV_PATH"
     fi 
 }
 
 function version () {
     if [ "$DDRIVER_TYPE" == "k" ]; then  
         echo "内核设备: $KERNEL_DEV_PATH"
+    elif [ "$DDRIVER_TYPE" == "b" ]; then
+        echo "内核块设备: $KERNEL_BLK_PATH"
     else
         echo "静态链接库设备: $USER_DEV_PATH"
     fi 
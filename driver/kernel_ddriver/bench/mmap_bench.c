@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../ddriver_ctl_user.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define DEFAULT_DEV     "/dev/ddriver"
+#define DEFAULT_CHUNK   4096
+#define DEFAULT_ROUNDS  20
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long checksum(const unsigned char *buf, size_t len, unsigned long sum) {
+    size_t i;
+    for (i = 0; i < len; i++)
+        sum += buf[i];
+    return sum;
+}
+/**
+ * @brief Sequential scan with read(2), @chunk bytes per syscall
+ */
+static unsigned long scan_read(int fd, long size, int chunk) {
+    unsigned char *buf = malloc(chunk);
+    unsigned long sum = 0;
+    long done;
+    ssize_t ret;
+
+    lseek(fd, 0, SEEK_SET);
+    for (done = 0; done < size; done += ret) {
+        ret = read(fd, buf, chunk);
+        if (ret <= 0) {
+            fprintf(stderr, "read at %ld: %s\n", done, ret < 0 ? strerror(errno) : "EOF");
+            exit(1);
+        }
+        sum = checksum(buf, ret, sum);
+    }
+    free(buf);
+    return sum;
+}
+/**
+ * @brief Sequential scan over a shared read-only mapping of the whole disk
+ */
+static unsigned long scan_mmap(int fd, long size) {
+    unsigned long sum;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        exit(1);
+    }
+    sum = checksum(map, size, 0);
+    munmap(map, size);
+    return sum;
+}
+/******************************************************************************
+* SECTION: Main
+*******************************************************************************/
+/**
+ * @brief Compare sequential scans of a ddriver device over read(2) and mmap(2)
+ * 
+ * usage: mmap_bench [device] [chunk] [rounds]
+ * The device may also be a user ddriver image, the size then comes from stat.
+ */
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : DEFAULT_DEV;
+    int chunk = argc > 2 ? atoi(argv[2]) : DEFAULT_CHUNK;
+    int rounds = argc > 3 ? atoi(argv[3]) : DEFAULT_ROUNDS;
+    unsigned long sum_read = 0, sum_mmap = 0;
+    double t_read, t_mmap, start;
+    struct stat st;
+    int size = 0;
+    int fd, i;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    if (ioctl(fd, IOC_REQ_DEVICE_SIZE, &size) < 0 || size <= 0) {
+        if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+            fprintf(stderr, "can't get size of %s\n", path);
+            return 1;
+        }
+        size = st.st_size;
+    }
+
+    start = now_sec();
+    for (i = 0; i < rounds; i++)
+        sum_read = scan_read(fd, size, chunk);
+    t_read = now_sec() - start;
+
+    start = now_sec();
+    for (i = 0; i < rounds; i++)
+        sum_mmap = scan_mmap(fd, size);
+    t_mmap = now_sec() - start;
+
+    printf("device %s, %d bytes, %d rounds\n", path, size, rounds);
+    printf("read  (%6d B/call): %8.3f ms/scan %10.1f MB/s\n", 
+           chunk, t_read * 1e3 / rounds, (double)size * rounds / t_read / (1 << 20));
+    printf("mmap               : %8.3f ms/scan %10.1f MB/s\n", 
+           t_mmap * 1e3 / rounds, (double)size * rounds / t_mmap / (1 << 20));
+    if (sum_read != sum_mmap) {
+        fprintf(stderr, "checksum mismatch: read %lu, mmap %lu\n", sum_read, sum_mmap);
+        return 1;
+    }
+    close(fd);
+    return 0;
+}
@@ -2,8 +2,16 @@
 #include <linux/kernel.h>
 #include <linux/init.h>
 #include <linux/fs.h>
+#include <linux/version.h>
 #include <asm/uaccess.h>
 #include <linux/uaccess.h>
+#include <linux/math64.h>
+#include <linux/uio.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
 #include "ddriver_ctl.h"
 /******************************************************************************
 * SECTION: Macro definitions
@@ -29,6 +37,7 @@
 
 #define CONFIG_DISK_SZ  (4 * 1024 * 1024)
 #define CONFIG_BLOCK_SZ (512)
+#define CONFIG_MAX_DEV  (16)                          /* One device per minor */
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
@@ -36,14 +45,17 @@
 #define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
 #define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
 
-#define GET_HEAD_POS(disk)      (disk.head - disk.layout)
-#define FORWARD_HEAD(disk, dis) (disk.head += dis)
-#define SET_HEAD(disk, ofs)     (disk.head = disk.layout + ofs)
+#define GET_HEAD_POS(disk)      ((disk)->head - (disk)->layout)
+#define FORWARD_HEAD(disk, dis) ((disk)->head += dis)
+#define SET_HEAD(disk, ofs)     ((disk)->head = (disk)->layout + ofs)
 #define RESET_HEAD(disk)        (SET_HEAD(disk, 0))
 
-#define INC_READCNT(disk)       (disk.read_cnt++)
-#define INC_WRITECNT(disk)      (disk.write_cnt++)
-#define INC_SEEKCNT(disk)       (disk.seek_cnt++)
+#define INC_READCNT(disk)       ((disk)->read_cnt++)
+#define INC_WRITECNT(disk)      ((disk)->write_cnt++)
+#define INC_SEEKCNT(disk)       ((disk)->seek_cnt++)
+
+#define RW_DELAY(disk, rw_ops, size) \
+    ((disk)->elapsed_us += (disk)->rw_ops##_lat * 1000LL + div_u64((size), (disk)->xfer_rate))
 /******************************************************************************
 * SECTION: Kernel Module Template
 *******************************************************************************/
@@ -51,125 +63,253 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR(DRIVER_AUTHOR);	    
 MODULE_DESCRIPTION(DRIVER_DESC);	
 MODULE_VERSION(DRIVER_VERSION);	
+
+static int ndevs = 1;
+module_param(ndevs, int, 0444);
+MODULE_PARM_DESC(ndevs, "Number of ddriver devices, one per minor (max 16)");
 /******************************************************************************
 * SECTION: Type definitions
 *******************************************************************************/
 struct ddriver
 {
-    char layout[CONFIG_DISK_SZ];                      /* Disk Layout */
+    char *layout;                                     /* Disk Layout, vmalloc_user'd so it can be mmap'd */
     char *head;                                       /* Disk Head */
     int  read_cnt;
     int  write_cnt;
     int  seek_cnt;
-    int  major_num;
+    int  read_lat;
+    int  write_lat;
+    int  seek_lat;
+    int  xfer_rate;                                   /* MB/s */
+    int  track_num;
+    long long elapsed_us;                             /* Emulated device time */
+    long long last_done_us;                           /* Device time at last request completion */
+    loff_t last_end;                                  /* End of last request, detects sequential IO */
+    struct ddriver_state_ext ext;
+    struct rw_semaphore layout_sem;                   /* Readers share the layout, writers own it */
+    spinlock_t state_lock;                            /* Head, counters and clock */
     int  open_count;
     int  layout_size;
     int  iounit_size;
 };
 
-static struct ddriver disk = {
+static const struct ddriver ddriver_default = {
+    .layout      = NULL,
     .head        = NULL,
     .read_cnt    = 0,
     .write_cnt   = 0,
     .seek_cnt    = 0,
-    .major_num   = 0,
+    .read_lat    = 2,                                 /* Same model as user ddriver */
+    .write_lat   = 1,
+    .seek_lat    = 4,
+    .xfer_rate   = 100,
+    .track_num   = 100,
+    .elapsed_us  = 0,
+    .last_done_us= 0,
+    .last_end    = 0,
     .open_count  = 0,
     .layout_size = CONFIG_DISK_SZ,
     .iounit_size = CONFIG_BLOCK_SZ
 };
+
+static struct ddriver *disks = NULL;                  /* Indexed by minor */
+static int major_num = 0;
 /******************************************************************************
 * SECTION: Helper Functions
 *******************************************************************************/
-int check_valid(size_t size){
-    if (GET_HEAD_POS(disk) >=  CONFIG_DISK_SZ) {
+/**
+ * @brief Any number of whole sectors inside the device
+ */
+int check_valid(struct ddriver *disk, loff_t pos, size_t size){
+    if (pos < 0 || pos >= disk->layout_size) {
         kernel_alert("disk head reach the end");
         return -EINVAL;
     }
-    if (size != CONFIG_BLOCK_SZ){
-        kernel_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
+    if (!IS_ADDR_ALIGN(pos) || !IS_ADDR_ALIGN(size)){
+        kernel_alert("io [%lld, +%zu) should align to %d", pos, size, CONFIG_BLOCK_SZ);
         return -EIO;
     }
+    if (size > disk->layout_size - pos) {
+        kernel_alert("io [%lld, +%zu) beyond disk end", pos, size);
+        return -EINVAL;
+    }
     return 0;
 }
+/**
+ * @brief Account rotation latency, the module never sleeps so the clock is
+ *        always virtual
+ */
+void emulate_rotate(struct ddriver *disk, loff_t start, loff_t end){
+    int bytes_per_track = disk->layout_size / disk->track_num;
+    loff_t distance = (start > end ? start - end : end - start) % bytes_per_track;
+
+    if (distance == 0)
+        return;
+    disk->elapsed_us += div_u64((u64)distance * disk->seek_lat * 1000, bytes_per_track);
+}
+
+int lat_bucket(long long us){
+    int bucket = 0;
+    while (us > 1 && bucket < DDRIVER_LAT_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+/**
+ * @brief Account one request: sequential or random, and its latency on the
+ *        device clock since the last completion (i.e. including the seek)
+ */
+void account_io(struct ddriver *disk, loff_t pos, size_t size, int *lat_hist){
+    if (pos == disk->last_end)
+        disk->ext.seq_cnt++;
+    else
+        disk->ext.rand_cnt++;
+    disk->last_end = pos + size;
+    lat_hist[lat_bucket(disk->elapsed_us - disk->last_done_us)]++;
+    disk->last_done_us = disk->elapsed_us;
+}
+
+/**
+ * @brief Move the head to @pos, a request away from the head (pread/pwrite,
+ *        another opener) costs a seek
+ */
+void position_head(struct ddriver *disk, loff_t pos){
+    loff_t cur = GET_HEAD_POS(disk);
+
+    if (pos == cur)
+        return;
+    SET_HEAD(disk, pos);
+    INC_SEEKCNT(disk);
+    disk->ext.seek_dist += abs(pos - cur);
+    emulate_rotate(disk, cur, pos);
+}
+
+void clear_state(struct ddriver *disk){
+    disk->read_cnt = 0;
+    disk->write_cnt = 0;
+    disk->seek_cnt = 0;
+    disk->elapsed_us = 0;
+    disk->last_done_us = 0;
+    memset(&disk->ext, 0, sizeof(struct ddriver_state_ext));
+}
 /******************************************************************************
 * SECTION: Function definitions
 *******************************************************************************/
 static int      device_open(struct inode *, struct file *);
 static int      device_release(struct inode *, struct file *);
-static ssize_t  device_read(struct file *, char *, size_t, loff_t *);
-static ssize_t  device_write(struct file *, const char *, size_t, loff_t *);
+static ssize_t  device_read_iter(struct kiocb *, struct iov_iter *);
+static ssize_t  device_write_iter(struct kiocb *, struct iov_iter *);
 static loff_t   device_seek(struct file *, loff_t, int);
 static long     device_ioctl(struct file *, unsigned int, unsigned long);
+static int      device_mmap(struct file *, struct vm_area_struct *);
 /******************************************************************************
 * SECTION: Global var or structure definitions
 *******************************************************************************/
 static struct file_operations file_ops = {
-    .read = device_read,
-    .write = device_write,
+    .read_iter = device_read_iter,
+    .write_iter = device_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read = copy_splice_read,                  /* FUSE servers splice straight from the disk */
+#else
+    .splice_read = generic_file_splice_read,
+#endif
+    .splice_write = iter_file_splice_write,
     .open = device_open,
     .llseek = device_seek,
     .unlocked_ioctl = device_ioctl,
+    .mmap = device_mmap,
     .release = device_release
 };
 /******************************************************************************
 * SECTION: Function Implementation
 *******************************************************************************/
 /**
- * @brief Disk Read
+ * @brief Disk Read, serves read/readv/pread from ki_pos, which is the
+ *        caller's own f_pos or pread offset
  * 
- * @param file          Ignored
- * @param user_buffer   User space buffer
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
- * @param offset        Ignored
+ * @param iocb          Device in ki_filp, position in ki_pos
+ * @param to            User space buffers, total length in whole sectors
  * @return ssize_t      Bytes have been read 
  */
 static ssize_t 
-device_read(struct file *file, char *user_buffer, size_t size, loff_t *offset) {
-    IGNORE_ARG(offset);
-    IGNORE_ARG(file);
-    int res = check_valid(size);
+device_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct ddriver *disk = iocb->ki_filp->private_data;
+    size_t size = iov_iter_count(to);
+    loff_t pos = iocb->ki_pos;
+    int res;
+
+    if (size == 0)
+        return 0;
+    res = check_valid(disk, pos, size);
     if(res < 0)
         return res;
-    if (copy_to_user(user_buffer, disk.head, CONFIG_BLOCK_SZ))
+    down_read(&disk->layout_sem);
+    res = copy_to_iter(disk->layout + pos, size, to) != size;
+    up_read(&disk->layout_sem);
+    if (res)
         return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
+
+    spin_lock(&disk->state_lock);
+    position_head(disk, pos);
+    FORWARD_HEAD(disk, size);
+    RW_DELAY(disk, read, size);                       /* Fixed cost per request plus transfer */
     INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    disk->ext.read_bytes += size;
+    account_io(disk, pos, size, disk->ext.read_lat_hist);
+    spin_unlock(&disk->state_lock);
+    iocb->ki_pos = pos + size;
+    return size;
 }
 /**
- * @brief Disk Write
+ * @brief Disk Write, serves write/writev/pwrite at ki_pos
  * 
- * @param file          Ignored
- * @param user_buffer   User space buffer, copy content from
- * @param size          Must equal to Blocksize @CONFIG_BLOCK_SZ
- * @param offset        Ignored
+ * @param iocb          Device in ki_filp, position in ki_pos
+ * @param from          User space buffers, total length in whole sectors
  * @return ssize_t      Bytes have been written
  */
 static ssize_t 
-device_write(struct file *file, const char *user_buffer, size_t size, loff_t *offset) {
-    IGNORE_ARG(offset);
-    IGNORE_ARG(file);
-    int res = check_valid(size);
+device_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct ddriver *disk = iocb->ki_filp->private_data;
+    size_t size = iov_iter_count(from);
+    loff_t pos = iocb->ki_pos;
+    int res;
+
+    if (size == 0)
+        return 0;
+    res = check_valid(disk, pos, size);
     if(res < 0)
         return res;
-
-    if (copy_from_user(disk.head, user_buffer, CONFIG_BLOCK_SZ))
+    down_write(&disk->layout_sem);
+    res = copy_from_iter(disk->layout + pos, size, from) != size;
+    up_write(&disk->layout_sem);
+    if (res)
         return -EFAULT;
-    FORWARD_HEAD(disk, CONFIG_BLOCK_SZ);
+
+    spin_lock(&disk->state_lock);
+    position_head(disk, pos);
+    FORWARD_HEAD(disk, size);
+    RW_DELAY(disk, write, size);                      /* Fixed cost per request plus transfer */
     INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    disk->ext.write_bytes += size;
+    account_io(disk, pos, size, disk->ext.write_lat_hist);
+    spin_unlock(&disk->state_lock);
+    iocb->ki_pos = pos + size;
+    return size;
 }
 /**
- * @brief Disk Seek
+ * @brief Disk Seek, moves this file's f_pos and the shared disk head
  * 
- * @param file          Ignored
+ * @param file          Device
  * @param offset        Aligned to @CONFIG_BLOCK_SZ
  * @param whence        SEEK_CUR, SEEK_SET
  * @return loff_t       cur pos
  */
 static loff_t 
 device_seek(struct file *file, loff_t offset, int whence) {
-    IGNORE_ARG(file);
+    struct ddriver *disk = file->private_data;
+    loff_t cur;
+    loff_t pos;
     if (!IS_ADDR_ALIGN(offset)) {
         kernel_alert("offset %lld must be aligned to block size %d", 
                       offset, CONFIG_BLOCK_SZ);
@@ -178,78 +318,180 @@ device_seek(struct file *file, loff_t offset, int whence) {
     switch (whence)
     {
     case SEEK_SET:
-        SET_HEAD(disk, offset);
+        pos = offset;
         break;
     case SEEK_CUR:
-        FORWARD_HEAD(disk, offset);
+        pos = file->f_pos + offset;
         break;
     default:
-        break;
+        return -EINVAL;
     }
+    if (pos < 0 || pos > disk->layout_size)
+        return -EINVAL;
+    file->f_pos = pos;                                /* read/write continue from here */
+
+    spin_lock(&disk->state_lock);
+    cur = GET_HEAD_POS(disk);
+    SET_HEAD(disk, pos);
     INC_SEEKCNT(disk);
-    return GET_HEAD_POS(disk);
+    disk->ext.seek_dist += abs(pos - cur);
+    emulate_rotate(disk, cur, pos);
+    spin_unlock(&disk->state_lock);
+    return pos;
 }
 /**
  * @brief Disk ioctl
  * 
- * @param file          Ignored
+ * @param file          Device
  * @param cmd           Command
  * @param arg           Args
  * @return long         State
  */
 static long 
 device_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
-    IGNORE_ARG(file);
+    struct ddriver *disk = file->private_data;
     int ret;
+    int vclock;
+    long long size64;
+    struct ddriver_range range;
     struct ddriver_state state;
+    struct ddriver_clock clock;
+    struct ddriver_state_ext ext;
     switch (cmd)
     {
     case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
-        ret = copy_to_user((int __user *)arg, &disk.layout_size, sizeof(int));
+        ret = copy_to_user((int __user *)arg, &disk->layout_size, sizeof(int));
         if (ret) 
             return -EFAULT;
         break;
     case IOC_REQ_DEVICE_STATE:                        /* Device State */
-        state.read_cnt = disk.read_cnt;
-        state.write_cnt = disk.write_cnt;
-        state.seek_cnt = disk.seek_cnt;
+        spin_lock(&disk->state_lock);
+        state.read_cnt = disk->read_cnt;
+        state.write_cnt = disk->write_cnt;
+        state.seek_cnt = disk->seek_cnt;
+        spin_unlock(&disk->state_lock);
         ret = copy_to_user((int __user *)arg, &state, sizeof(struct ddriver_state));
         if (ret) 
             return -EFAULT;
         break;
     case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
-        disk.head = disk.layout;
-        disk.read_cnt = 0;
-        disk.write_cnt = 0;
-        disk.seek_cnt = 0;
+        file->f_pos = 0;
+        spin_lock(&disk->state_lock);
+        disk->head = disk->layout;
+        clear_state(disk);
+        disk->last_end = 0;
+        spin_unlock(&disk->state_lock);
+        break;
+    case IOC_REQ_DEVICE_SIZE64:                       /* Device Size */
+        size64 = disk->layout_size;
+        ret = copy_to_user((long long __user *)arg, &size64, sizeof(long long));
+        if (ret) 
+            return -EFAULT;
         break;
     case IOC_REQ_DEVICE_IO_SZ:
-        ret = copy_to_user((int __user *)arg, &disk.iounit_size, sizeof(int));
+        ret = copy_to_user((int __user *)arg, &disk->iounit_size, sizeof(int));
+        if (ret) 
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_CLOCK:                        /* Emulated Device Time */
+        clock.vclock = 1;
+        spin_lock(&disk->state_lock);
+        clock.elapsed_us = disk->elapsed_us;
+        spin_unlock(&disk->state_lock);
+        ret = copy_to_user((struct ddriver_clock __user *)arg, &clock, sizeof(struct ddriver_clock));
+        if (ret) 
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_VCLOCK:                       /* Wall clock is not supported */
+        if (copy_from_user(&vclock, (int __user *)arg, sizeof(int)))
+            return -EFAULT;
+        if (!vclock)
+            return -EINVAL;
+        break;
+    case IOC_REQ_DEVICE_STATE_EXT:                    /* Extended Device State */
+        spin_lock(&disk->state_lock);
+        ext = disk->ext;
+        spin_unlock(&disk->state_lock);
+        ret = copy_to_user((struct ddriver_state_ext __user *)arg, &ext, sizeof(struct ddriver_state_ext));
         if (ret) 
             return -EFAULT;
         break;
+    case IOC_REQ_DEVICE_STATE_CLR:                    /* Clear State, keep data */
+        spin_lock(&disk->state_lock);
+        clear_state(disk);
+        spin_unlock(&disk->state_lock);
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* Discard Range, reads back zero */
+        if (copy_from_user(&range, (struct ddriver_range __user *)arg, sizeof(struct ddriver_range)))
+            return -EFAULT;
+        if (!IS_ADDR_ALIGN(range.offset) || !IS_ADDR_ALIGN(range.len) ||
+            range.offset < 0 || range.len < 0 || 
+            range.offset + range.len > disk->layout_size) {
+            kernel_alert("bad discard range [%lld, +%lld)", range.offset, range.len);
+            return -EINVAL;
+        }
+        down_write(&disk->layout_sem);
+        memset(disk->layout + range.offset, 0, range.len);
+        up_write(&disk->layout_sem);
+        spin_lock(&disk->state_lock);
+        disk->ext.discard_bytes += range.len;
+        disk->ext.discard_cnt++;
+        spin_unlock(&disk->state_lock);
+        break;
+    case IOC_REQ_DEVICE_FLUSH:                        /* Memory backed, writes are already ordered */
+        spin_lock(&disk->state_lock);
+        disk->ext.flush_cnt++;
+        spin_unlock(&disk->state_lock);
+        break;
     default:
         break;
     }
     return 0;
 }
+/**
+ * @brief Map the layout into user space, zero-copy access to the disk
+ *        content. Loads and stores through the mapping bypass the emulated
+ *        latency and the statistics, they are not disk requests.
+ * 
+ * @param file          Device
+ * @param vma           Page offset and length must stay inside the layout
+ * @return int          state
+ */
+static int 
+device_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct ddriver *disk = file->private_data;
+    unsigned long len = vma->vm_end - vma->vm_start;
+
+    if (vma->vm_pgoff > (disk->layout_size >> PAGE_SHIFT) ||
+        len > disk->layout_size - (vma->vm_pgoff << PAGE_SHIFT)) {
+        kernel_alert("mmap [%lu, +%lu) beyond disk end", vma->vm_pgoff << PAGE_SHIFT, len);
+        return -EINVAL;
+    }
+    return remap_vmalloc_range(vma, disk->layout, vma->vm_pgoff);
+}
 /**
  * @brief Disk Open
  * 
- * @param inode         Ignored
- * @param file          Ignored
+ * @param inode         Minor number selects the device
+ * @param file          Device is kept in private_data
  * @return int          state
  */
 static int 
 device_open(struct inode *inode, struct file *file) {
-    IGNORE_ARG(inode);
-    IGNORE_ARG(file);
-    
-    if (disk.open_count) {                            /* If device is open, return busy */
-        return -EBUSY;
+    struct ddriver *disk;
+    unsigned int minor = iminor(inode);
+
+    if (minor >= ndevs) {
+        return -ENODEV;
     }
-    RESET_HEAD(disk);                                 /* Everytime close device, reset head */
-    disk.open_count++;
+    disk = &disks[minor];
+    file->private_data = disk;
+    file->f_pos = 0;                                  /* Every open has its own position */
+    spin_lock(&disk->state_lock);
+    if (disk->open_count++ == 0) {                    /* First open resets the head */
+        RESET_HEAD(disk);
+    }
+    spin_unlock(&disk->state_lock);
     try_module_get(THIS_MODULE);
     return 0;
 }
@@ -257,48 +499,78 @@ device_open(struct inode *inode, struct file *file) {
  * @brief Disk Close
  * 
  * @param inode         Ignored
- * @param file          Ignored
+ * @param file          Device
  * @return int          state
  */
 static int 
 device_release(struct inode *inode, struct file *file) {
                                                       /* Decrement the open counter and usage count. 
                                                          Without this, the module would not unload. */
+    struct ddriver *disk = file->private_data;
     IGNORE_ARG(inode);
-    IGNORE_ARG(file);
-    disk.open_count--;
+    spin_lock(&disk->state_lock);
+    disk->open_count--;
+    spin_unlock(&disk->state_lock);
     module_put(THIS_MODULE);
     return 0;
 }
 /******************************************************************************
 * SECTION: Module Register and Unregister
 *******************************************************************************/
+static void 
+free_disks(void)
+{
+    int i;
+    for (i = 0; i < ndevs; i++)
+        vfree(disks[i].layout);
+    kfree(disks);
+    disks = NULL;
+}
+
 static int __init 
 ddriver_init(void)
 {
-    int major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
+    int i;
+
+    if (ndevs < 1 || ndevs > CONFIG_MAX_DEV) {
+        kernel_alert("ndevs %d out of range [1, %d]", ndevs, CONFIG_MAX_DEV);
+        return -EINVAL;
+    }
+    disks = kcalloc(ndevs, sizeof(struct ddriver), GFP_KERNEL);
+    if (!disks)
+        return -ENOMEM;
+    for (i = 0; i < ndevs; i++) {
+        disks[i] = ddriver_default;
+        disks[i].layout = vmalloc_user(CONFIG_DISK_SZ);   /* Zeroed, mappable layout */
+        if (!disks[i].layout) {
+            free_disks();
+            return -ENOMEM;
+        }
+        init_rwsem(&disks[i].layout_sem);
+        spin_lock_init(&disks[i].state_lock);
+        RESET_HEAD(&disks[i]);
+    }
+
+    major_num = register_chrdev(0, DEVICE_NAME, &file_ops);   
                                                       /* Register an device */
     if (major_num < 0) {                              /* Register fail */
         kernel_alert("Can't register device, ret %d", major_num);
+        free_disks();
         return major_num;
     } 
-    else {                                            /* Register success */                                                  
-        kernel_info("module loaded with device major number %d", major_num);
-        disk.major_num = major_num;
-        memset(disk.layout, 0, CONFIG_DISK_SZ);
-        return 0;
-    }
+                                                      /* Register success */
+    kernel_info("module loaded with %d devices, device major number %d", ndevs, major_num);
     return 0;
 }
 
 static void __exit 
 ddriver_exit(void)
 {   
-    int major_num = disk.major_num;
     kernel_info("Goodbye %d", major_num);
-    if(major_num != 0){
+    if(major_num > 0){
         unregister_chrdev(major_num, DEVICE_NAME);
     }
+    free_disks();
 }
 
 module_init(ddriver_init);
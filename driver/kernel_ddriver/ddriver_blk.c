@@ -0,0 +1,447 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/version.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/highmem.h>
+#include <linux/uaccess.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include "ddriver_ctl.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define DEVICE_NAME   "ddriver_blk"
+#define kernel_info(fmt, ...)                                           \
+	do {                                                                \
+		printk(KERN_INFO DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);      \
+	} while(0)                                                          \
+
+#define kernel_alert(fmt, ...)                                          \
+	do {                                                                \
+		printk(KERN_ALERT DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);     \
+	} while(0)                                                          \
+
+#define DRIVER_AUTHOR   "Deadpool <deadpoolmine@qq.com>"
+#define DRIVER_DESC     "A Fake disk driver as a blk-mq block device, same "\
+                        "ioctl protocol and latency model as ddriver"
+#define DRIVER_VERSION  "0.1.0"
+
+#define CONFIG_BLOCK_SZ (512)
+#define CONFIG_MAX_MB   (16 * 1024)                   /* vmalloc backed, keep it sane */
+/******************************************************************************
+* SECTION: Macro Functions
+*******************************************************************************/
+#define IGNORE_ARG(arg)         ((void)arg)
+
+#define INC_READCNT(disk)       ((disk)->read_cnt++)
+#define INC_WRITECNT(disk)      ((disk)->write_cnt++)
+#define INC_SEEKCNT(disk)       ((disk)->seek_cnt++)
+
+#define RW_DELAY(disk, rw_ops, size) \
+    ((disk)->elapsed_us += (disk)->rw_ops##_lat * 1000LL + div_u64((size), (disk)->xfer_rate))
+/******************************************************************************
+* SECTION: Kernel Module Template
+*******************************************************************************/
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR(DRIVER_AUTHOR);
+MODULE_DESCRIPTION(DRIVER_DESC);
+MODULE_VERSION(DRIVER_VERSION);
+
+static unsigned long capacity_mb = 4;
+module_param(capacity_mb, ulong, 0444);
+MODULE_PARM_DESC(capacity_mb, "Capacity in MB, vmalloc backed (default 4)");
+
+static int nr_hw_queues = 4;
+module_param(nr_hw_queues, int, 0444);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues (default 4)");
+
+static int queue_depth = 64;
+module_param(queue_depth, int, 0444);
+MODULE_PARM_DESC(queue_depth, "Tags per hardware queue (default 64)");
+/******************************************************************************
+* SECTION: Type definitions
+*******************************************************************************/
+struct ddriver_blk
+{
+    char *layout;                                     /* Disk Layout, vmalloc'd */
+    loff_t head;                                      /* Disk Head */
+    int  read_cnt;
+    int  write_cnt;
+    int  seek_cnt;
+    int  read_lat;
+    int  write_lat;
+    int  seek_lat;
+    int  xfer_rate;         /* MB/s */
+    int  track_num;
+    long long elapsed_us;                             /* Emulated device time, always virtual */
+    long long last_done_us;                           /* Device time at last request completion */
+    loff_t last_end;                                  /* End of last request, detects sequential IO */
+    struct ddriver_state_ext ext;
+    spinlock_t state_lock;                            /* Head, counters and clock */
+    long long layout_size;
+    int  iounit_size;
+    int  major_num;
+    struct blk_mq_tag_set tag_set;
+    struct gendisk *gd;
+};
+
+/* reference: https://en.wikipedia.org/wiki/Hard_disk_drive_performance_characteristics */
+static struct ddriver_blk disk = {
+    .layout      = NULL,
+    .head        = 0,
+    .read_lat    = 2,       /* 2ms */
+    .write_lat   = 1,       /* 1ms */
+    .seek_lat    = 4,       /* 4.17ms per 360 degree */
+    .xfer_rate   = 100,     /* 100MB/s, ~5us per 512B */
+    .track_num   = 100,
+    .iounit_size = CONFIG_BLOCK_SZ
+};
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+/**
+ * @brief Account rotation latency, same model as the character device
+ */
+static void emulate_rotate(struct ddriver_blk *disk, loff_t start, loff_t end){
+    u64 bytes_per_track = div_u64(disk->layout_size, disk->track_num);
+    u64 distance;
+
+    div64_u64_rem(start > end ? start - end : end - start, bytes_per_track, &distance);
+    if (distance == 0)
+        return;
+    disk->elapsed_us += div64_u64(distance * disk->seek_lat * 1000, bytes_per_track);
+}
+
+static int lat_bucket(long long us){
+    int bucket = 0;
+    while (us > 1 && bucket < DDRIVER_LAT_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+/**
+ * @brief Account one request on the single emulated head. Requests from all
+ *        hardware queues share it, so interleaved streams pay seeks.
+ */
+static void account_io(struct ddriver_blk *disk, loff_t pos, unsigned int size, int is_write){
+    if (pos != disk->head) {
+        INC_SEEKCNT(disk);
+        disk->ext.seek_dist += abs(pos - disk->head);
+        emulate_rotate(disk, disk->head, pos);
+    }
+    disk->head = pos + size;
+    if (is_write) {
+        RW_DELAY(disk, write, size);
+        INC_WRITECNT(disk);
+        disk->ext.write_bytes += size;
+    }
+    else {
+        RW_DELAY(disk, read, size);
+        INC_READCNT(disk);
+        disk->ext.read_bytes += size;
+    }
+    if (pos == disk->last_end)
+        disk->ext.seq_cnt++;
+    else
+        disk->ext.rand_cnt++;
+    disk->last_end = pos + size;
+    (is_write ? disk->ext.write_lat_hist : disk->ext.read_lat_hist)
+        [lat_bucket(disk->elapsed_us - disk->last_done_us)]++;
+    disk->last_done_us = disk->elapsed_us;
+}
+
+static void clear_state(struct ddriver_blk *disk){
+    disk->read_cnt = 0;
+    disk->write_cnt = 0;
+    disk->seek_cnt = 0;
+    disk->elapsed_us = 0;
+    disk->last_done_us = 0;
+    memset(&disk->ext, 0, sizeof(struct ddriver_state_ext));
+}
+/******************************************************************************
+* SECTION: Request Queue
+*******************************************************************************/
+/**
+ * @brief Serve one request. Data is copied without a lock like brd, ordering
+ *        overlapping requests is left to the submitter as on real storage.
+ *
+ * @param hctx          Hardware queue, ignored
+ * @param bd            Request
+ * @return blk_status_t state
+ */
+static blk_status_t
+ddriver_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd) {
+    struct request *rq = bd->rq;
+    loff_t pos = (loff_t)blk_rq_pos(rq) << SECTOR_SHIFT;
+    unsigned int size = blk_rq_bytes(rq);
+    blk_status_t status = BLK_STS_OK;
+    struct req_iterator iter;
+    struct bio_vec bvec;
+    loff_t cur = pos;
+    char *buf;
+    IGNORE_ARG(hctx);
+
+    blk_mq_start_request(rq);
+    if (pos + size > disk.layout_size) {
+        kernel_alert("io [%lld, +%u) beyond disk end", pos, size);
+        status = BLK_STS_IOERR;
+        goto end;
+    }
+
+    switch (req_op(rq))
+    {
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        rq_for_each_segment(bvec, rq, iter) {
+            buf = kmap_local_page(bvec.bv_page) + bvec.bv_offset;
+            if (req_op(rq) == REQ_OP_READ) {
+                memcpy(buf, disk.layout + cur, bvec.bv_len);
+                flush_dcache_page(bvec.bv_page);
+            }
+            else {
+                flush_dcache_page(bvec.bv_page);
+                memcpy(disk.layout + cur, buf, bvec.bv_len);
+            }
+            kunmap_local(buf);
+            cur += bvec.bv_len;
+        }
+        spin_lock(&disk.state_lock);
+        account_io(&disk, pos, size, req_op(rq) == REQ_OP_WRITE);
+        spin_unlock(&disk.state_lock);
+        break;
+    case REQ_OP_DISCARD:                              /* Discard Range, reads back zero */
+    case REQ_OP_WRITE_ZEROES:
+        memset(disk.layout + pos, 0, size);
+        spin_lock(&disk.state_lock);
+        disk.ext.discard_bytes += size;
+        disk.ext.discard_cnt++;
+        spin_unlock(&disk.state_lock);
+        break;
+    case REQ_OP_FLUSH:                                /* Memory backed, writes are already ordered */
+        spin_lock(&disk.state_lock);
+        disk.ext.flush_cnt++;
+        spin_unlock(&disk.state_lock);
+        break;
+    default:
+        status = BLK_STS_NOTSUPP;
+        break;
+    }
+end:
+    blk_mq_end_request(rq, status);
+    return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops ddriver_mq_ops = {
+    .queue_rq = ddriver_queue_rq,
+};
+/******************************************************************************
+* SECTION: Block Device Operations
+*******************************************************************************/
+/**
+ * @brief Disk ioctl, same protocol as the character device so that the user
+ *        space ddriver library can pass requests through
+ *
+ * @param bdev          Ignored
+ * @param mode          Ignored
+ * @param cmd           Command
+ * @param arg           Args
+ * @return int          State
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+static int
+device_ioctl(struct block_device *bdev, blk_mode_t mode, unsigned int cmd, unsigned long arg){
+#else
+static int
+device_ioctl(struct block_device *bdev, fmode_t mode, unsigned int cmd, unsigned long arg){
+#endif
+    int size;
+    int vclock;
+    long long size64;
+    struct ddriver_state state;
+    struct ddriver_clock clock;
+    struct ddriver_state_ext ext;
+    IGNORE_ARG(bdev);
+    IGNORE_ARG(mode);
+
+    switch (cmd)
+    {
+    case IOC_REQ_DEVICE_SIZE:                         /* Device Size, clamped to int */
+        size = disk.layout_size > INT_MAX ? INT_MAX : disk.layout_size;
+        if (copy_to_user((int __user *)arg, &size, sizeof(int)))
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_SIZE64:                       /* Device Size */
+        size64 = disk.layout_size;
+        if (copy_to_user((long long __user *)arg, &size64, sizeof(long long)))
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_IO_SZ:
+        if (copy_to_user((int __user *)arg, &disk.iounit_size, sizeof(int)))
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_STATE:                        /* Device State */
+        spin_lock(&disk.state_lock);
+        state.read_cnt = disk.read_cnt;
+        state.write_cnt = disk.write_cnt;
+        state.seek_cnt = disk.seek_cnt;
+        spin_unlock(&disk.state_lock);
+        if (copy_to_user((struct ddriver_state __user *)arg, &state, sizeof(struct ddriver_state)))
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
+    case IOC_REQ_DEVICE_STATE_CLR:                    /* Clear State, keep data */
+        spin_lock(&disk.state_lock);
+        clear_state(&disk);
+        if (cmd == IOC_REQ_DEVICE_RESET) {
+            disk.head = 0;
+            disk.last_end = 0;
+        }
+        spin_unlock(&disk.state_lock);
+        break;
+    case IOC_REQ_DEVICE_CLOCK:                        /* Emulated Device Time */
+        clock.vclock = 1;
+        spin_lock(&disk.state_lock);
+        clock.elapsed_us = disk.elapsed_us;
+        spin_unlock(&disk.state_lock);
+        if (copy_to_user((struct ddriver_clock __user *)arg, &clock, sizeof(struct ddriver_clock)))
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_VCLOCK:                       /* Wall clock is not supported */
+        if (copy_from_user(&vclock, (int __user *)arg, sizeof(int)))
+            return -EFAULT;
+        if (!vclock)
+            return -EINVAL;
+        break;
+    case IOC_REQ_DEVICE_STATE_EXT:                    /* Extended Device State */
+        spin_lock(&disk.state_lock);
+        ext = disk.ext;
+        spin_unlock(&disk.state_lock);
+        if (copy_to_user((struct ddriver_state_ext __user *)arg, &ext, sizeof(struct ddriver_state_ext)))
+            return -EFAULT;
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* Use BLKDISCARD, it also drops the page cache */
+    case IOC_REQ_DEVICE_FLUSH:                        /* Use fsync, it issues REQ_OP_FLUSH */
+        return -ENOTTY;
+    default:
+        return -ENOTTY;
+    }
+    return 0;
+}
+
+static const struct block_device_operations ddriver_blk_ops = {
+    .owner = THIS_MODULE,
+    .ioctl = device_ioctl,
+};
+/******************************************************************************
+* SECTION: Module Register and Unregister
+*******************************************************************************/
+static int __init
+ddriver_blk_init(void)
+{
+    int ret;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    struct queue_limits lim = {
+        .logical_block_size     = CONFIG_BLOCK_SZ,
+        .physical_block_size    = CONFIG_BLOCK_SZ,
+        .max_hw_discard_sectors = UINT_MAX,
+        .max_write_zeroes_sectors = UINT_MAX,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 11, 0)
+        .features               = BLK_FEAT_WRITE_CACHE,
+#endif
+    };
+#endif
+
+    if (capacity_mb < 1 || capacity_mb > CONFIG_MAX_MB ||
+        nr_hw_queues < 1 || queue_depth < 1) {
+        kernel_alert("bad parameters: capacity_mb %lu, nr_hw_queues %d, queue_depth %d",
+                     capacity_mb, nr_hw_queues, queue_depth);
+        return -EINVAL;
+    }
+    disk.layout_size = (long long)capacity_mb << 20;
+    disk.layout = vzalloc(disk.layout_size);          /* Zeroed layout */
+    if (!disk.layout)
+        return -ENOMEM;
+    spin_lock_init(&disk.state_lock);
+
+    disk.major_num = register_blkdev(0, DEVICE_NAME);
+    if (disk.major_num < 0) {
+        kernel_alert("Can't register device, ret %d", disk.major_num);
+        ret = disk.major_num;
+        goto err_free;
+    }
+
+    disk.tag_set.ops = &ddriver_mq_ops;
+    disk.tag_set.nr_hw_queues = nr_hw_queues;
+    disk.tag_set.queue_depth = queue_depth;
+    disk.tag_set.numa_node = NUMA_NO_NODE;
+    disk.tag_set.cmd_size = 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+    disk.tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+#endif
+    ret = blk_mq_alloc_tag_set(&disk.tag_set);
+    if (ret)
+        goto err_unregister;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+    disk.gd = blk_mq_alloc_disk(&disk.tag_set, &lim, NULL);
+#else
+    disk.gd = blk_mq_alloc_disk(&disk.tag_set, NULL);
+#endif
+    if (IS_ERR(disk.gd)) {
+        ret = PTR_ERR(disk.gd);
+        goto err_tag_set;
+    }
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+    blk_queue_logical_block_size(disk.gd->queue, CONFIG_BLOCK_SZ);
+    blk_queue_physical_block_size(disk.gd->queue, CONFIG_BLOCK_SZ);
+    blk_queue_max_discard_sectors(disk.gd->queue, UINT_MAX);
+    blk_queue_max_write_zeroes_sectors(disk.gd->queue, UINT_MAX);
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+    blk_queue_write_cache(disk.gd->queue, true, false);
+#endif
+
+    disk.gd->major = disk.major_num;
+    disk.gd->first_minor = 0;
+    disk.gd->minors = 1;
+    disk.gd->fops = &ddriver_blk_ops;
+    disk.gd->private_data = &disk;
+    snprintf(disk.gd->disk_name, DISK_NAME_LEN, DEVICE_NAME);
+    set_capacity(disk.gd, disk.layout_size >> SECTOR_SHIFT);
+
+    ret = add_disk(disk.gd);
+    if (ret)
+        goto err_disk;
+    kernel_info("module loaded, %lu MB, %d queues x %d tags, device major number %d",
+                capacity_mb, nr_hw_queues, queue_depth, disk.major_num);
+    return 0;
+
+err_disk:
+    put_disk(disk.gd);
+err_tag_set:
+    blk_mq_free_tag_set(&disk.tag_set);
+err_unregister:
+    unregister_blkdev(disk.major_num, DEVICE_NAME);
+err_free:
+    vfree(disk.layout);
+    return ret;
+}
+
+static void __exit
+ddriver_blk_exit(void)
+{
+    kernel_info("Goodbye %d", disk.major_num);
+    del_gendisk(disk.gd);
+    put_disk(disk.gd);
+    blk_mq_free_tag_set(&disk.tag_set);
+    unregister_blkdev(disk.major_num, DEVICE_NAME);
+    vfree(disk.layout);
+}
+
+module_init(ddriver_blk_init);
+module_exit(ddriver_blk_exit);
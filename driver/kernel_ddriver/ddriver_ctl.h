@@ -14,8 +14,43 @@ struct ddriver_state
     int seek_cnt;
 };
 
+struct ddriver_clock
+{
+    int       vclock;                                 /* 1: virtual clock, 0: wall clock */
+    long long elapsed_us;                             /* Emulated device time in us */
+};
+
+#define DDRIVER_LAT_BUCKETS     24                    /* Bucket i: latency in [2^i, 2^(i+1)) us */
+
+struct ddriver_state_ext
+{
+    long long read_bytes;
+    long long write_bytes;
+    long long seek_dist;                              /* Total head movement in bytes */
+    int       seq_cnt;                                /* Requests starting where the last one ended */
+    int       rand_cnt;
+    int       read_lat_hist[DDRIVER_LAT_BUCKETS];
+    int       write_lat_hist[DDRIVER_LAT_BUCKETS];
+    long long discard_bytes;
+    int       discard_cnt;
+    int       flush_cnt;
+};
+
+struct ddriver_range
+{
+    long long offset;                                 /* Aligned to IO unit */
+    long long len;                                    /* Multiple of IO unit */
+};
+
 #define IOC_REQ_DEVICE_SIZE     _IOR(IOC_MAGIC, 0, int)
 #define IOC_REQ_DEVICE_STATE    _IOR(IOC_MAGIC, 1, struct ddriver_state)
 #define IOC_REQ_DEVICE_RESET    _IO(IOC_MAGIC, 2)
 #define IOC_REQ_DEVICE_IO_SZ    _IOR(IOC_MAGIC, 3, int)
+#define IOC_REQ_DEVICE_CLOCK    _IOR(IOC_MAGIC, 4, struct ddriver_clock)
+#define IOC_REQ_DEVICE_VCLOCK   _IOW(IOC_MAGIC, 5, int)
+#define IOC_REQ_DEVICE_STATE_EXT _IOR(IOC_MAGIC, 6, struct ddriver_state_ext)
+#define IOC_REQ_DEVICE_STATE_CLR _IO(IOC_MAGIC, 7)
+#define IOC_REQ_DEVICE_DISCARD  _IOW(IOC_MAGIC, 8, struct ddriver_range)
+#define IOC_REQ_DEVICE_FLUSH    _IO(IOC_MAGIC, 9)
+#define IOC_REQ_DEVICE_SIZE64   _IOR(IOC_MAGIC, 10, long long)
 #endif
\ No newline at end of file
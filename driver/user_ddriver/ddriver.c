@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "stdio.h"
 #include "stdlib.h"
 #include <unistd.h>
@@ -5,11 +6,16 @@
 #include <fcntl.h>
 #include "string.h"
 #include <linux/fs.h>
+#include <linux/falloc.h>
 #include "ddriver_ctl.h"
 #include "stdio.h"
 #include "errno.h"
-#include <pwd.h>
 #include <time.h>
+#include <limits.h>
+#include <libgen.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
 
 extern int errno;
 
@@ -21,18 +27,26 @@ extern int errno;
 * SECTION: Macro definitions
 *******************************************************************************/   
 #define DEVICE_NAME   "ddriver"
-#define DEVICE_LOG    "ddriver_log"
+#define DEVICE_LOG    "_log"                          /* Log: <image>_log */
+#define DEVICE_VCLOCK "DDRIVER_VCLOCK"                /* env: 1 => virtual clock */
+#define DEVICE_META   ".meta"                         /* Sidecar: <image>.meta keeps geometry */
+#define META_MAGIC    "DDRIVER_META"
+#define META_VERSION  1
+#define ENV_DISK_SZ   "DDRIVER_DISK_SZ"               /* env: size of a new image, e.g. 4M, 2G */
+#define ENV_IO_SZ     "DDRIVER_IO_SZ"                 /* env: sector size of a new image */
+#define ENV_PREALLOC  "DDRIVER_PREALLOC"              /* env: 1 => fully allocate, default sparse */
+#define PASS_LOG_DIR  "/tmp/"                         /* Log of a kernel device: /tmp/<dev>_log */
 
-#define user_info(fmt, ...)\
+#define user_info(disk, fmt, ...)\
 	do {\
 		printf(USER_INFO DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
+        fprintf((disk)->debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
 	} while(0)\
 
-#define user_alert(fmt, ...)\
+#define user_alert(disk, fmt, ...)\
 	do {\
 		printf(USER_ALERT DEVICE_NAME " " fmt "\n", ##__VA_ARGS__);\
-        fprintf(debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
+        fprintf((disk)->debugf, USER_PANIC  " " fmt "\n", ##__VA_ARGS__);\
 	} while(0)\
 
 #define user_panic(fmt, ...)\
@@ -46,18 +60,21 @@ extern int errno;
 
 #define CONFIG_DISK_SZ  (4 * 1024 * 1024)
 #define CONFIG_BLOCK_SZ (512)
+#define CONFIG_MAX_FD   (1024)                        /* Devices are keyed by fd */
 /******************************************************************************
 * SECTION: Macro Functions 
 *******************************************************************************/
 #define IGNORE_ARG(arg)         ((void)arg)
-#define IS_ADDR_ALIGN(addr)     (addr % CONFIG_BLOCK_SZ == 0)
-#define ADDR_ROUND_UP(addr)     ((addr / CONFIG_BLOCK_SZ) * CONFIG_BLOCK_SZ)
+#define IS_ADDR_ALIGN(disk, addr)   ((addr) % (disk)->iounit_size == 0)
+#define ADDR_ROUND_UP(disk, addr)   (((addr) / (disk)->iounit_size) * (disk)->iounit_size)
 
-#define INC_READCNT(disk)       (disk.read_cnt++)
-#define INC_WRITECNT(disk)      (disk.write_cnt++)
-#define INC_SEEKCNT(disk)       (disk.seek_cnt++)
+#define INC_READCNT(disk)       (disk->read_cnt++)
+#define INC_WRITECNT(disk)      (disk->write_cnt++)
+#define INC_SEEKCNT(disk)       (disk->seek_cnt++)
 
-#define RW_DELAY(disk, rw_ops)  (usleep(disk.rw_ops##_lat * 1000))
+/* 每个请求一次固定开销，另加按字节数计的传输时间：xfer_rate为MB/s，即每微秒xfer_rate字节 */
+#define RW_DELAY(disk, rw_ops, size)  (emulate_delay(disk, disk->rw_ops##_lat * 1000LL + \
+                                                   (long long)(size) / disk->xfer_rate))
 /******************************************************************************
 * SECTION: Type definitions
 *******************************************************************************/
@@ -70,96 +87,543 @@ struct ddriver
     int  read_lat;
     int  write_lat;
     int  seek_lat;
+    int  xfer_rate;                                  /* MB/s */
     int  track_num;
     int  major_num;
-    int  layout_size;
+    long long layout_size;
     int  iounit_size;
+    int  vclock;                                     /* Advance clock instead of sleeping */
+    long long elapsed_us;                            /* Emulated device time */
+    long long last_done_us;                          /* Device time at last request completion */
+    off_t last_end;                                  /* End of last request, detects sequential IO */
+    off_t head;                                      /* Emulated head, pread/pwrite move it too */
+    struct ddriver_state_ext ext;
+    FILE *debugf;                                    /* Per device log: <image>_log */
+    pthread_mutex_t lock;                            /* Serializes requests on one device */
+    int  passthrough;                                /* 0: image file, 1: kernel char device, 2: block device */
+    char *bounce;                                    /* O_DIRECT bounce buffer for unaligned bufs */
+    size_t bounce_sz;
 };
 /******************************************************************************
 * SECTION: Global Variable
 *******************************************************************************/
 /* reference: https://en.wikipedia.org/wiki/Hard_disk_drive_performance_characteristics */
-struct ddriver disk = {
+static const struct ddriver ddriver_default = {
+    .ddriver_fd  = -1,
     .read_cnt    = 0,
     .write_cnt   = 0,
     .seek_cnt    = 0,
     .read_lat    = 2,       /* 2ms */       
     .write_lat   = 1,       /* 1ms */
     .seek_lat    = 4,       /* 4.17ms per 360 degree */
+    .xfer_rate   = 100,     /* 100MB/s, ~5us per 512B */
     .major_num   = 0,
     .track_num   = 100,
     .layout_size = CONFIG_DISK_SZ,
-    .iounit_size = CONFIG_BLOCK_SZ
+    .iounit_size = CONFIG_BLOCK_SZ,
+    .vclock      = 0,
+    .elapsed_us  = 0,
+    .last_done_us= 0,
+    .last_end    = 0,
+    .head        = 0,
+    .passthrough = 0,
+    .bounce      = NULL,
+    .bounce_sz   = 0
 };
 
-FILE *debugf = NULL;
+enum {
+    PASS_NONE = 0,                                   /* Emulated on an image file */
+    PASS_CHR  = 1,                                   /* Kernel ddriver, it emulates and accounts */
+    PASS_BLK  = 2                                    /* ddriver_blk or any block device, O_DIRECT */
+};
+
+static struct ddriver *disks[CONFIG_MAX_FD];         /* Open devices, indexed by fd */
+static pthread_mutex_t disks_lock = PTHREAD_MUTEX_INITIALIZER;
 /******************************************************************************
 * SECTION: Helper Functions
 *******************************************************************************/
-int check_valid(size_t size) {
-    if (size != CONFIG_BLOCK_SZ){
-        user_alert("io size %ld should align to %d", size, CONFIG_BLOCK_SZ);
+/**
+ * @brief 请求须为整数个IO单位，且不越过设备末尾
+ */
+int check_valid(struct ddriver *disk, off_t pos, size_t size) {
+    if (size == 0 || !IS_ADDR_ALIGN(disk, size) || !IS_ADDR_ALIGN(disk, pos)){
+        user_alert(disk, "io [%ld, +%ld) should align to %d", pos, size, disk->iounit_size);
         return -EIO;
     }
+    if (pos < 0 || pos + (long long)size > disk->layout_size) {
+        user_alert(disk, "io [%ld, +%ld) beyond disk end", pos, size);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+long long parse_size(const char *str) {
+    char *unit;
+    long long size = strtoll(str, &unit, 0);
+    switch (*unit)
+    {
+    case 'G': case 'g':
+        size *= 1024;
+        /* fall through */
+    case 'M': case 'm':
+        size *= 1024;
+        /* fall through */
+    case 'K': case 'k':
+        size *= 1024;
+        break;
+    default:
+        break;
+    }
+    return size;
+}
+/**
+ * @brief 读取镜像的几何信息(<image>.meta)，不存在时按环境变量或默认值创建
+ * 镜像本身不带头部，保持与ddriver -d导出、checkbm等工具的偏移一致
+ */
+int load_meta(struct ddriver *disk, const char *device_path) {
+    char meta_path[256] = {0};
+    char magic[32] = {0};
+    char *env;
+    int version, io_sz, ret;
+    long long disk_sz;
+    FILE *meta;
+
+    snprintf(meta_path, sizeof(meta_path), "%s" DEVICE_META, device_path);
+    meta = fopen(meta_path, "r");
+    if (meta != NULL) {
+        if (fscanf(meta, "%31s %d disk_sz %lld io_sz %d", 
+                   magic, &version, &disk_sz, &io_sz) != 4 ||
+            strcmp(magic, META_MAGIC) != 0) {
+            user_panic("bad meta file %s", meta_path);
+            fclose(meta);
+            return -EINVAL;
+        }
+        fclose(meta);
+        disk->layout_size = disk_sz;
+        disk->iounit_size = io_sz;
+        return 0;
+    }
+
+    disk_sz = CONFIG_DISK_SZ;
+    io_sz = CONFIG_BLOCK_SZ;
+    if ((env = getenv(ENV_DISK_SZ)) != NULL)
+        disk_sz = parse_size(env);
+    if ((env = getenv(ENV_IO_SZ)) != NULL)
+        io_sz = parse_size(env);
+    if (io_sz < 512 || (io_sz & (io_sz - 1)) != 0 || 
+        disk_sz < io_sz || disk_sz % io_sz != 0) {
+        user_panic("bad geometry: disk %lld, io %d", disk_sz, io_sz);
+        return -EINVAL;
+    }
+
+    meta = fopen(meta_path, "w");
+    if (meta == NULL) {
+        ret = -errno;
+        user_panic("can't create meta file %s: %s", meta_path, strerror(-ret));
+        return ret;
+    }
+    fprintf(meta, META_MAGIC " %d\ndisk_sz %lld\nio_sz %d\n", META_VERSION, disk_sz, io_sz);
+    fclose(meta);
+    disk->layout_size = disk_sz;
+    disk->iounit_size = io_sz;
     return 0;
 }
 
-int emulate_rotate(int fd, off_t start, off_t end) {
-    int bytes_per_track = disk.layout_size / disk.track_num;
-    int lat_per_track = disk.seek_lat;
-    int distance = abs(end - start) % bytes_per_track; 
+void emulate_delay(struct ddriver *disk, long long us) {
+    if (us <= 0) {
+        return;
+    }
+    disk->elapsed_us += us;
+    if (!disk->vclock) {                               /* Virtual clock only accounts */
+        usleep(us);
+    }
+}
+
+int emulate_rotate(struct ddriver *disk, off_t start, off_t end) {
+    long long bytes_per_track = disk->layout_size / disk->track_num;
+    int lat_per_track = disk->seek_lat;
+    long long distance = llabs(end - start) % bytes_per_track; 
     
     if (distance == 0) {
         return 0;
     }
 
-    usleep(distance * lat_per_track / bytes_per_track * 1000);
+    emulate_delay(disk, (long long)distance * lat_per_track * 1000 / bytes_per_track);
+    return 0;
+}
+
+int lat_bucket(long long us) {
+    int bucket = 0;
+    while (us > 1 && bucket < DDRIVER_LAT_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+/**
+ * @brief 统计一次读写请求：顺序/随机、延迟分布
+ * 延迟取设备时钟上距上次请求完成的时间，即包含了请求前的寻道
+ */
+void account_io(struct ddriver *disk, off_t pos, size_t size, int *lat_hist) {
+    if (pos == disk->last_end) {
+        disk->ext.seq_cnt++;
+    }
+    else {
+        disk->ext.rand_cnt++;
+    }
+    disk->last_end = pos + size;
+    lat_hist[lat_bucket(disk->elapsed_us - disk->last_done_us)]++;
+    disk->last_done_us = disk->elapsed_us;
+}
+
+/**
+ * @brief 磁盘头移到pos，pread/pwrite离开磁盘头时计一次寻道
+ */
+void position_head(struct ddriver *disk, off_t pos) {
+    if (pos == disk->head) {
+        return;
+    }
+    INC_SEEKCNT(disk);
+    disk->ext.seek_dist += labs(pos - disk->head);
+    emulate_rotate(disk, disk->head, pos);
+    disk->head = pos;
+}
+/**
+ * @brief 内核设备直通：数据直接交给设备，延迟和统计由内核驱动负责
+ * 块设备以O_DIRECT打开，未对齐的buf经由bounce buffer
+ */
+int passthrough_io(struct ddriver *disk, char *buf, size_t size, off_t pos, int is_write) {
+    char *io_buf = buf;
+    ssize_t done;
+
+    if (disk->passthrough == PASS_BLK && (uintptr_t)buf % disk->iounit_size != 0) {
+        if (disk->bounce_sz < size) {
+            free(disk->bounce);
+            disk->bounce = NULL;
+            disk->bounce_sz = 0;
+            if (posix_memalign((void **)&disk->bounce, 4096, size) != 0) {
+                return -ENOMEM;
+            }
+            disk->bounce_sz = size;
+        }
+        io_buf = disk->bounce;
+        if (is_write) {
+            memcpy(io_buf, buf, size);
+        }
+    }
+    done = is_write ? pwrite(disk->ddriver_fd, io_buf, size, pos)
+                    : pread(disk->ddriver_fd, io_buf, size, pos);
+    if (done < 0) {
+        user_alert(disk, "io error: %s", strerror(errno));
+        return -errno;
+    }
+    if (done != size) {
+        return -EIO;
+    }
+    if (!is_write && io_buf != buf) {
+        memcpy(buf, io_buf, size);
+    }
+    return size;
+}
+/**
+ * @brief 一次读写请求，可跨多个IO单位：命令开销每个请求计一次，传输时间按大小计
+ */
+int emulate_io(struct ddriver *disk, char *buf, size_t size, off_t pos, int is_write) {
+    ssize_t done;
+
+    if (disk->passthrough) {
+        return passthrough_io(disk, buf, size, pos, is_write);
+    }
+    position_head(disk, pos);
+    if (is_write) {
+        RW_DELAY(disk, write, size);
+        done = pwrite(disk->ddriver_fd, buf, size, pos);
+    }
+    else {
+        RW_DELAY(disk, read, size);
+        done = pread(disk->ddriver_fd, buf, size, pos);
+    }
+    if (done < 0) {
+        user_alert(disk, "io error: %s", strerror(errno));
+        return -errno;
+    }
+    if (done < size) {                                 /* Image shorter than layout */
+        if (is_write) {
+            return -EIO;
+        }
+        memset(buf + done, 0, size - done);
+    }
+    disk->head = pos + size;
+
+    if (is_write) {
+        INC_WRITECNT(disk);
+        disk->ext.write_bytes += size;
+        account_io(disk, pos, size, disk->ext.write_lat_hist);
+    }
+    else {
+        INC_READCNT(disk);
+        disk->ext.read_bytes += size;
+        account_io(disk, pos, size, disk->ext.read_lat_hist);
+    }
+    return size;
+}
+
+int check_range(struct ddriver *disk, struct ddriver_range *range) {
+    if (!IS_ADDR_ALIGN(disk, range->offset) || !IS_ADDR_ALIGN(disk, range->len) ||
+        range->offset < 0 || range->len < 0 ||
+        range->offset + range->len > disk->layout_size) {
+        user_alert(disk, "bad range [%lld, +%lld)", range->offset, range->len);
+        return -EINVAL;
+    }
+    return 0;
+}
+/**
+ * @brief 丢弃区间，打洞使镜像保持稀疏，文件系统不支持打洞时写0
+ */
+int emulate_discard(struct ddriver *disk, int fd, struct ddriver_range *range) {
+    char buf[4096] = {'\0'};
+    off_t pos, end;
+    ssize_t done;
+    int ret = check_range(disk, range);
+    if (ret < 0)
+        return ret;
+
+    if (range->len == 0)
+        return 0;
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  range->offset, range->len) < 0) {
+        if (errno != EOPNOTSUPP) {
+            user_alert(disk, "discard error: %s", strerror(errno));
+            return -errno;
+        }
+        /* pwrite不移动共享的文件位置；短写时接着写剩下的部分 */
+        end = range->offset + range->len;
+        for (pos = range->offset; pos < end; pos += done) {
+            done = pwrite(fd, buf, end - pos < sizeof(buf) ? end - pos : sizeof(buf), pos);
+            if (done < 0 && errno == EINTR) {
+                done = 0;
+                continue;
+            }
+            if (done <= 0) {
+                ret = done < 0 ? -errno : -EIO;
+                user_alert(disk, "discard error: %s", strerror(-ret));
+                return ret;
+            }
+        }
+    }
+    disk->ext.discard_bytes += range->len;
+    disk->ext.discard_cnt++;
+    return 0;
+}
+
+/**
+ * @brief 直通设备的ioctl：协议与内核驱动一致，块设备的丢弃和刷盘走块层
+ */
+int passthrough_ioctl(struct ddriver *disk, unsigned long cmd, void *arg) {
+    int fd = disk->ddriver_fd;
+    struct ddriver_range *range = (struct ddriver_range *)arg;
+    uint64_t blk_range[2];
+    int ret = 0;
+    int size;
+
+    switch (cmd)
+    {
+    case IOC_REQ_DEVICE_SIZE:                         /* Geometry is known since open */
+        size = disk->layout_size > INT_MAX ? INT_MAX : disk->layout_size;
+        memcpy(arg, &size, sizeof(int));
+        break;
+    case IOC_REQ_DEVICE_SIZE64:
+        memcpy(arg, &disk->layout_size, sizeof(long long));
+        break;
+    case IOC_REQ_DEVICE_IO_SZ:
+        memcpy(arg, &disk->iounit_size, sizeof(int));
+        break;
+    case IOC_REQ_DEVICE_DISCARD:
+        if (disk->passthrough == PASS_BLK) {
+            ret = check_range(disk, range);
+            if (ret < 0 || range->len == 0)
+                return ret;
+            blk_range[0] = range->offset;
+            blk_range[1] = range->len;
+            ret = ioctl(fd, BLKDISCARD, blk_range);   /* Also drops the page cache */
+        }
+        else {
+            ret = ioctl(fd, cmd, arg);
+        }
+        break;
+    case IOC_REQ_DEVICE_FLUSH:
+        ret = disk->passthrough == PASS_BLK ? fsync(fd) : ioctl(fd, cmd, arg);
+        break;
+    case IOC_REQ_DEVICE_RESET:
+        ret = ioctl(fd, cmd, arg);
+        disk->head = 0;
+        break;
+    default:
+        ret = ioctl(fd, cmd, arg);
+        break;
+    }
+    if (ret < 0) {
+        user_alert(disk, "ioctl %lx error: %s", cmd, strerror(errno));
+        return -errno;
+    }
     return 0;
 }
+/**
+ * @brief 打开内核设备(ddriver字符设备、ddriver_blk块设备)，几何信息来自设备本身
+ */
+int open_passthrough(struct ddriver *disk, const char *path, struct stat *st) {
+    char log_path[256] = {0};
+    char *name = strdup(path);
+    int fd;
+
+    snprintf(log_path, sizeof(log_path), PASS_LOG_DIR "%s" DEVICE_LOG, basename(name));
+    free(name);
+    disk->debugf = fopen(log_path, "w+");
+    if (disk->debugf == NULL) {
+        fd = -errno;
+        user_panic("can't init log: %s: %s", log_path, strerror(-fd));
+        return fd;
+    }
+
+    disk->passthrough = S_ISBLK(st->st_mode) ? PASS_BLK : PASS_CHR;
+    fd = open(path, O_RDWR | (disk->passthrough == PASS_BLK ? O_DIRECT : 0));
+    if (fd < 0) {
+        fd = -errno;
+        user_panic("can't open device %s: %s", path, strerror(-fd));
+        return fd;
+    }
+    disk->ddriver_fd = fd;
+
+    if (disk->passthrough == PASS_BLK) {
+        if (ioctl(fd, BLKGETSIZE64, &disk->layout_size) < 0 ||
+            ioctl(fd, BLKSSZGET, &disk->iounit_size) < 0) {
+            fd = -errno;
+            user_panic("can't get geometry of %s: %s", path, strerror(-fd));
+            return fd;
+        }
+    }
+    else if (ioctl(fd, IOC_REQ_DEVICE_SIZE64, &disk->layout_size) < 0 ||
+             ioctl(fd, IOC_REQ_DEVICE_IO_SZ, &disk->iounit_size) < 0) {
+        fd = -errno;
+        user_panic("can't get geometry of %s: %s", path, strerror(-fd));
+        return fd;
+    }
+    return fd;
+}
+
+struct ddriver *get_disk(int fd) {
+    if (fd < 0 || fd >= CONFIG_MAX_FD)
+        return NULL;
+    return disks[fd];
+}
+
+void clear_state(struct ddriver *disk) {
+    disk->read_cnt = 0;
+    disk->write_cnt = 0;
+    disk->seek_cnt = 0;
+    disk->elapsed_us = 0;
+    disk->last_done_us = 0;
+    memset(&disk->ext, 0, sizeof(struct ddriver_state_ext));
+}
 /******************************************************************************
 * SECTION: Global Function Implementation
 *******************************************************************************/
 /**
- * @brief 打开驱动
+ * @brief 打开驱动，每个打开的镜像有独立的状态、统计和日志，以fd区分
+ * 路径是字符设备或块设备时直通到内核驱动，读写和统计都由内核完成
  * 
- * @return int 文件描述符
+ * @param path 镜像路径，不存在时创建；或/dev/ddriver、/dev/ddriver_blk
+ * @return int 文件描述符，失败时返回负的errno
  */
 int ddriver_open(char *path) {
     int fd, ret = 0;
-    char device_path[128] = {0};
-    char log_path[128] = {0};
-    
-    sprintf(device_path, "%s/" DEVICE_NAME, getpwuid(getuid())->pw_dir);
-    sprintf(log_path, "%s/" DEVICE_LOG, getpwuid(getuid())->pw_dir);
-    
-    if (strcmp(device_path, path) != 0) {
-        user_panic("wrong path [%s], should be [%s]", path, device_path);
-        return -1;
-    }
+    char log_path[256] = {0};
+    char *vclock, *prealloc;
+    struct stat st;
+    struct ddriver *disk;
 
-    if (access(device_path, F_OK) == 0) {
-        fd = open(device_path, O_RDWR);
-    }
-    else {
-        fd = open(device_path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (stat(path, &st) == 0 && (S_ISBLK(st.st_mode) || S_ISCHR(st.st_mode))) {
+        disk = (struct ddriver *)malloc(sizeof(struct ddriver));
+        *disk = ddriver_default;
+        pthread_mutex_init(&disk->lock, NULL);
+        fd = open_passthrough(disk, path, &st);
+        if (fd >= CONFIG_MAX_FD) {
+            user_panic("too many open devices");
+            fd = -EMFILE;
+        }
+        if (fd < 0) {
+            if (disk->debugf != NULL)
+                fclose(disk->debugf);
+            if (disk->ddriver_fd >= 0)
+                close(disk->ddriver_fd);
+            pthread_mutex_destroy(&disk->lock);
+            free(disk);
+            return fd;
+        }
+        pthread_mutex_lock(&disks_lock);
+        disks[fd] = disk;
+        pthread_mutex_unlock(&disks_lock);
+        return fd;
     }
+
+    fd = open(path, O_CREAT | O_RDWR, 0644);
     if (fd < 0) {
-        user_panic("can't open device: %d", fd);
+        fd = -errno;
+        user_panic("can't open device %s: %s", path, strerror(-fd));
         return fd;
     }
-    ret = posix_fallocate(fd, 0, CONFIG_DISK_SZ);
+    if (fd >= CONFIG_MAX_FD) {
+        user_panic("too many open devices");
+        close(fd);
+        return -EMFILE;
+    }
+
+    disk = (struct ddriver *)malloc(sizeof(struct ddriver));
+    *disk = ddriver_default;
+    disk->ddriver_fd = fd;
+    pthread_mutex_init(&disk->lock, NULL);
+
+    ret = load_meta(disk, path);
     if (ret < 0) {
-        user_panic("low space");
-        return ret;
+        goto err;
+    }
+    prealloc = getenv(ENV_PREALLOC);
+    if (prealloc != NULL && atoi(prealloc) != 0) {
+        ret = posix_fallocate(fd, 0, disk->layout_size);
+        if (ret != 0) {
+            user_panic("low space");
+            ret = -ret;
+            goto err;
+        }
+    }
+    else if (fstat(fd, &st) == 0 && st.st_size < disk->layout_size) {
+        if (ftruncate(fd, disk->layout_size) < 0) {     /* Sparse by default, holes read back zero */
+            ret = -errno;
+            user_panic("can't size device: %s", strerror(-ret));
+            goto err;
+        }
     }
 
-    debugf = fopen(log_path, "w+");
-    if (debugf == NULL) {
-        user_panic("can't init log: %s", log_path);
-        return -1;
+    snprintf(log_path, sizeof(log_path), "%s" DEVICE_LOG, path);
+    disk->debugf = fopen(log_path, "w+");
+    if (disk->debugf == NULL) {
+        ret = -errno;
+        user_panic("can't init log: %s: %s", log_path, strerror(-ret));
+        goto err;
     }
 
+    vclock = getenv(DEVICE_VCLOCK);
+    disk->vclock = (vclock != NULL && atoi(vclock) != 0);
+
+    pthread_mutex_lock(&disks_lock);
+    disks[fd] = disk;
+    pthread_mutex_unlock(&disks_lock);
     return fd;
+err:
+    pthread_mutex_destroy(&disk->lock);
+    free(disk);
+    close(fd);
+    return ret;
 }
 /**
  * @brief 关闭驱动
@@ -168,7 +632,18 @@ int ddriver_open(char *path) {
  * @return int 
  */
 int ddriver_close(int fd) {
-    return close(fd) && fclose(debugf);
+    struct ddriver *disk = get_disk(fd);
+    if (disk == NULL)
+        return -EBADF;
+
+    pthread_mutex_lock(&disks_lock);
+    disks[fd] = NULL;
+    pthread_mutex_unlock(&disks_lock);
+    fclose(disk->debugf);
+    pthread_mutex_destroy(&disk->lock);
+    free(disk->bounce);
+    free(disk);
+    return close(fd);
 }
 /**
  * @brief 磁盘头SEEK
@@ -179,62 +654,145 @@ int ddriver_close(int fd) {
  * @return int 
  */
 int ddriver_seek(int fd, off_t offset, int whence){
-    int ret = 0;
-    int cur = 0;
+    off_t ret = 0;
+    off_t cur = 0;
+    struct ddriver *disk = get_disk(fd);
+    if (disk == NULL)
+        return -EBADF;
 
-    if (!IS_ADDR_ALIGN(offset)) {
-        user_alert("offset %ld must be aligned to block size %d", 
-                      offset, CONFIG_BLOCK_SZ);
+    if (!IS_ADDR_ALIGN(disk, offset)) {
+        user_alert(disk, "offset %ld must be aligned to block size %d", 
+                      offset, disk->iounit_size);
         return -EINVAL;
     }
 
+    pthread_mutex_lock(&disk->lock);
+    if (disk->passthrough) {                           /* The kernel driver accounts the seek */
+        ret = lseek(fd, offset, whence);
+        if (ret >= 0)
+            disk->head = ret;
+        pthread_mutex_unlock(&disk->lock);
+        return ret < 0 ? -errno : ret;
+    }
     INC_SEEKCNT(disk);
-    cur = lseek(fd, 0, SEEK_CUR);
+    cur = disk->head;
     ret = lseek(fd, offset, whence);
     if (ret < 0) {
+        pthread_mutex_unlock(&disk->lock);
         user_panic("seek error: %s", strerror(errno));
         return ret;
     }
-    emulate_rotate(fd, cur, ret);
+    disk->head = ret;
+    disk->ext.seek_dist += labs(ret - cur);
+    emulate_rotate(disk, cur, ret);
+    pthread_mutex_unlock(&disk->lock);
     return ret;
 }
 /**
- * @brief 磁盘写入，写入大小可通过IOCTL查询
+ * @brief 磁盘写入，大小为IO单位(可通过IOCTL查询)的整数倍
  * 
  * @param fd 
  * @param buf 
  * @param size 
- * @return int 
+ * @return int 写入字节数
  */
 int ddriver_write(int fd, char *buf, size_t size){
-    int res = check_valid(size);
-    if(res < 0)
-        return res;
+    off_t pos;
+    int res;
+    struct ddriver *disk = get_disk(fd);
+    if (disk == NULL)
+        return -EBADF;
         
-    RW_DELAY(disk, write);
-    write(fd, buf, size);
-
-    INC_WRITECNT(disk);
-    return CONFIG_BLOCK_SZ;
+    pthread_mutex_lock(&disk->lock);
+    pos = disk->passthrough ? disk->head : lseek(fd, 0, SEEK_CUR);
+    res = check_valid(disk, pos, size);
+    if (res == 0) {
+        res = emulate_io(disk, buf, size, pos, 1);
+    }
+    if (res > 0 && disk->passthrough) {
+        disk->head = pos + res;                        /* Position kept here, pread/pwrite underneath */
+    }
+    else if (res > 0) {
+        lseek(fd, pos + res, SEEK_SET);
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return res;
 }
 /**
- * @brief 
+ * @brief 磁盘读出，大小为IO单位的整数倍
  * 
  * @param fd 
  * @param buf 
  * @param size 
- * @return int 
+ * @return int 读出字节数
  */
 int ddriver_read(int fd, char *buf, size_t size){
-    int res = check_valid(size);
-    if(res < 0)
-        return res;
+    off_t pos;
+    int res;
+    struct ddriver *disk = get_disk(fd);
+    if (disk == NULL)
+        return -EBADF;
+
+    pthread_mutex_lock(&disk->lock);
+    pos = disk->passthrough ? disk->head : lseek(fd, 0, SEEK_CUR);
+    res = check_valid(disk, pos, size);
+    if (res == 0) {
+        res = emulate_io(disk, buf, size, pos, 0);
+    }
+    if (res > 0 && disk->passthrough) {
+        disk->head = pos + res;                        /* Position kept here, pread/pwrite underneath */
+    }
+    else if (res > 0) {
+        lseek(fd, pos + res, SEEK_SET);
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+/**
+ * @brief 定位写入，不改变ddriver_seek的位置
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size IO单位的整数倍
+ * @param offset 与IO单位对齐
+ * @return int 写入字节数
+ */
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset){
+    int res;
+    struct ddriver *disk = get_disk(fd);
+    if (disk == NULL)
+        return -EBADF;
 
-    RW_DELAY(disk, read);
-    read(fd, buf, size);
+    pthread_mutex_lock(&disk->lock);
+    res = check_valid(disk, offset, size);
+    if (res == 0) {
+        res = emulate_io(disk, buf, size, offset, 1);
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return res;
+}
+/**
+ * @brief 定位读出，不改变ddriver_seek的位置
+ * 
+ * @param fd 
+ * @param buf 
+ * @param size IO单位的整数倍
+ * @param offset 与IO单位对齐
+ * @return int 读出字节数
+ */
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset){
+    int res;
+    struct ddriver *disk = get_disk(fd);
+    if (disk == NULL)
+        return -EBADF;
 
-    INC_READCNT(disk);
-    return CONFIG_BLOCK_SZ;
+    pthread_mutex_lock(&disk->lock);
+    res = check_valid(disk, offset, size);
+    if (res == 0) {
+        res = emulate_io(disk, buf, size, offset, 0);
+    }
+    pthread_mutex_unlock(&disk->lock);
+    return res;
 }
 /**
  * @brief 
@@ -245,35 +803,75 @@ int ddriver_read(int fd, char *buf, size_t size){
  * @return int 
  */
 int ddriver_ioctl(int fd, unsigned long cmd, void *arg){
+    int ret = 0;
+    int size;
     struct ddriver_state state;
+    struct ddriver_clock clock;
+    struct ddriver *disk = get_disk(fd);
+    if (disk == NULL)
+        return -EBADF;
+
+    pthread_mutex_lock(&disk->lock);
+    if (disk->passthrough) {
+        ret = passthrough_ioctl(disk, cmd, arg);
+        pthread_mutex_unlock(&disk->lock);
+        return ret;
+    }
     switch (cmd)
     {
-    case IOC_REQ_DEVICE_SIZE:                         /* Device Size */
-        memcpy(arg, &disk.layout_size, sizeof(int));
+    case IOC_REQ_DEVICE_SIZE:                         /* Device Size, clamped to int */
+        size = disk->layout_size > INT_MAX ? INT_MAX : disk->layout_size;
+        memcpy(arg, &size, sizeof(int));
+        break;
+    case IOC_REQ_DEVICE_SIZE64:                       /* Device Size */
+        memcpy(arg, &disk->layout_size, sizeof(long long));
         break;
     case IOC_REQ_DEVICE_STATE:                        /* Device State */
-        state.read_cnt = disk.read_cnt;
-        state.write_cnt = disk.write_cnt;
-        state.seek_cnt = disk.seek_cnt;
+        state.read_cnt = disk->read_cnt;
+        state.write_cnt = disk->write_cnt;
+        state.seek_cnt = disk->seek_cnt;
         memcpy(arg, &state, sizeof(struct ddriver_state));
         break;
-    case IOC_REQ_DEVICE_RESET:                        /* Reset Device */
-        lseek(fd, 0, SEEK_SET);
-        char buf[4096] = {'\0'};
-        for (size_t i = 0; i < CONFIG_DISK_SZ; i += 4096)
-        {
-            write(fd, buf, 4096);
+    case IOC_REQ_DEVICE_RESET:                        /* Reset Device, drop all extents */
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, disk->layout_size) < 0) {
+            user_alert(disk, "reset error: %s", strerror(errno));
+            ret = -errno;
         }
         lseek(fd, 0, SEEK_SET);
-        disk.read_cnt = 0;
-        disk.write_cnt = 0;
-        disk.seek_cnt = 0;
+        disk->head = 0;
+        clear_state(disk);
+        disk->last_end = 0;
         break;
     case IOC_REQ_DEVICE_IO_SZ:
-        memcpy(arg, &disk.iounit_size, sizeof(int));
+        memcpy(arg, &disk->iounit_size, sizeof(int));
+        break;
+    case IOC_REQ_DEVICE_CLOCK:                        /* Emulated Device Time */
+        clock.vclock = disk->vclock;
+        clock.elapsed_us = disk->elapsed_us;
+        memcpy(arg, &clock, sizeof(struct ddriver_clock));
+        break;
+    case IOC_REQ_DEVICE_VCLOCK:                       /* Switch Virtual Clock */
+        disk->vclock = (*(int *)arg != 0);
+        break;
+    case IOC_REQ_DEVICE_STATE_EXT:                    /* Extended Device State */
+        memcpy(arg, &disk->ext, sizeof(struct ddriver_state_ext));
+        break;
+    case IOC_REQ_DEVICE_STATE_CLR:                    /* Clear State, keep data */
+        clear_state(disk);
+        break;
+    case IOC_REQ_DEVICE_DISCARD:                      /* Discard Range */
+        ret = emulate_discard(disk, fd, (struct ddriver_range *)arg);
+        break;
+    case IOC_REQ_DEVICE_FLUSH:                        /* Write Barrier */
+        if (fdatasync(fd) < 0) {
+            user_alert(disk, "flush error: %s", strerror(errno));
+            ret = -errno;
+        }
+        disk->ext.flush_cnt++;
         break;
     default:
         break;
     }
-    return 0;
+    pthread_mutex_unlock(&disk->lock);
+    return ret;
 }
\ No newline at end of file
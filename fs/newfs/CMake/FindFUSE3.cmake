@@ -0,0 +1,28 @@
+# Find the FUSE 3 includes and library
+#
+#  FUSE3_INCLUDE_DIR - where to find fuse.h, fuse_lowlevel.h, etc.
+#  FUSE3_LIBRARIES   - List of libraries when using FUSE 3.
+#  FUSE3_FOUND       - True if FUSE 3 lib is found.
+
+# check if already in cache, be silent
+IF (FUSE3_INCLUDE_DIR)
+    SET (FUSE3_FIND_QUIETLY TRUE)
+ENDIF (FUSE3_INCLUDE_DIR)
+
+# find includes, fuse3 installs its headers under include/fuse3
+FIND_PATH (FUSE3_INCLUDE_DIR fuse_lowlevel.h
+        PATHS /usr/local/include /usr/include
+        PATH_SUFFIXES fuse3
+        )
+
+# find lib
+FIND_LIBRARY(FUSE3_LIBRARIES
+        NAMES fuse3
+        PATHS /lib64 /lib /usr/lib64 /usr/lib /usr/local/lib64 /usr/local/lib /usr/lib/x86_64-linux-gnu
+        )
+
+include ("FindPackageHandleStandardArgs")
+find_package_handle_standard_args ("FUSE3" DEFAULT_MSG
+        FUSE3_INCLUDE_DIR FUSE3_LIBRARIES)
+
+mark_as_advanced (FUSE3_INCLUDE_DIR FUSE3_LIBRARIES)
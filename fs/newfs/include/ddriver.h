@@ -6,6 +6,9 @@
 
 /**
  * @brief 打开ddriver设备
+ * 镜像默认稀疏分配，大小和IO单位记录在<path>.meta中；
+ * 新镜像可用环境变量DDRIVER_DISK_SZ(如64M、2G)和DDRIVER_IO_SZ指定；
+ * 路径为/dev/ddriver或/dev/ddriver_blk等设备时直通内核驱动，统计由内核负责
  * 
  * @param path ddriver设备路径
  * @return int 0成功，否则失败
@@ -27,8 +30,8 @@ int ddriver_seek(int fd, off_t offset, int whence);
  * 
  * @param fd ddriver设备handler
  * @param buf 要写入的数据Buf
- * @param size 要写入的数据大小，注意一定要等于单次设备IO单位
- * @return int 0成功，否则失败
+ * @param size 要写入的数据大小，必须是设备IO单位的整数倍，一次请求只计一次延迟
+ * @return int 写入字节数，负数失败
  */
 int ddriver_write(int fd, char *buf, size_t size);
 
@@ -37,11 +40,33 @@ int ddriver_write(int fd, char *buf, size_t size);
  * 
  * @param fd ddriver设备handler
  * @param buf 要读出的数据Buf
- * @param size 要读出的数据大小，注意一定要等于单次设备IO单位
- * @return int 
+ * @param size 要读出的数据大小，必须是设备IO单位的整数倍
+ * @return int 读出字节数，负数失败
  */
 int ddriver_read(int fd, char *buf, size_t size);
 
+/**
+ * @brief 在指定位置写入数据，不改变ddriver_seek设置的位置
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要写入的数据Buf
+ * @param size 要写入的数据大小，必须是设备IO单位的整数倍
+ * @param offset 写入位置，注意要和设备IO单位对齐
+ * @return int 写入字节数，负数失败
+ */
+int ddriver_pwrite(int fd, char *buf, size_t size, off_t offset);
+
+/**
+ * @brief 从指定位置读出数据，不改变ddriver_seek设置的位置
+ * 
+ * @param fd ddriver设备handler
+ * @param buf 要读出的数据Buf
+ * @param size 要读出的数据大小，必须是设备IO单位的整数倍
+ * @param offset 读出位置，注意要和设备IO单位对齐
+ * @return int 读出字节数，负数失败
+ */
+int ddriver_pread(int fd, char *buf, size_t size, off_t offset);
+
 /**
  * @brief ddriver IO控制
  * 
@@ -1,18 +1,24 @@
 #ifndef _NEWFS_H_
 #define _NEWFS_H_
 
+#ifdef NEWFS_FUSE3
+#define FUSE_USE_VERSION 31 /* cmake -DNEWFS_FUSE3=ON */
+#else
 #define FUSE_USE_VERSION 26
+#endif
 #include "stdio.h"
 #include "stdlib.h"
 #include <unistd.h>
 #include "fcntl.h"
 #include "string.h"
 #include "fuse.h"
+#include "fuse_lowlevel.h"
 #include <stddef.h>
 #include "ddriver.h"
 #include "errno.h"
-#include "types.h"
 #include "stdint.h"
+#include <pthread.h>
+#include "types.h"
 
 #define NEWFS_MAGIC 0x131313	/* TODO: Define by yourself */
 #define NEWFS_DEFAULT_PERM 0777 /* 全权限打开 */
@@ -22,6 +28,16 @@
 *******************************************************************************/
 #define NFS_DBG(fmt, ...) do { printf("NFS_DBG: " fmt, ##__VA_ARGS__); } while(0) 
 
+/******************************************************************************
+* SECTION: FUSE版本适配
+*******************************************************************************/
+/* FUSE 3的fuse_fill_dir_t多一个flags参数 */
+#if FUSE_USE_VERSION >= 30
+#define NFS_FILLER(filler, buf, name, stbuf, off) filler(buf, name, stbuf, off, 0)
+#else
+#define NFS_FILLER(filler, buf, name, stbuf, off) filler(buf, name, stbuf, off)
+#endif
+
 
 /******************************************************************************
  * SECTION: newfs_utils.c
@@ -30,21 +46,101 @@ char *nfs_get_fname(const char *);
 int nfs_calc_lvl(const char *);
 int nfs_driver_read(int, uint8_t *, int);
 int nfs_driver_write(int, uint8_t *, int);
+int nfs_driver_ioctl(unsigned long cmd, void *arg);
 int nfs_mount(struct custom_options);
 int nfs_umount();
 int nfs_alloc_dentry(struct nfs_inode *inode, struct nfs_dentry *dentry, int);
+int nfs_drop_dentry(struct nfs_inode *inode, struct nfs_dentry *dentry);
+int nfs_alloc_data_blk();
+void nfs_free_data_blk(int dno);
+void nfs_release_data_blk(int dno);
+int nfs_flush_discards();
 struct nfs_inode *nfs_alloc_inode(struct nfs_dentry *dentry);
+void nfs_free_inode(struct nfs_inode *inode);
 int nfs_sync_inode(struct nfs_inode *inode);
+boolean nfs_verify_inode_blk(const uint8_t *blk);
+boolean nfs_verify_dentry_blk(const uint8_t *blk);
+int nfs_pack_inode(struct nfs_inode *inode, uint8_t *bufs, int *blknos);
+uint32_t nfs_log_inode(struct nfs_inode *inode);
+void nfs_dirty_map(boolean is_data, int bit);
+int nfs_take_dirty_maps(uint8_t *bufs, int *blknos);
+void nfs_redirty_maps(const int *blknos, int cnt);
+void nfs_log_maps();
 struct nfs_inode *nfs_read_inode(struct nfs_dentry *dentry, int ino);
+int nfs_evict_inode(struct nfs_inode *inode);
+struct nfs_dentry *nfs_find_dentry(struct nfs_inode *dir, const char *fname);
+int nfs_make_node(struct nfs_inode *dir, const char *fname, FILE_TYPE ftype,
+                  struct nfs_dentry **out);
+int nfs_file_resize(struct nfs_inode *inode, int size);
+struct fuse_bufvec *nfs_file_read_buf(struct nfs_inode *inode, struct nfs_file *file,
+                                      size_t size, off_t offset, boolean pin);
+int nfs_file_write_buf(struct nfs_inode *inode, struct nfs_file *file,
+                       struct fuse_bufvec *src, off_t offset);
+struct nfs_file *nfs_file_open(struct nfs_inode *inode);
+void nfs_file_close(struct nfs_file *file);
 struct nfs_dentry *nfs_get_dentry(struct nfs_inode *inode, int dir);
-struct nfs_dentry *nfs_lookup(const char *path, boolean *is_find, boolean *is_root);
+void nfs_dir_lock(struct nfs_inode *inode, boolean excl);
+void nfs_dir_unlock(struct nfs_inode *inode);
+struct nfs_inode *nfs_load_inode(struct nfs_dentry *dentry);
+struct nfs_dentry *nfs_lookup(const char *path, boolean *is_find, boolean *is_root,
+                              struct nfs_inode **locked, boolean excl);
+/******************************************************************************
+ * SECTION: newfs_format.c
+ *******************************************************************************/
+void nfs_csum_super(struct nfs_super_d *super_d);
+boolean nfs_verify_super(struct nfs_super_d *super_d);
+int nfs_plan_layout(struct nfs_super_d *super_d, long long sz_disk, int sz_io, int sz_blk,
+                    int inode_ratio, int journal_blks);
+int nfs_format(int fd, struct nfs_super_d *super_d);
+/******************************************************************************
+ * SECTION: newfs_crc32c.c
+ *******************************************************************************/
+uint32_t nfs_crc32c(const void *buf, size_t len);
+uint32_t nfs_crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len);
+#if defined(__x86_64__) || defined(__i386__)
+uint32_t nfs_crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len);
+#endif
+const char *nfs_crc32c_impl();
+/******************************************************************************
+ * SECTION: newfs_journal.c
+ *******************************************************************************/
+int nfs_journal_mount();
+int nfs_journal_umount();
+boolean nfs_journal_enabled();
+void nfs_journal_start(int credits);
+void nfs_journal_stop();
+uint32_t nfs_journal_log(int blkno, const uint8_t *buf);
+boolean nfs_journal_free(int blkno);
+boolean nfs_journal_busy(int blkno);
+boolean nfs_journal_read(int blkno, uint8_t *buf);
+int nfs_journal_sync(uint32_t seq);
+int nfs_journal_commit();
+boolean nfs_journal_commit_expired(long expire_ms);
+/******************************************************************************
+ * SECTION: newfs_writeback.c
+ *******************************************************************************/
+long nfs_now_ms();
+void nfs_mark_inode_dirty(struct nfs_inode *inode, int flags);
+void nfs_dirty_blk(struct nfs_inode *inode, int blk);
+void nfs_clean_blk(struct nfs_inode *inode, int blk);
+void nfs_forget_dirty(struct nfs_inode *inode);
+int nfs_write_inode(struct nfs_inode *inode, boolean maps);
+int nfs_fsync_inode(struct nfs_inode *inode);
+void nfs_wb_init(struct custom_options options);
+int nfs_wb_start();
+void nfs_wb_stop();
+void nfs_balance_dirty();
 /******************************************************************************
  * SECTION: newfs.c
  *******************************************************************************/
+extern int max_dentrys_2_inode;
+void newfs_default_options();
+void newfs_conn_init(struct fuse_conn_info *);
 void *newfs_init(struct fuse_conn_info *);
 void newfs_destroy(void *);
 int newfs_mkdir(const char *, mode_t);
 int newfs_getattr(const char *, struct stat *);
+int newfs_fgetattr(const char *, struct stat *, struct fuse_file_info *);
 int newfs_readdir(const char *, void *, fuse_fill_dir_t, off_t,
 				  struct fuse_file_info *);
 int newfs_mknod(const char *, mode_t, dev_t);
@@ -52,14 +148,56 @@ int newfs_write(const char *, const char *, size_t, off_t,
 				struct fuse_file_info *);
 int newfs_read(const char *, char *, size_t, off_t,
 			   struct fuse_file_info *);
+int newfs_write_buf(const char *, struct fuse_bufvec *, off_t,
+					struct fuse_file_info *);
+int newfs_read_buf(const char *, struct fuse_bufvec **, size_t, off_t,
+				   struct fuse_file_info *);
 int newfs_access(const char *, int);
 int newfs_unlink(const char *);
 int newfs_rmdir(const char *);
 int newfs_rename(const char *, const char *);
 int newfs_utimens(const char *, const struct timespec tv[2]);
 int newfs_truncate(const char *, off_t);
+int newfs_ftruncate(const char *, off_t, struct fuse_file_info *);
 
 int newfs_open(const char *, struct fuse_file_info *);
 int newfs_opendir(const char *, struct fuse_file_info *);
+int newfs_flush(const char *, struct fuse_file_info *);
+int newfs_release(const char *, struct fuse_file_info *);
+int newfs_releasedir(const char *, struct fuse_file_info *);
+int newfs_fsync(const char *, int, struct fuse_file_info *);
+int newfs_fsyncdir(const char *, int, struct fuse_file_info *);
+int newfs_ioctl(const char *, int, void *, struct fuse_file_info *, unsigned int, void *);
+/******************************************************************************
+ * SECTION: newfs_ll.c
+ *******************************************************************************/
+void newfs_ll_init(void *, struct fuse_conn_info *);
+void newfs_ll_destroy(void *);
+void newfs_ll_lookup(fuse_req_t, fuse_ino_t, const char *);
+void newfs_ll_forget(fuse_req_t, fuse_ino_t, unsigned long);
+void newfs_ll_getattr(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+void newfs_ll_setattr(fuse_req_t, fuse_ino_t, struct stat *, int,
+					  struct fuse_file_info *);
+void newfs_ll_mknod(fuse_req_t, fuse_ino_t, const char *, mode_t, dev_t);
+void newfs_ll_mkdir(fuse_req_t, fuse_ino_t, const char *, mode_t);
+void newfs_ll_unlink(fuse_req_t, fuse_ino_t, const char *);
+void newfs_ll_rmdir(fuse_req_t, fuse_ino_t, const char *);
+void newfs_ll_readdir(fuse_req_t, fuse_ino_t, size_t, off_t,
+					  struct fuse_file_info *);
+void newfs_ll_open(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+void newfs_ll_release(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+void newfs_ll_flush(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+void newfs_ll_fsync(fuse_req_t, fuse_ino_t, int, struct fuse_file_info *);
+void newfs_ll_read(fuse_req_t, fuse_ino_t, size_t, off_t,
+				   struct fuse_file_info *);
+void newfs_ll_write_buf(fuse_req_t, fuse_ino_t, struct fuse_bufvec *, off_t,
+						struct fuse_file_info *);
+void newfs_ll_ioctl(fuse_req_t, fuse_ino_t, int, void *, struct fuse_file_info *,
+					unsigned, const void *, size_t, size_t);
+#if FUSE_USE_VERSION >= 30
+void newfs_ll_readdirplus(fuse_req_t, fuse_ino_t, size_t, off_t,
+						  struct fuse_file_info *);
+#endif
+int newfs_ll_main(struct fuse_args *);
 
 #endif /* _newfs_H_ */
\ No newline at end of file
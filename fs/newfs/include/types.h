@@ -35,6 +35,11 @@ typedef enum file_type
 #define NFS_ERROR_UNSUPPORTED ENXIO
 #define NFS_ERROR_IO EIO       /* Error Input/Output */
 #define NFS_ERROR_INVAL EINVAL /* Invalid Args */
+#define NFS_ERROR_NOTEMPTY ENOTEMPTY
+#define NFS_ERROR_NAMETOOLONG ENAMETOOLONG
+#define NFS_ERROR_BUSY EBUSY
+#define NFS_ERROR_FBIG EFBIG
+#define NFS_ERROR_NOTTY ENOTTY /* 不支持的ioctl */
 
 #define NFS_MAX_FILE_NAME 128
 // 一个逻辑块里面可以放16个inode
@@ -46,18 +51,54 @@ typedef enum file_type
 #define NFS_IOC_MAGIC 'S'
 #define NFS_IOC_SEEK _IO(NFS_IOC_MAGIC, 0)
 
+// 与内核协商的单次读写上限
+#define NFS_FUSE_MAX_IO (1 << 20)
+// 内核缓存entry和属性的默认时间(秒)
+#define NFS_DEFAULT_TIMEOUT 1.0
+
+// 攒够这么多个被释放的数据块再一起下发discard
+#define NFS_DISCARD_BATCH 64
+
 #define NFS_FLAG_BUF_DIRTY 0x1
 #define NFS_FLAG_BUF_OCCUPY 0x2
 
-/**磁盘布局设计 */
+// 顺序读预读窗口的初始值与上限(块数)
+#define NFS_RA_INIT_BLKS 2
+#define NFS_RA_MAX_BLKS 8
+
+// 元数据日志：日志超级块、描述块、提交块的幻数
+#define NFS_JOURNAL_MAGIC 0x4a524e4c
+#define NFS_JDESC_MAGIC 0x4a444553
+#define NFS_JCOMMIT_MAGIC 0x4a434d54
+// 一个操作最多改动的元数据块：两个位图、父目录和自身的inode、父目录的全部目录项块，以及撤销记录
+#define NFS_JOURNAL_OP_BLKS 16
+// 首次挂载时日志区的默认大小与下限(块数)，0表示不使用日志。
+// 除去日志超级块、描述块和提交块，一个事务至少要放得下一个操作
+#define NFS_JOURNAL_DEFAULT_BLKS 128
+#define NFS_JOURNAL_MIN_BLKS (NFS_JOURNAL_OP_BLKS + 3)
+
+// 超级块的特性位与挂载状态
+#define NFS_FEATURE_CSUM 0x1   // 超级块、位图、inode块和目录项块带CRC32C校验和
+#define NFS_STATE_CLEAN 0x1    // 正常卸载，位图与超级块中的校验和一致
+#define NFS_STATE_MOUNTED 0x2  // 已挂载或未正常卸载，位图的校验和不可信
+
+// inode上尚未写回的内容
+#define NFS_DIRTY_DATA 0x1 // 数据块
+#define NFS_DIRTY_META 0x2 // inode和目录项块(不使用日志时)
+// 后台写回：变脏超过dirty_expire毫秒的inode写回；脏块超过数据区的dirty_ratio%时阻塞写者，超过一半时就开始写回
+#define NFS_DIRTY_EXPIRE_MS 5000
+#define NFS_DIRTY_RATIO 20
+#define NFS_WB_INTERVAL_MS 500 // 后台线程的唤醒周期
+#define NFS_WB_BATCH 16        // 一批最多写回的inode数
+
+/**磁盘布局设计：mkfs.newfs或首次挂载时按磁盘大小规划 */
 // 超级块
 #define NFS_BLKS_SUPER 1
-// 索引节点位图
-#define NFS_BLKS_MAP_INODE 1
-// 数据区位图
-#define NFS_BLKS_MAP_DATA 1
-#define NFS_BLKS_INODE 585
-#define NFS_BLKS_DATA 3508
+// 默认每7KB磁盘空间一个inode：4MB的磁盘得585个inode、3508个数据块，两张位图各占一块
+#define NFS_INODE_RATIO 7168
+// 块大小的范围，须是2的幂且是IO单位的整数倍；默认为两倍IO单位
+#define NFS_MIN_BLK_SZ 1024
+#define NFS_MAX_BLK_SZ 65536
 
 /******************************************************************************
  * SECTION: Macro Function
@@ -70,8 +111,8 @@ typedef enum file_type
 //!!!!
 #define NFS_BLKS_SZ(blks) ((blks) * NFS_BLK_SZ())
 // 计算一个磁盘块可以储存多少dentry
-#define NFS_DENTRY_PER_DATABLK() (NFS_BLK_SZ() / sizeof(struct nfs_dentry))
-#define NFS_DENTRY_D_PER_DATABLK() (NFS_BLK_SZ() / sizeof(struct nfs_dentry_d))
+#define NFS_DENTRY_D_PER_DATABLK() ((NFS_BLK_SZ() - sizeof(uint32_t)) / sizeof(struct nfs_dentry_d)) // 末尾4字节是校验和
+#define NFS_DENTRY_CSUM_OFS() (NFS_BLK_SZ() - sizeof(uint32_t))
 
 // 向下取整
 #define NFS_ROUND_DOWN(value, round) ((value) % (round) == 0 ? (value) : ((value) / (round)) * (round))
@@ -82,6 +123,13 @@ typedef enum file_type
 // 偏移的计算
 #define NFS_INO_OFS(ino) (nfs_super.inode_offset + NFS_BLKS_SZ(ino))
 #define NFS_DATA_OFS(dno) (nfs_super.data_offset + NFS_BLKS_SZ(dno))
+// 地址所在的磁盘块号，日志按块号记录元数据
+#define NFS_BLK_NO(ofs) ((ofs) / NFS_BLK_SZ())
+// 普通文件占用的数据块数，以及文件大小上限
+#define NFS_DATA_BLKS(size) (NFS_ROUND_UP((size), NFS_BLK_SZ()) / NFS_BLK_SZ())
+#define NFS_MAX_FILE_SZ() NFS_BLKS_SZ(NFS_DATA_PER_FILE)
+// open时存入fuse_file_info的句柄
+#define NFS_FH(fi) ((struct nfs_file *)(uintptr_t)(fi)->fh)
 // 判断inode类型
 #define NFS_IS_DIR(pinode) (pinode->dentry->ftype == NFS_DIR)
 #define NFS_IS_REG(pinode) (pinode->dentry->ftype == NFS_FILE)
@@ -92,6 +140,12 @@ typedef enum file_type
 struct custom_options
 {
     const char *device;
+    int lowlevel; // 使用FUSE低层接口(按inode号寻址)
+    double entry_timeout; // 内核缓存目录项的时间(秒)
+    double attr_timeout;  // 内核缓存属性的时间(秒)
+    int journal_blks;     // 首次挂载时划出的日志区大小(块数)，0表示不使用日志
+    int dirty_expire;     // 脏inode在内存中最多停留的时间(毫秒)
+    int dirty_ratio;      // 脏数据块占数据区的百分比上限
 };
 
 struct nfs_inode
@@ -102,9 +156,27 @@ struct nfs_inode
     FILE_TYPE ftype;                       // 文件类型，本次使用中只有目录文件/普通文件两种
     int used_block_num[NFS_DATA_PER_FILE]; // 该inode对应的文件占的数据块的块号。最多是6块
     uint8_t *data[NFS_DATA_PER_FILE];      // 指向数据块的指针，最多指向6个数据块
+    flag16 data_flag[NFS_DATA_PER_FILE];   // 数据块缓存状态，NFS_FLAG_BUF_OCCUPY表示已读入，NFS_FLAG_BUF_DIRTY表示尚未写回
     struct nfs_dentry *dentry;             // 指向该inode的dentry
     struct nfs_dentry *dentrys;            // 如果inode是一个目录文件缩影项目，表示改inode所有目录项
     int dir_cnt;                           // 如果是目录类型文件，下面有几个文件（包括目录文件和普通文件）
+    pthread_rwlock_t dir_lock;             // 目录锁：保护dentrys、dir_cnt及子项的增删
+    pthread_mutex_t lock;                  // 文件锁：保护数据块和size
+    unsigned long nlookup;                 // 内核持有的lookup引用数，由icache_lock保护(低层接口)
+    int nopen;                             // 打开的文件句柄数，由icache_lock保护(高层接口)
+    uint32_t jseq;                         // 最近一次记录该inode元数据的日志事务序号
+    int dirty;                             // NFS_DIRTY_*，以下四项由dirty_lock保护
+    long dirtied_when;                     // 变脏的时间(毫秒)
+    struct nfs_inode *dirty_prev;          // 脏inode链表，按变脏先后排列
+    struct nfs_inode *dirty_next;
+    boolean wb_busy;                       // 后台线程正在写回，释放inode前要等它结束
+};
+
+struct nfs_file
+{
+    struct nfs_inode *inode; // open时解析出的inode，句柄持有一个引用，关闭前不会被释放
+    off_t pos;               // 上一次读写结束的位置；目录为下一个目录项的序号
+    int ra_blks;             // 当前预读窗口(块数)，顺序读时翻倍，随机读时清零
 };
 
 struct nfs_dentry
@@ -117,6 +189,19 @@ struct nfs_dentry
     struct nfs_inode *inode;       // 文件对应的inode（在内存中需要用到）
 };
 
+/* 后台写回的统计，卸载时打印 */
+struct nfs_wb_stats
+{
+    long rounds;      // 写回的批数
+    long inodes;      // 写回的inode数
+    long blocks;      // 写回的块数
+    long ios;         // 合并后下发的写请求数
+    long skipped;     // 正被占用、留到下一轮的inode数
+    long commits;     // 到期提交的日志事务数
+    long throttled;   // 写者因脏块超限被阻塞的次数
+    long throttle_ms; // 累计阻塞的时间
+};
+
 struct nfs_super
 {
     uint32_t magic_num; // 幻数，表名是否是初次挂载
@@ -138,6 +223,31 @@ struct nfs_super
     int map_data_offset; // data位图的起始地址
     int map_data_blks;   // data位图所占的块数
     int data_offset;     // 数据块的起始地址
+    uint8_t *map_dirty;  // 位图的块中改动过、尚未写回或记入日志的，每块一位，inode位图的块在前
+
+    int discard_dnos[NFS_DISCARD_BATCH]; // 已释放、待discard的数据块号
+    int discard_cnt;
+    pthread_mutex_t map_lock;            // 保护两个位图、map_dirty和discard批次
+    pthread_mutex_t load_lock;           // 串行化inode的懒加载
+    struct nfs_inode **inodes;           // ino -> 已缓存的inode，供低层接口按inode号寻址
+    pthread_mutex_t icache_lock;         // 保护nlookup和link，决定inode何时回收
+    boolean splice_fd;                   // 设备是内核字符设备，干净的数据块可让FUSE直接从fd splice
+
+    int journal_offset; // 日志区的起始地址，位于磁盘末尾
+    int journal_blks;   // 日志区所占的块数，0表示不使用日志
+    uint32_t features;  // NFS_FEATURE_*
+
+    pthread_mutex_t dirty_lock;     // 保护脏inode链表和写回统计
+    pthread_cond_t dirty_cond;      // 一批写回结束
+    pthread_cond_t wb_cond;         // 唤醒后台写回线程
+    struct nfs_inode *dirty_head;   // 最早变脏的inode
+    struct nfs_inode *dirty_tail;
+    int nr_dirty;                   // 脏数据块数，原子访问
+    int dirty_expire;               // 见custom_options
+    int dirty_limit;                // 脏数据块上限
+    pthread_t wb_thread;            // 后台写回线程
+    boolean wb_stop;
+    struct nfs_wb_stats wb_stats;
 
     boolean is_mounted;             // 是否挂载
     struct nfs_dentry *root_dentry; // 根目录
@@ -176,6 +286,16 @@ struct nfs_super_d
 
     int data_offset;  // 数据块的起始地址
     int inode_offset; // 索引节点的起始地址
+
+    int journal_offset; // 日志区的起始地址
+    int journal_blks;   // 日志区所占的块数，旧镜像上为0，即不使用日志
+
+    uint32_t features;       // NFS_FEATURE_*，旧镜像上为0，即没有校验和
+    uint32_t state;          // NFS_STATE_*
+    uint32_t map_inode_csum; // 卸载时inode位图的CRC32C
+    uint32_t map_data_csum;  // 卸载时数据位图的CRC32C
+    int sz_blk;              // 逻辑块大小，旧镜像上为0，即两倍IO单位
+    uint32_t csum;           // 超级块自身的CRC32C，计算时此项为0，须是最后一项
 };
 
 struct nfs_inode_d
@@ -186,6 +306,7 @@ struct nfs_inode_d
     FILE_TYPE ftype;                       // 文件类型（目录类型、普通文件类型）
     int used_block_num[NFS_DATA_PER_FILE]; // 该索引节点指向的数据块号
     int dir_cnt;                           // 如果是目录类型文件，下面有几个文件（包括目录文件和普通文件）
+    uint32_t csum;                         // 以上各项的CRC32C，须是最后一项
 };
 
 struct nfs_dentry_d
@@ -195,4 +316,29 @@ struct nfs_dentry_d
     FILE_TYPE ftype;               // 文件类型
 };
 
+/* 日志区第0块：从start处、序号为seq的事务开始重放 */
+struct nfs_journal_d
+{
+    uint32_t magic;
+    uint32_t seq;  // 第一个需要重放的事务序号
+    int start;     // 该事务在日志区中的块号
+};
+
+/* 一个事务在日志区中连续存放：描述块 + cnt个元数据块映像 + 提交块 */
+struct nfs_jdesc_d
+{
+    uint32_t magic;
+    uint32_t seq;
+    int cnt;      // 其后的块映像数
+    int nrevoke;  // 撤销的块数
+    int blknos[]; // cnt个映像对应的磁盘块号，之后是nrevoke个被撤销的块号
+};
+
+struct nfs_jcommit_d
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t csum; // 描述块与全部映像的CRC32C，写入不完整的事务在重放时丢弃
+};
+
 #endif
\ No newline at end of file
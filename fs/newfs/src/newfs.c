@@ -11,36 +11,44 @@
 /******************************************************************************
  * SECTION: 全局变量
  *******************************************************************************/
-static const struct fuse_opt option_spec[] = {/* 用于FUSE文件系统解析参数 */
-											  OPTION("--device=%s", device),
-											  FUSE_OPT_END};
-
 struct custom_options newfs_options; /* 全局选项 */
 extern struct nfs_super nfs_super;
-/******************************************************************************
- * SECTION: FUSE操作定义
- *******************************************************************************/
-static struct fuse_operations operations = {
-	.init = newfs_init,		  /* mount文件系统 */
-	.destroy = newfs_destroy, /* umount文件系统 */
-	.mkdir = newfs_mkdir,	  /* 建目录，mkdir */
-	.getattr = newfs_getattr, /* 获取文件属性，类似stat，必须完成 */
-	.readdir = newfs_readdir, /* 填充dentrys */
-	.mknod = newfs_mknod,	  /* 创建文件，touch相关 */
-	.write = NULL,			  /* 写入文件 */
-	.read = NULL,			  /* 读文件 */
-	.utimens = newfs_utimens, /* 修改时间，忽略，避免touch报错 */
-	.truncate = NULL,		  /* 改变文件大小 */
-	.unlink = NULL,			  /* 删除文件 */
-	.rmdir = NULL,			  /* 删除目录， rm -r */
-	.rename = NULL,			  /* 重命名，mv */
-
-	.open = NULL,
-	.opendir = NULL,
-	.access = NULL};
 /******************************************************************************
  * SECTION: 必做函数实现
  *******************************************************************************/
+/**
+ * @brief 与内核协商缓存相关能力，高层和低层接口共用：
+ * 大块读写、异步读，FUSE 3下再打开内核writeback cache，
+ * 小写入先在页缓存合并，按页成批下发；
+ * 文件数据以fuse_bufvec交接，内核支持时允许经由管道splice，省去/dev/fuse上的拷贝
+ *
+ * @param conn_info 连接信息
+ */
+void newfs_conn_init(struct fuse_conn_info *conn_info)
+{
+	if (conn_info == NULL)
+	{
+		return; // 不经过内核、进程内直接调用时没有连接
+	}
+#if FUSE_USE_VERSION >= 30
+	if (conn_info->capable & FUSE_CAP_WRITEBACK_CACHE)
+	{
+		conn_info->want |= FUSE_CAP_WRITEBACK_CACHE;
+	}
+	if (conn_info->capable & FUSE_CAP_ASYNC_READ)
+	{
+		conn_info->want |= FUSE_CAP_ASYNC_READ;
+	}
+	conn_info->max_read = NFS_FUSE_MAX_IO; // 须与挂载参数max_read一致
+#else
+	conn_info->async_read = 1;
+#endif
+	conn_info->want |= conn_info->capable &
+					   (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	conn_info->max_write = NFS_FUSE_MAX_IO;
+	conn_info->max_readahead = NFS_FUSE_MAX_IO;
+}
+
 /**
  * @brief 挂载（mount）文件系统
  *
@@ -50,6 +58,7 @@ static struct fuse_operations operations = {
 void *newfs_init(struct fuse_conn_info *conn_info)
 {
 	/* TODO: 在这里进行挂载 */
+	newfs_conn_init(conn_info);
 	if (nfs_mount(newfs_options) != NFS_ERROR_NONE)
 	{
 		NFS_DBG("[%s] mount error\n", __func__);
@@ -77,6 +86,24 @@ void newfs_destroy(void *p)
 	return;
 }
 
+/**
+ * @brief nfs_lookup没有拿到目标时放掉它持有的锁，并给出错误号：
+ * 路径上某个inode读不出(is_find为TRUE)时为-EIO，否则为不存在
+ *
+ * @param dentry nfs_lookup的返回值
+ * @param is_find
+ * @param locked nfs_lookup返回时持有的锁
+ * @return int
+ */
+static int nfs_lookup_err(struct nfs_dentry *dentry, boolean is_find, struct nfs_inode *locked)
+{
+	if (dentry != NULL)
+	{
+		nfs_dir_unlock(locked);
+	}
+	return is_find ? -NFS_ERROR_IO : -NFS_ERROR_NOTFOUND;
+}
+
 /**
  * @brief 创建目录
  *
@@ -92,64 +119,68 @@ int newfs_mkdir(const char *path, mode_t mode)
 	/* TODO: 解析路径，创建目录 */
 	(void)mode;
 	boolean is_find, is_root;
-	char *fname;
-	struct nfs_dentry *last_dentry = nfs_lookup(path, &is_find, &is_root);
+	struct nfs_inode *locked;
+	struct nfs_dentry *last_dentry;
 	struct nfs_dentry *dentry;
-	struct nfs_inode *inode;
+	int ret = NFS_ERROR_NONE;
 
+	nfs_journal_start(NFS_JOURNAL_OP_BLKS); // 先于目录锁
+	last_dentry = nfs_lookup(path, &is_find, &is_root, &locked, TRUE);
+	if (last_dentry == NULL)
+	{
+		nfs_journal_stop();
+		return nfs_lookup_err(last_dentry, is_find, locked);
+	}
+	// 父目录已加写锁，检查与创建之间不会有同名项插入
 	if (is_find)
 	{
-		return -NFS_ERROR_EXISTS;
+		ret = -NFS_ERROR_EXISTS;
+		goto out;
 	}
 	// 最后一级目录是文件则无法再创建目录
 	if (NFS_IS_REG(last_dentry->inode))
 	{
-		return -NFS_ERROR_UNSUPPORTED;
-	}
-
-	//限制一个目录下最多能创建的文件数量
-	if((last_dentry->inode->dir_cnt+1)>max_dentrys_2_inode){
-		return -NFS_ERROR_UNSUPPORTED;
+		ret = -NFS_ERROR_UNSUPPORTED;
+		goto out;
 	}
 
-	fname = nfs_get_fname(path);
-	dentry = new_dentry(fname, NFS_DIR);
-
-	dentry->parent = last_dentry; 
-
-	inode = nfs_alloc_inode(dentry);
-
 	// 将新建的目录添加到父目录的inode当中
-	nfs_alloc_dentry(last_dentry->inode, dentry, 1);
+	ret = nfs_make_node(last_dentry->inode, nfs_get_fname(path), NFS_DIR, &dentry);
 
-	return NFS_ERROR_NONE;
+out:
+	nfs_dir_unlock(locked);
+	nfs_journal_stop();
+	return ret;
 }
 
 /**
- * @brief 获取文件或目录的属性，该函数非常重要
+ * @brief 按inode填充属性，getattr和fgetattr共用
  *
- * @param path 相对于挂载点的路径
- * @param newfs_stat 返回状态
- * @return int 0成功，否则返回对应错误号
+ * @param inode
+ * @param nfs_stat 返回状态
+ * @param dir_locked 调用者是否已持有该目录自身的锁
  */
-int newfs_getattr(const char *path, struct stat *nfs_stat)
+static void nfs_fill_stat(struct nfs_inode *inode, struct stat *nfs_stat, boolean dir_locked)
 {
-	/* TODO: 解析路径，获取Inode，填充newfs_stat，可参考/fs/simplefs/sfs.c的sfs_getattr()函数实现 */
-	boolean is_find, is_root;
-	struct nfs_dentry *dentry = nfs_lookup(path, &is_find, &is_root);
-	if (is_find == FALSE)
-	{
-		return -NFS_ERROR_NOTFOUND;
-	}
-	if (NFS_IS_DIR(dentry->inode))
+	if (NFS_IS_DIR(inode))
 	{
 		nfs_stat->st_mode = S_IFDIR | NFS_DEFAULT_PERM; // 文件的模式，包括文件的权限、文件类型
-		nfs_stat->st_size = dentry->inode->dir_cnt * sizeof(struct nfs_dentry_d);
+		if (!dir_locked)
+		{
+			nfs_dir_lock(inode, FALSE); // dir_cnt由目录自身的锁保护
+		}
+		nfs_stat->st_size = inode->dir_cnt * sizeof(struct nfs_dentry_d);
+		if (!dir_locked)
+		{
+			nfs_dir_unlock(inode);
+		}
 	}
-	else if (NFS_IS_REG(dentry->inode))
+	else if (NFS_IS_REG(inode))
 	{
 		nfs_stat->st_mode = S_IFREG | NFS_DEFAULT_PERM;
-		nfs_stat->st_size = dentry->inode->size;
+		pthread_mutex_lock(&inode->lock);
+		nfs_stat->st_size = inode->size;
+		pthread_mutex_unlock(&inode->lock);
 	}
 	nfs_stat->st_nlink = 1;
 	nfs_stat->st_uid = getuid();
@@ -158,12 +189,51 @@ int newfs_getattr(const char *path, struct stat *nfs_stat)
 	nfs_stat->st_atime = time(NULL); // 文件最近一次访问时间
 	nfs_stat->st_mtime = time(NULL); // 文件最近一次修改时间
 
-	if (is_root)
+	if (inode->ino == NFS_ROOT_INO)
 	{
 		nfs_stat->st_size = nfs_super.sz_usage;
 		nfs_stat->st_blocks = NFS_DISK_SZ() / NFS_BLK_SZ(); // 文件所占的块数
 		nfs_stat->st_nlink = 2;								/* !特殊，根目录link数为2 */
 	}
+}
+
+/**
+ * @brief 获取文件或目录的属性，该函数非常重要
+ *
+ * @param path 相对于挂载点的路径
+ * @param newfs_stat 返回状态
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_getattr(const char *path, struct stat *nfs_stat)
+{
+	/* TODO: 解析路径，获取Inode，填充newfs_stat，可参考/fs/simplefs/sfs.c的sfs_getattr()函数实现 */
+	boolean is_find, is_root;
+	struct nfs_inode *locked;
+	struct nfs_dentry *dentry = nfs_lookup(path, &is_find, &is_root, &locked, FALSE);
+	if (dentry == NULL || is_find == FALSE)
+	{
+		return nfs_lookup_err(dentry, is_find, locked);
+	}
+	nfs_fill_stat(dentry->inode, nfs_stat, locked == dentry->inode);
+	nfs_dir_unlock(locked);
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 按打开的句柄获取属性(fstat)，不解析路径
+ *
+ * @param path 相对于挂载点的路径，可为NULL
+ * @param newfs_stat 返回状态
+ * @param fi 文件信息，句柄在fi->fh中
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fgetattr(const char *path, struct stat *nfs_stat, struct fuse_file_info *fi)
+{
+	if (fi == NULL || fi->fh == 0)
+	{
+		return newfs_getattr(path, nfs_stat);
+	}
+	nfs_fill_stat(NFS_FH(fi)->inode, nfs_stat, FALSE);
 	return NFS_ERROR_NONE;
 }
 
@@ -182,12 +252,11 @@ int newfs_getattr(const char *path, struct stat *nfs_stat)
  * off: 下一次offset从哪里开始，这里可以理解为第几个dentry
  *
  * @param offset 第几个目录项？
- * @param fi 可忽略
+ * @param fi 文件信息，opendir过的句柄在fi->fh中
  * @return int 0成功，否则返回对应错误号
  */
-//ls显示最新创建的几个文件
-int nums = 100000;
-int now_nums = 0;
+//ls最多显示的目录项数目；只读，多线程下无需加锁
+const int nums = 100000;
 
 int newfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 				  struct fuse_file_info *fi)
@@ -195,36 +264,56 @@ int newfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 	/* TODO: 解析路径，获取目录的Inode，并读取目录项，利用filler填充到buf，可参考/fs/simplefs/sfs.c的sfs_readdir()函数实现 */
 	boolean is_find, is_root;
 	int cur_dir = offset;
-	if(offset == 0){
-		nums = 100000;
-		now_nums = 0;
-	}
 
 	/* 解析父目录路径 */
-	struct nfs_dentry *dentry = nfs_lookup(path, &is_find, &is_root);
+	struct nfs_inode *locked;
+	struct nfs_dentry *dentry;
 	struct nfs_dentry *sub_dentry;
 	struct nfs_inode *inode;
+
+	/* opendir过的直接用句柄中的目录，不再解析路径 */
+	if (fi != NULL && fi->fh != 0)
+	{
+		inode = NFS_FH(fi)->inode;
+		nfs_dir_lock(inode, FALSE);
+		goto fill;
+	}
+	dentry = nfs_lookup(path, &is_find, &is_root, &locked, FALSE);
+	if (dentry == NULL || is_find == FALSE)
+	{
+		return nfs_lookup_err(dentry, is_find, locked);
+	}
 	printf("*****readdir %s\n", dentry->fname);
-	printf("*****offset %d  is_find %d is_root %d\n", offset, is_find, is_root);
-	if (is_find)
+	printf("*****offset %d  is_find %d is_root %d\n", (int)offset, is_find, is_root);
+	inode = dentry->inode;
+	if (!NFS_IS_DIR(inode))
 	{
-		inode = dentry->inode;
-		/* 根据offset获取到对应的子文件名 */
-		printf("*****cur_dir %d\n", cur_dir);
-		sub_dentry = nfs_get_dentry(inode, cur_dir);
-		if (sub_dentry)
-		{	
-			now_nums++;
-			if(now_nums>nums){
-				return -NFS_ERROR_NOTFOUND;
-			}
-			printf("***** subentry->fname:%s\n", sub_dentry->fname);
-			/* 直接调用filler来装填结果 */
-			filler(buf, sub_dentry->fname, NULL, ++offset);
-		}
-		return NFS_ERROR_NONE;
+		nfs_dir_unlock(locked);
+		return -ENOTDIR;
+	}
+	/* 换成目录自身的读锁(根目录已持有)，父目录锁保证它在加锁前不被删除 */
+	if (locked != inode)
+	{
+		nfs_dir_lock(inode, FALSE);
+		nfs_dir_unlock(locked);
+	}
+
+fill:
+	/* 根据offset获取到对应的子文件名 */
+	printf("*****cur_dir %d\n", cur_dir);
+	sub_dentry = cur_dir < nums ? nfs_get_dentry(inode, cur_dir) : NULL;
+	if (sub_dentry)
+	{	
+		printf("***** subentry->fname:%s\n", sub_dentry->fname);
+		/* 直接调用filler来装填结果 */
+		NFS_FILLER(filler, buf, sub_dentry->fname, NULL, ++offset);
+	}
+	if (fi != NULL && fi->fh != 0)
+	{
+		NFS_FH(fi)->pos = offset; // 同一句柄上的readdir由内核串行化
 	}
-	return -NFS_ERROR_NOTFOUND;
+	nfs_dir_unlock(inode);
+	return NFS_ERROR_NONE;
 }
 
 /**
@@ -239,39 +328,30 @@ int newfs_mknod(const char *path, mode_t mode, dev_t dev)
 {
 	/* TODO: 解析路径，并创建相应的文件 */
 	boolean is_find, is_root;
-	struct nfs_dentry *last_dentry = nfs_lookup(path, &is_find, &is_root);
+	struct nfs_inode *locked;
+	struct nfs_dentry *last_dentry;
+	struct nfs_dentry *dentry;
+	int ret = NFS_ERROR_NONE;
 
-	//限制一个目录下最多能创建的文件数量
-	if((last_dentry->inode->dir_cnt+1)>max_dentrys_2_inode){
-		return -NFS_ERROR_UNSUPPORTED;
+	nfs_journal_start(NFS_JOURNAL_OP_BLKS);
+	last_dentry = nfs_lookup(path, &is_find, &is_root, &locked, TRUE);
+	if (last_dentry == NULL)
+	{
+		nfs_journal_stop();
+		return nfs_lookup_err(last_dentry, is_find, locked);
 	}
-
-
-	struct nfs_dentry *dentry;
-	struct nfs_inode *inode;
-	char *fname;
 	// 同名文件已经存在
 	if (is_find == TRUE)
 	{
-		return -NFS_ERROR_EXISTS;
-	}
-	fname = nfs_get_fname(path);
-	if (S_ISREG(mode))
-	{
-		dentry = new_dentry(fname, NFS_FILE);
-	}
-	else if (S_ISDIR(mode))
-	{
-		dentry = new_dentry(fname, NFS_DIR);
+		ret = -NFS_ERROR_EXISTS;
+		goto out;
 	}
-	else
-	{
-		dentry = new_dentry(fname, NFS_FILE);
-	}
-	dentry->parent = last_dentry;
-	inode = nfs_alloc_inode(dentry);//inode位图修改
-	nfs_alloc_dentry(last_dentry->inode, dentry, 1);//数据位图修改
-	return NFS_ERROR_NONE;
+	ret = nfs_make_node(last_dentry->inode, nfs_get_fname(path),
+						S_ISDIR(mode) ? NFS_DIR : NFS_FILE, &dentry);
+out:
+	nfs_dir_unlock(locked);
+	nfs_journal_stop();
+	return ret;
 }
 
 /**
@@ -289,6 +369,42 @@ int newfs_utimens(const char *path, const struct timespec tv[2])
 /******************************************************************************
  * SECTION: 选做函数实现
  *******************************************************************************/
+/**
+ * @brief 取得读写的目标文件：open过的直接用句柄中的inode，不再解析路径；
+ * 没有句柄时按路径查找，成功时持有其父目录的读锁，期间文件不会被删除
+ *
+ * @param path 相对于挂载点的路径，有句柄时可为NULL
+ * @param fi 文件信息，可为NULL
+ * @param locked 返回时持有的目录锁，使用句柄时为NULL，可据此判断句柄是否存在
+ * @param err 失败时的错误号
+ * @return struct nfs_inode*
+ */
+static struct nfs_inode *nfs_get_file(const char *path, struct fuse_file_info *fi,
+									  struct nfs_inode **locked, int *err)
+{
+	boolean is_find, is_root;
+	struct nfs_dentry *dentry;
+
+	if (fi != NULL && fi->fh != 0)
+	{
+		*locked = NULL;
+		return NFS_FH(fi)->inode;
+	}
+	dentry = nfs_lookup(path, &is_find, &is_root, locked, FALSE);
+	if (dentry == NULL || is_find == FALSE)
+	{
+		*err = nfs_lookup_err(dentry, is_find, *locked);
+		return NULL;
+	}
+	if (NFS_IS_DIR(dentry->inode))
+	{
+		nfs_dir_unlock(*locked);
+		*err = -NFS_ERROR_ISDIR;
+		return NULL;
+	}
+	return dentry->inode;
+}
+
 /**
  * @brief 写入文件
  *
@@ -296,14 +412,50 @@ int newfs_utimens(const char *path, const struct timespec tv[2])
  * @param buf 写入的内容
  * @param size 写入的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi 文件信息，open过的句柄在fi->fh中
  * @return int 写入大小
  */
 int newfs_write(const char *path, const char *buf, size_t size, off_t offset,
 				struct fuse_file_info *fi)
 {
-	/* 选做 */
-	return size;
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+	src.buf[0].mem = (void *)buf;
+	return newfs_write_buf(path, &src, offset, fi);
+}
+
+/**
+ * @brief 写入文件，FUSE给出的数据(请求缓冲区或splice管道)直接拷入缓存块
+ *
+ * @param path 相对于挂载点的路径
+ * @param buf 写入的内容
+ * @param offset 相对文件的偏移
+ * @param fi 文件信息，open过的句柄在fi->fh中
+ * @return int 写入大小
+ */
+int newfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+					struct fuse_file_info *fi)
+{
+	struct nfs_inode *locked;
+	struct nfs_inode *inode;
+	int ret;
+
+	nfs_journal_start(NFS_JOURNAL_OP_BLKS); // 扩展文件时改动inode和数据位图
+	inode = nfs_get_file(path, fi, &locked, &ret);
+	if (inode == NULL)
+	{
+		nfs_journal_stop();
+		return ret;
+	}
+	pthread_mutex_lock(&inode->lock);
+	ret = nfs_file_write_buf(inode, locked == NULL ? NFS_FH(fi) : NULL, buf, offset);
+	pthread_mutex_unlock(&inode->lock);
+	if (locked != NULL)
+	{
+		nfs_dir_unlock(locked);
+	}
+	nfs_journal_stop();
+	nfs_balance_dirty(); // 脏块过多时等后台线程写回
+	return ret;
 }
 
 /**
@@ -313,14 +465,88 @@ int newfs_write(const char *path, const char *buf, size_t size, off_t offset,
  * @param buf 读取的内容
  * @param size 读取的字节数
  * @param offset 相对文件的偏移
- * @param fi 可忽略
+ * @param fi 文件信息，open过的句柄在fi->fh中
  * @return int 读取大小
  */
 int newfs_read(const char *path, char *buf, size_t size, off_t offset,
 			   struct fuse_file_info *fi)
 {
-	/* 选做 */
-	return size;
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	struct fuse_bufvec *src;
+	struct nfs_inode *locked;
+	int ret;
+	struct nfs_inode *inode = nfs_get_file(path, fi, &locked, &ret);
+	if (inode == NULL)
+	{
+		return ret;
+	}
+	dst.buf[0].mem = buf;
+	pthread_mutex_lock(&inode->lock);
+	src = nfs_file_read_buf(inode, locked == NULL ? NFS_FH(fi) : NULL, size, offset, TRUE);
+	ret = src != NULL ? fuse_buf_copy(&dst, src, 0) : -NFS_ERROR_IO;
+	pthread_mutex_unlock(&inode->lock);
+	if (locked != NULL)
+	{
+		nfs_dir_unlock(locked);
+	}
+	free(src);
+	return ret;
+}
+
+/**
+ * @brief 读取文件，不拷到FUSE的缓冲区，而是交给它一组片段：
+ * 设备上的干净数据由FUSE直接从设备fd splice，其余复制一份由FUSE释放。
+ * fd片段在放锁之后才被读取：并发的写只落在缓存里，读到的是写之前的数据；
+ * 并发截断释放的块若已被重新分配并写回，读到的内容不确定，与读、截断同时进行的语义一致
+ *
+ * @param path 相对于挂载点的路径
+ * @param bufp 返回的片段
+ * @param size 读取的字节数
+ * @param offset 相对文件的偏移
+ * @param fi 文件信息，open过的句柄在fi->fh中
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+				   struct fuse_file_info *fi)
+{
+	struct nfs_inode *locked;
+	int ret;
+	struct nfs_inode *inode = nfs_get_file(path, fi, &locked, &ret);
+	if (inode == NULL)
+	{
+		return ret;
+	}
+	pthread_mutex_lock(&inode->lock);
+	*bufp = nfs_file_read_buf(inode, locked == NULL ? NFS_FH(fi) : NULL, size, offset, FALSE);
+	pthread_mutex_unlock(&inode->lock);
+	if (locked != NULL)
+	{
+		nfs_dir_unlock(locked);
+	}
+	return *bufp != NULL ? NFS_ERROR_NONE : -NFS_ERROR_IO;
+}
+
+/**
+ * @brief 从父目录摘除dentry并删除其inode，调用者持有父目录的写锁；
+ * 仍有打开的句柄时只摘除，inode及其空间在最后一次release时释放
+ *
+ * @param dentry
+ */
+static void nfs_remove_dentry(struct nfs_dentry *dentry)
+{
+	struct nfs_inode *inode = dentry->inode;
+	boolean free_now;
+
+	nfs_drop_dentry(dentry->parent->inode, dentry);
+	pthread_mutex_lock(&nfs_super.icache_lock);
+	inode->link = 0;
+	free_now = inode->nopen == 0;
+	pthread_mutex_unlock(&nfs_super.icache_lock);
+	if (free_now)
+	{
+		nfs_free_inode(inode);
+		free(dentry);
+	}
 }
 
 /**
@@ -331,8 +557,30 @@ int newfs_read(const char *path, char *buf, size_t size, off_t offset,
  */
 int newfs_unlink(const char *path)
 {
-	/* 选做 */
-	return 0;
+	boolean is_find, is_root;
+	struct nfs_inode *locked;
+	struct nfs_dentry *dentry;
+	int ret = NFS_ERROR_NONE;
+
+	nfs_journal_start(NFS_JOURNAL_OP_BLKS);
+	dentry = nfs_lookup(path, &is_find, &is_root, &locked, TRUE);
+	if (dentry == NULL || is_find == FALSE)
+	{
+		ret = nfs_lookup_err(dentry, is_find, locked);
+		nfs_journal_stop();
+		return ret;
+	}
+	if (NFS_IS_DIR(dentry->inode))
+	{
+		ret = -NFS_ERROR_ISDIR;
+		goto out;
+	}
+	/* 父目录写锁下没有其他线程能再拿到该文件；释放的数据块会攒批下发discard */
+	nfs_remove_dentry(dentry);
+out:
+	nfs_dir_unlock(locked);
+	nfs_journal_stop();
+	return ret;
 }
 
 /**
@@ -349,8 +597,44 @@ int newfs_unlink(const char *path)
  */
 int newfs_rmdir(const char *path)
 {
-	/* 选做 */
-	return 0;
+	boolean is_find, is_root;
+	struct nfs_inode *locked;
+	struct nfs_dentry *dentry;
+	int dir_cnt;
+	int ret = NFS_ERROR_NONE;
+
+	nfs_journal_start(NFS_JOURNAL_OP_BLKS);
+	dentry = nfs_lookup(path, &is_find, &is_root, &locked, TRUE);
+	if (dentry == NULL || is_find == FALSE)
+	{
+		ret = nfs_lookup_err(dentry, is_find, locked);
+		nfs_journal_stop();
+		return ret;
+	}
+	if (is_root)
+	{
+		ret = -NFS_ERROR_ACCESS;
+		goto out;
+	}
+	if (!NFS_IS_DIR(dentry->inode))
+	{
+		ret = -ENOTDIR;
+		goto out;
+	}
+	/* 等待目录内正在进行的操作结束；父目录持有写锁，之后不会再有新的进入 */
+	nfs_dir_lock(dentry->inode, TRUE);
+	dir_cnt = dentry->inode->dir_cnt;
+	nfs_dir_unlock(dentry->inode);
+	if (dir_cnt != 0)
+	{
+		ret = -NFS_ERROR_NOTEMPTY;
+		goto out;
+	}
+	nfs_remove_dentry(dentry);
+out:
+	nfs_dir_unlock(locked);
+	nfs_journal_stop();
+	return ret;
 }
 
 /**
@@ -370,14 +654,25 @@ int newfs_rename(const char *from, const char *to)
  * @brief 打开文件，可以在这里维护fi的信息，例如，fi->fh可以理解为一个64位指针，可以把自己想保存的数据结构
  * 保存在fh中
  *
+ * 只在这里解析一次路径，之后的读写、flush、release都经由句柄找到inode，与路径深度无关
+ *
  * @param path 相对于挂载点的路径
  * @param fi 文件信息
  * @return int 0成功，否则返回对应错误号
  */
 int newfs_open(const char *path, struct fuse_file_info *fi)
 {
-	/* 选做 */
-	return 0;
+	struct nfs_inode *locked;
+	int ret;
+	struct nfs_inode *inode = nfs_get_file(path, NULL, &locked, &ret);
+	if (inode == NULL)
+	{
+		return ret;
+	}
+	/* 父目录锁下取引用，之后即使被unlink，inode也保留到release */
+	fi->fh = (uint64_t)(uintptr_t)nfs_file_open(inode);
+	nfs_dir_unlock(locked);
+	return NFS_ERROR_NONE;
 }
 
 /**
@@ -389,8 +684,114 @@ int newfs_open(const char *path, struct fuse_file_info *fi)
  */
 int newfs_opendir(const char *path, struct fuse_file_info *fi)
 {
-	/* 选做 */
-	return 0;
+	boolean is_find, is_root;
+	struct nfs_inode *locked;
+	struct nfs_dentry *dentry = nfs_lookup(path, &is_find, &is_root, &locked, FALSE);
+	if (dentry == NULL || is_find == FALSE)
+	{
+		return nfs_lookup_err(dentry, is_find, locked);
+	}
+	if (!NFS_IS_DIR(dentry->inode))
+	{
+		nfs_dir_unlock(locked);
+		return -ENOTDIR;
+	}
+	fi->fh = (uint64_t)(uintptr_t)nfs_file_open(dentry->inode);
+	nfs_dir_unlock(locked);
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 关闭文件描述符时调用。不写回：脏块由后台线程按dirty_expire写回，
+ * 需要落盘的由fsync负责，close不必等设备
+ *
+ * @param path 相对于挂载点的路径，可为NULL
+ * @param fi 文件信息，句柄在fi->fh中
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_flush(const char *path, struct fuse_file_info *fi)
+{
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief fsync/fdatasync，只写该文件自己的脏块和改动过的元数据，见nfs_fsync_inode
+ *
+ * @param path 相对于挂载点的路径，可为NULL
+ * @param datasync 非0时为fdatasync
+ * @param fi 文件信息，句柄在fi->fh中
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	if (fi->fh == 0)
+	{
+		return NFS_ERROR_NONE;
+	}
+	return nfs_fsync_inode(NFS_FH(fi)->inode);
+}
+
+/**
+ * @brief 目录的fsync，写回目录的inode和目录项块，或等记录它们的日志事务提交
+ *
+ * @param path 相对于挂载点的路径，可为NULL
+ * @param datasync 非0时为fdatasync
+ * @param fi 文件信息，句柄在fi->fh中
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	return newfs_fsync(path, datasync, fi);
+}
+
+/**
+ * @brief ioctl，只支持读取设备统计，见nfs_driver_ioctl；挂载点或任一文件上都可以发出
+ *
+ * @param path 相对于挂载点的路径，可为NULL
+ * @param cmd 命令
+ * @param arg 用户态地址，不使用
+ * @param fi 文件信息
+ * @param flags FUSE_IOCTL_*
+ * @param data libfuse按_IOC_SIZE(cmd)准备的缓冲区
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+				unsigned int flags, void *data)
+{
+	if (flags & FUSE_IOCTL_COMPAT)
+	{
+		return -ENOSYS;
+	}
+	return nfs_driver_ioctl((unsigned int)cmd, data); // _IOR的最高位为1，不能符号扩展
+}
+
+/**
+ * @brief 文件的最后一个描述符关闭，释放句柄
+ *
+ * @param path 相对于挂载点的路径，可为NULL
+ * @param fi 文件信息，句柄在fi->fh中
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_release(const char *path, struct fuse_file_info *fi)
+{
+	if (fi->fh != 0)
+	{
+		nfs_file_close(NFS_FH(fi));
+		fi->fh = 0;
+	}
+	return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 关闭目录，释放句柄
+ *
+ * @param path 相对于挂载点的路径，可为NULL
+ * @param fi 文件信息，句柄在fi->fh中
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	return newfs_release(path, fi);
 }
 
 /**
@@ -402,8 +803,46 @@ int newfs_opendir(const char *path, struct fuse_file_info *fi)
  */
 int newfs_truncate(const char *path, off_t offset)
 {
-	/* 选做 */
-	return 0;
+	return newfs_ftruncate(path, offset, NULL);
+}
+
+/**
+ * @brief 按打开的句柄改变文件大小(ftruncate)
+ *
+ * @param path 相对于挂载点的路径，有句柄时可为NULL
+ * @param offset 改变后文件大小
+ * @param fi 文件信息，可为NULL
+ * @return int 0成功，否则返回对应错误号
+ */
+int newfs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+	struct nfs_inode *locked;
+	struct nfs_inode *inode;
+	int ret;
+
+	nfs_journal_start(NFS_JOURNAL_OP_BLKS);
+	inode = nfs_get_file(path, fi, &locked, &ret);
+	if (inode == NULL)
+	{
+		nfs_journal_stop();
+		return ret;
+	}
+	if (offset > NFS_MAX_FILE_SZ())
+	{
+		ret = -NFS_ERROR_FBIG;
+	}
+	else
+	{
+		pthread_mutex_lock(&inode->lock);
+		ret = nfs_file_resize(inode, offset);
+		pthread_mutex_unlock(&inode->lock);
+	}
+	if (locked != NULL)
+	{
+		nfs_dir_unlock(locked);
+	}
+	nfs_journal_stop();
+	return ret;
 }
 
 /**
@@ -426,17 +865,130 @@ int newfs_access(const char *path, int type)
 /******************************************************************************
  * SECTION: FUSE入口
  *******************************************************************************/
+/**
+ * @brief 全局选项的默认值：main在解析命令行之前设置，
+ * 以库(NEWFS_LIBRARY，没有main)链接的进程内调用方在改写设备等选项之前设置
+ */
+void newfs_default_options()
+{
+	newfs_options.device = strdup("TODO: 这里填写你的ddriver设备路径");
+	newfs_options.entry_timeout = NFS_DEFAULT_TIMEOUT;
+	newfs_options.attr_timeout = NFS_DEFAULT_TIMEOUT;
+	newfs_options.journal_blks = NFS_JOURNAL_DEFAULT_BLKS;
+	newfs_options.dirty_expire = NFS_DIRTY_EXPIRE_MS;
+	newfs_options.dirty_ratio = NFS_DIRTY_RATIO;
+}
+
+#ifndef NEWFS_LIBRARY
+static const struct fuse_opt option_spec[] = {/* 用于FUSE文件系统解析参数 */
+											  OPTION("--device=%s", device),
+											  OPTION("--lowlevel", lowlevel),
+											  OPTION("--entry_timeout=%lf", entry_timeout),
+											  OPTION("--attr_timeout=%lf", attr_timeout),
+											  OPTION("--journal_blks=%d", journal_blks),
+											  OPTION("--dirty_expire=%d", dirty_expire),
+											  OPTION("--dirty_ratio=%d", dirty_ratio),
+											  FUSE_OPT_END};
+
+/******************************************************************************
+ * SECTION: FUSE 3适配，转调FUSE 2签名的实现
+ *******************************************************************************/
+#if FUSE_USE_VERSION >= 30
+static void *newfs_init_v3(struct fuse_conn_info *conn_info, struct fuse_config *cfg)
+{
+	cfg->nullpath_ok = 1; // 带句柄的操作不需要libfuse拼路径
+	return newfs_init(conn_info);
+}
+
+static int newfs_getattr_v3(const char *path, struct stat *nfs_stat, struct fuse_file_info *fi)
+{
+	return newfs_fgetattr(path, nfs_stat, fi);
+}
+
+static int newfs_readdir_v3(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+							struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	return newfs_readdir(path, buf, filler, offset, fi);
+}
+
+static int newfs_utimens_v3(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+{
+	return newfs_utimens(path, tv);
+}
+
+static int newfs_truncate_v3(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+	return newfs_ftruncate(path, offset, fi);
+}
+
+#define NFS_OP(op) op##_v3
+#else
+#define NFS_OP(op) op
+#endif
+/******************************************************************************
+ * SECTION: FUSE操作定义
+ *******************************************************************************/
+static struct fuse_operations operations = {
+	.init = NFS_OP(newfs_init),		  /* mount文件系统 */
+	.destroy = newfs_destroy,		  /* umount文件系统 */
+	.mkdir = newfs_mkdir,			  /* 建目录，mkdir */
+	.getattr = NFS_OP(newfs_getattr), /* 获取文件属性，类似stat，必须完成 */
+	.readdir = NFS_OP(newfs_readdir), /* 填充dentrys */
+	.mknod = newfs_mknod,			  /* 创建文件，touch相关 */
+	.write = newfs_write,			  /* 写入文件 */
+	.read = newfs_read,				  /* 读文件 */
+	.write_buf = newfs_write_buf,	  /* 写入文件，数据直接拷入缓存块 */
+	.read_buf = newfs_read_buf,		  /* 读文件，交给FUSE片段而不是拷贝 */
+	.utimens = NFS_OP(newfs_utimens), /* 修改时间，忽略，避免touch报错 */
+	.truncate = NFS_OP(newfs_truncate), /* 改变文件大小 */
+	.unlink = newfs_unlink,	  /* 删除文件 */
+	.rmdir = newfs_rmdir,	  /* 删除目录， rm -r */
+	.rename = NULL,			  /* 重命名，mv */
+
+	.open = newfs_open,		  /* 解析一次路径，把句柄存入fi->fh */
+	.opendir = newfs_opendir, /* 同上，目录句柄 */
+	.flush = newfs_flush,	  /* close时不写回，交给后台线程 */
+	.release = newfs_release, /* 释放句柄 */
+	.releasedir = newfs_releasedir,
+	.fsync = newfs_fsync,		  /* 只写该文件自己的脏块和元数据 */
+	.fsyncdir = newfs_fsyncdir,
+	.ioctl = newfs_ioctl,		  /* 读取设备统计，供基准测试使用 */
+#if FUSE_USE_VERSION < 30
+	.fgetattr = newfs_fgetattr,	  /* fstat，按句柄取属性 */
+	.ftruncate = newfs_ftruncate, /* 按句柄改变文件大小 */
+	.flag_nopath = 1,			  /* 带句柄的操作不需要libfuse拼路径 */
+#endif
+	.access = NULL};
+/******************************************************************************
+ * SECTION: main函数
+ *******************************************************************************/
 int main(int argc, char **argv)
 {
 	int ret;
+	char opt[64];
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-	newfs_options.device = strdup("TODO: 这里填写你的ddriver设备路径");
-
+	newfs_default_options();
 	if (fuse_opt_parse(&args, &newfs_options, option_spec, NULL) == -1)
 		return -1;
+#if FUSE_USE_VERSION >= 30
+	snprintf(opt, sizeof(opt), "-omax_read=%d", NFS_FUSE_MAX_IO);
+	fuse_opt_add_arg(&args, opt);
+#endif
 
-	ret = fuse_main(args.argc, args.argv, &operations, NULL);
+	if (newfs_options.lowlevel)
+	{
+		ret = newfs_ll_main(&args);
+	}
+	else
+	{
+		/* 高层接口的缓存时间由libfuse自己的挂载参数控制 */
+		snprintf(opt, sizeof(opt), "-oentry_timeout=%g,attr_timeout=%g",
+				 newfs_options.entry_timeout, newfs_options.attr_timeout);
+		fuse_opt_add_arg(&args, opt);
+		ret = fuse_main(args.argc, args.argv, &operations, NULL);
+	}
 	fuse_opt_free_args(&args);
 	return ret;
-}
\ No newline at end of file
+}
+#endif /* NEWFS_LIBRARY */
\ No newline at end of file
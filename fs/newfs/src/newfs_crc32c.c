@@ -0,0 +1,153 @@
+#include "../include/newfs.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define NFS_CRC32C_X86
+#endif
+
+/******************************************************************************
+ * SECTION: CRC32C校验和
+ *
+ * 元数据块的校验和用CRC32C(Castagnoli，多项式0x1EDC6F41)：
+ *  - x86上CPU支持SSE4.2时用crc32指令，每次处理8字节
+ *  - 否则用slicing-by-8查表，8张256项的表每次同样处理8字节
+ * 第一次调用时按CPU选定实现，之后经由函数指针调用
+ *******************************************************************************/
+#define NFS_CRC32C_POLY 0x82F63B78 // 0x1EDC6F41按位反转
+
+static uint32_t nfs_crc32c_table[8][256];
+static uint32_t (*nfs_crc32c_fn)(uint32_t, const uint8_t *, size_t);
+static pthread_once_t nfs_crc32c_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief slicing-by-8：一次查8张表处理8字节，首尾不足8字节的部分逐字节处理
+ * @param crc 未取反的中间值
+ * @param buf
+ * @param len
+ * @return uint32_t
+ */
+uint32_t nfs_crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    uint64_t word;
+
+    while (len > 0 && ((uintptr_t)buf & 7) != 0)
+    {
+        crc = nfs_crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8)
+    {
+        memcpy(&word, buf, 8);
+        word ^= crc; // 小端：低4字节与crc合并
+        crc = nfs_crc32c_table[7][word & 0xff] ^
+              nfs_crc32c_table[6][(word >> 8) & 0xff] ^
+              nfs_crc32c_table[5][(word >> 16) & 0xff] ^
+              nfs_crc32c_table[4][(word >> 24) & 0xff] ^
+              nfs_crc32c_table[3][(word >> 32) & 0xff] ^
+              nfs_crc32c_table[2][(word >> 40) & 0xff] ^
+              nfs_crc32c_table[1][(word >> 48) & 0xff] ^
+              nfs_crc32c_table[0][word >> 56];
+        buf += 8;
+        len -= 8;
+    }
+    while (len > 0)
+    {
+        crc = nfs_crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#ifdef NFS_CRC32C_X86
+/**
+ * @brief SSE4.2的crc32指令，只在CPU支持时被选用
+ * @param crc 未取反的中间值
+ * @param buf
+ * @param len
+ * @return uint32_t
+ */
+__attribute__((target("sse4.2"))) uint32_t nfs_crc32c_hw(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    while (len > 0 && ((uintptr_t)buf & 7) != 0)
+    {
+        crc = _mm_crc32_u8(crc, *buf++);
+        len--;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc, word;
+    while (len >= 8)
+    {
+        memcpy(&word, buf, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (len >= 4)
+    {
+        uint32_t word32;
+        memcpy(&word32, buf, 4);
+        crc = _mm_crc32_u32(crc, word32);
+        buf += 4;
+        len -= 4;
+    }
+    while (len > 0)
+    {
+        crc = _mm_crc32_u8(crc, *buf++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+static void nfs_crc32c_setup()
+{
+    uint32_t crc;
+
+    for (int i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ NFS_CRC32C_POLY : crc >> 1;
+        }
+        nfs_crc32c_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+        {
+            crc = nfs_crc32c_table[t - 1][i];
+            nfs_crc32c_table[t][i] = nfs_crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+        }
+    }
+    nfs_crc32c_fn = nfs_crc32c_sw;
+#ifdef NFS_CRC32C_X86
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        nfs_crc32c_fn = nfs_crc32c_hw;
+    }
+#endif
+}
+
+/**
+ * @brief 计算buf的CRC32C
+ * @param buf
+ * @param len
+ * @return uint32_t
+ */
+uint32_t nfs_crc32c(const void *buf, size_t len)
+{
+    pthread_once(&nfs_crc32c_once, nfs_crc32c_setup);
+    return ~nfs_crc32c_fn(~0U, (const uint8_t *)buf, len);
+}
+
+/**
+ * @brief 选用的实现，用于打印和基准测试
+ * @return const char*
+ */
+const char *nfs_crc32c_impl()
+{
+    pthread_once(&nfs_crc32c_once, nfs_crc32c_setup);
+    return nfs_crc32c_fn == nfs_crc32c_sw ? "slicing-by-8" : "sse4.2";
+}
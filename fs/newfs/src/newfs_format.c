@@ -0,0 +1,153 @@
+#include "../include/newfs.h"
+#include <limits.h>
+
+#if NFS_JOURNAL_MIN_BLKS < NFS_JOURNAL_OP_BLKS + 3
+#error "journal too small to hold one operation"
+#endif
+
+/******************************************************************************
+ * SECTION: 格式化
+ *
+ * 按磁盘大小、块大小、每个inode对应的字节数和日志区大小规划布局：
+ *   | Super(1) | Inode Map | Data Map | Inode | Data | Journal |
+ * 每个inode占一块；两张位图的块数按各自要覆盖的位数取整，日志区从磁盘末尾划出。
+ * 格式化只写超级块、两张位图、根目录的inode块(它们在磁盘上连续，一次写入)和日志区开头两块，
+ * inode区和数据区不清零，哪些块有效只看位图。
+ * mkfs.newfs和首次挂载共用这里，不依赖内存中的nfs_super
+ *******************************************************************************/
+/**
+ * @brief 超级块写回前更新它的校验和
+ * @param super_d
+ */
+void nfs_csum_super(struct nfs_super_d *super_d)
+{
+    super_d->csum = 0;
+    if (super_d->features & NFS_FEATURE_CSUM)
+    {
+        super_d->csum = nfs_crc32c(super_d, offsetof(struct nfs_super_d, csum));
+    }
+}
+
+/**
+ * @brief 校验读入的超级块，没有校验和特性的旧镜像总是通过
+ * @param super_d
+ * @return boolean
+ */
+boolean nfs_verify_super(struct nfs_super_d *super_d)
+{
+    return !(super_d->features & NFS_FEATURE_CSUM) ||
+           super_d->csum == nfs_crc32c(super_d, offsetof(struct nfs_super_d, csum));
+}
+
+/**
+ * @brief 规划磁盘布局，结果填入super_d
+ * 偏移以int按字节记录，超过2GB的设备只使用前2GB；
+ * 日志区不足NFS_JOURNAL_MIN_BLKS时取下限，超过数据区的一半时截到一半，一半还不够下限时不使用日志
+ * @param super_d
+ * @param sz_disk 设备大小(字节)
+ * @param sz_io 设备IO单位
+ * @param sz_blk 块大小
+ * @param inode_ratio 每多少字节磁盘空间分配一个inode
+ * @param journal_blks 日志区块数，0表示不使用日志
+ * @return int
+ */
+int nfs_plan_layout(struct nfs_super_d *super_d, long long sz_disk, int sz_io, int sz_blk,
+                    int inode_ratio, int journal_blks)
+{
+    int bits = sz_blk * UINT8_BITS; // 一块位图能覆盖的块数
+    int blks, inode_num, map_inode_blks, map_data_blks, data_num;
+
+    if (sz_io <= 0 || sz_blk < NFS_MIN_BLK_SZ || sz_blk > NFS_MAX_BLK_SZ ||
+        (sz_blk & (sz_blk - 1)) != 0 || sz_blk % sz_io != 0 || inode_ratio < sz_blk)
+    {
+        return -NFS_ERROR_INVAL;
+    }
+    sz_disk = sz_disk > INT_MAX ? INT_MAX : sz_disk;
+    blks = sz_disk / sz_blk;
+    inode_num = sz_disk / inode_ratio;
+    map_inode_blks = (inode_num + bits - 1) / bits;
+    // 剩下的块分给数据位图和数据区，数据位图要覆盖全部数据块(包括之后划给日志的)
+    data_num = blks - NFS_BLKS_SUPER - map_inode_blks - inode_num;
+    map_data_blks = (data_num + bits) / (bits + 1);
+    data_num -= map_data_blks;
+    if (inode_num <= 0 || data_num < NFS_DATA_PER_FILE)
+    {
+        return -NFS_ERROR_NOSPACE;
+    }
+
+    journal_blks = journal_blks < 0 ? 0 : journal_blks;
+    journal_blks = journal_blks > 0 && journal_blks < NFS_JOURNAL_MIN_BLKS ? NFS_JOURNAL_MIN_BLKS : journal_blks;
+    if (journal_blks > data_num / 2)
+    {
+        journal_blks = data_num / 2 >= NFS_JOURNAL_MIN_BLKS ? data_num / 2 : 0;
+    }
+
+    memset(super_d, 0, sizeof(struct nfs_super_d));
+    super_d->magic_num = NFS_MAGIC_NUM;
+    super_d->sz_blk = sz_blk;
+    super_d->map_inode_blks = map_inode_blks;
+    super_d->map_data_blks = map_data_blks;
+    super_d->map_inode_offset = NFS_SUPER_OFS + NFS_BLKS_SUPER * sz_blk;
+    super_d->map_data_offset = super_d->map_inode_offset + map_inode_blks * sz_blk;
+    super_d->inode_offset = super_d->map_data_offset + map_data_blks * sz_blk;
+    super_d->data_offset = super_d->inode_offset + inode_num * sz_blk;
+    super_d->journal_blks = journal_blks;
+    super_d->journal_offset = journal_blks > 0 ? (blks - journal_blks) * sz_blk : 0;
+    super_d->features = NFS_FEATURE_CSUM;
+    super_d->state = NFS_STATE_CLEAN;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 按nfs_plan_layout规划好的super_d格式化设备：
+ * 超级块到根目录inode块一次写入，使用日志时再写日志超级块和清零的第一个事务位置，最后刷盘。
+ * 写入的超级块标记为正常卸载，带两张位图的校验和
+ * @param fd ddriver设备
+ * @param super_d
+ * @return int
+ */
+int nfs_format(int fd, struct nfs_super_d *super_d)
+{
+    int sz_blk = super_d->sz_blk;
+    int head = super_d->inode_offset + (NFS_ROOT_INO + 1) * sz_blk;
+    uint8_t *buf = (uint8_t *)calloc(1, head);
+    uint8_t *map_inode = buf + super_d->map_inode_offset;
+    uint8_t *map_data = buf + super_d->map_data_offset;
+    struct nfs_inode_d *root_d = (struct nfs_inode_d *)(buf + super_d->inode_offset + NFS_ROOT_INO * sz_blk);
+    struct nfs_journal_d *journal_d;
+    int ret = NFS_ERROR_NONE;
+
+    // 根目录：空目录不占数据块
+    map_inode[NFS_ROOT_INO / UINT8_BITS] |= (0x1 << (NFS_ROOT_INO % UINT8_BITS));
+    root_d->ino = NFS_ROOT_INO;
+    root_d->link = 1;
+    root_d->ftype = NFS_DIR;
+    root_d->csum = nfs_crc32c(root_d, offsetof(struct nfs_inode_d, csum));
+
+    super_d->state = NFS_STATE_CLEAN;
+    super_d->map_inode_csum = nfs_crc32c(map_inode, super_d->map_inode_blks * sz_blk);
+    super_d->map_data_csum = nfs_crc32c(map_data, super_d->map_data_blks * sz_blk);
+    nfs_csum_super(super_d);
+    memcpy(buf + NFS_SUPER_OFS, super_d, sizeof(struct nfs_super_d));
+    if (ddriver_pwrite(fd, (char *)buf, head, NFS_SUPER_OFS) < 0)
+    {
+        ret = -NFS_ERROR_IO;
+    }
+
+    // 日志超级块指向1号块，1号块清零，重放时不会把设备上残留的旧事务当成有效的
+    if (ret == NFS_ERROR_NONE && super_d->journal_blks > 0)
+    {
+        memset(buf, 0, 2 * sz_blk);
+        journal_d = (struct nfs_journal_d *)buf;
+        journal_d->magic = NFS_JOURNAL_MAGIC;
+        journal_d->seq = 1;
+        journal_d->start = 1;
+        if (ddriver_pwrite(fd, (char *)buf, 2 * sz_blk, super_d->journal_offset) < 0)
+        {
+            ret = -NFS_ERROR_IO;
+        }
+    }
+    ddriver_ioctl(fd, IOC_REQ_DEVICE_FLUSH, NULL);
+    free(buf);
+    return ret;
+}
@@ -0,0 +1,764 @@
+#include "../include/newfs.h"
+
+extern struct nfs_super nfs_super;
+
+/******************************************************************************
+ * SECTION: 元数据日志
+ *
+ * 位图、inode表和目录项块以整块映像记入日志区，写回原位之前先在日志中提交：
+ *  - 每个改动元数据的操作先用nfs_journal_start取得handle，再拿目录锁/文件锁；
+ *    改完后把涉及的块整块记入handle所在的事务，nfs_journal_stop结束
+ *  - 事务不随操作提交，由fsync/flush、事务写满和卸载触发；一次提交把事务内所有操作
+ *    连同描述块、提交块顺序写入日志区，许多操作只花一次顺序写(组提交)
+ *  - 提交后的块映像留在内存，日志区写到末尾时统一写回原位(检查点)，再从头开始写
+ *  - 挂载时从日志超级块记录的位置起重放校验通过的事务
+ * 释放的数据块在释放它的事务提交前不重新分配、也不discard，崩溃后仍归原来的文件；
+ * 其中日志里记录过的目录项块之后可能作为普通文件的数据块直接写回原位，
+ * 因此还要记一条撤销记录，重放时跳过更早的映像
+ *******************************************************************************/
+struct nfs_jblks
+{
+    int cnt;
+    int *blknos;   // 磁盘块号
+    uint8_t *bufs; // cnt个块映像，连续存放
+};
+
+struct nfs_txn
+{
+    uint32_t seq;
+    int updates;  // 仍持有handle的操作数
+    int reserved; // 这些操作预留、尚未用完的块数
+    struct nfs_jblks blks;
+    int nrevoke;
+    int *revokes; // 撤销的块，写入描述块
+    int nfreed;
+    int freed_cap;
+    int *freed; // 本事务释放的全部数据块，提交后才可重新分配
+    long since; // 第一次记入内容的时间(毫秒)，空事务为0
+};
+
+static struct
+{
+    boolean enabled;
+    pthread_mutex_t lock; // 保护以下全部字段和事务内容
+    pthread_cond_t cond;
+    struct nfs_txn txns[2];
+    struct nfs_txn *running;    // 接收新操作的事务
+    struct nfs_txn *committing; // 正在写入日志区的事务
+    boolean locked;             // running等待已有的操作结束后提交，期间不接收新操作
+    uint32_t committed_seq;     // 已提交的最大事务序号
+    int err;                    // 写日志出错后一直返回该错误
+    int txn_cap;                // 一个事务最多的块映像与撤销记录数
+    int head;                   // 下一个事务写入的位置，只由提交者访问
+    struct nfs_jblks ckpt;      // 已提交、尚未写回原位的块映像
+    uint8_t *pending;           // 释放尚未提交、暂不能重新分配的块，由map_lock保护
+} nfs_journal;
+
+static __thread int nfs_jdepth;            // 本线程handle的嵌套深度
+static __thread struct nfs_txn *nfs_jtxn;  // 本线程handle所在的事务
+static __thread int nfs_jcredits;          // 本线程handle预留的块数
+
+#define NFS_JBLK_OFS(pos) (nfs_super.journal_offset + NFS_BLKS_SZ(pos))
+#define NFS_JDESC_CAP() ((NFS_BLK_SZ() - (int)sizeof(struct nfs_jdesc_d)) / (int)sizeof(int))
+
+static int nfs_jblks_find(struct nfs_jblks *set, int blkno)
+{
+    for (int i = 0; i < set->cnt; i++)
+    {
+        if (set->blknos[i] == blkno)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* 记入或覆盖一个块映像 */
+static void nfs_jblks_put(struct nfs_jblks *set, int blkno, const uint8_t *buf)
+{
+    int idx = nfs_jblks_find(set, blkno);
+    if (idx < 0)
+    {
+        idx = set->cnt++;
+        set->blknos[idx] = blkno;
+    }
+    memcpy(set->bufs + NFS_BLKS_SZ(idx), buf, NFS_BLK_SZ());
+}
+
+/* 删除一个块映像，最后一个补到它的位置 */
+static void nfs_jblks_del(struct nfs_jblks *set, int blkno)
+{
+    int idx = nfs_jblks_find(set, blkno);
+    if (idx < 0)
+    {
+        return;
+    }
+    set->cnt--;
+    set->blknos[idx] = set->blknos[set->cnt];
+    memcpy(set->bufs + NFS_BLKS_SZ(idx), set->bufs + NFS_BLKS_SZ(set->cnt), NFS_BLK_SZ());
+}
+
+static void nfs_jblks_init(struct nfs_jblks *set, int cap)
+{
+    set->cnt = 0;
+    set->blknos = (int *)malloc(cap * sizeof(int));
+    set->bufs = (uint8_t *)malloc(NFS_BLKS_SZ(cap));
+}
+
+static void nfs_jblks_free(struct nfs_jblks *set)
+{
+    free(set->blknos);
+    free(set->bufs);
+}
+
+static void nfs_txn_reset(struct nfs_txn *txn, uint32_t seq)
+{
+    txn->seq = seq;
+    txn->updates = 0;
+    txn->reserved = 0;
+    txn->blks.cnt = 0;
+    txn->nrevoke = 0;
+    txn->nfreed = 0;
+    txn->since = 0;
+}
+
+static int nfs_cmp_idx_blkno(const void *a, const void *b)
+{
+    return ((const int *)a)[0] - ((const int *)b)[0];
+}
+
+/**
+ * @brief 把一组块映像写回原位：按块号排序，连续的合并成一次写，最后刷盘
+ * @param set
+ * @return int
+ */
+static int nfs_journal_write_home(struct nfs_jblks *set)
+{
+    int (*order)[2] = malloc(set->cnt * sizeof(*order));
+    uint8_t *run = (uint8_t *)malloc(NFS_BLKS_SZ(set->cnt));
+    int start = 0, end, ret = NFS_ERROR_NONE;
+
+    for (int i = 0; i < set->cnt; i++)
+    {
+        order[i][0] = set->blknos[i];
+        order[i][1] = i;
+    }
+    qsort(order, set->cnt, sizeof(*order), nfs_cmp_idx_blkno);
+    while (start < set->cnt)
+    {
+        for (end = start + 1; end < set->cnt && order[end][0] == order[end - 1][0] + 1; end++)
+            ;
+        for (int i = start; i < end; i++)
+        {
+            memcpy(run + NFS_BLKS_SZ(i - start), set->bufs + NFS_BLKS_SZ(order[i][1]), NFS_BLK_SZ());
+        }
+        if (ddriver_pwrite(NFS_DRIVER(), (char *)run, NFS_BLKS_SZ(end - start),
+                           NFS_BLKS_SZ(order[start][0])) < 0)
+        {
+            ret = -NFS_ERROR_IO;
+            break;
+        }
+        start = end;
+    }
+    free(order);
+    free(run);
+    ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_FLUSH, NULL);
+    return ret;
+}
+
+/**
+ * @brief 更新日志超级块：下次挂载从start处、序号为seq的事务开始重放
+ * @param seq
+ * @param start
+ * @return int
+ */
+static int nfs_journal_write_super(uint32_t seq, int start)
+{
+    uint8_t *blk = (uint8_t *)calloc(1, NFS_BLK_SZ());
+    struct nfs_journal_d *journal_d = (struct nfs_journal_d *)blk;
+    int ret = NFS_ERROR_NONE;
+
+    journal_d->magic = NFS_JOURNAL_MAGIC;
+    journal_d->seq = seq;
+    journal_d->start = start;
+    if (ddriver_pwrite(NFS_DRIVER(), (char *)blk, NFS_BLK_SZ(), NFS_JBLK_OFS(0)) < 0)
+    {
+        ret = -NFS_ERROR_IO;
+    }
+    ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_FLUSH, NULL);
+    free(blk);
+    return ret;
+}
+
+/**
+ * @brief 检查点：把已提交的块映像全部写回原位，日志区清空，下一个事务seq从头写起
+ * 只由提交者调用
+ * @param seq
+ * @return int
+ */
+static int nfs_journal_checkpoint(uint32_t seq)
+{
+    int ret = nfs_journal_write_home(&nfs_journal.ckpt);
+    if (ret == NFS_ERROR_NONE)
+    {
+        ret = nfs_journal_write_super(seq, 1);
+    }
+    pthread_mutex_lock(&nfs_journal.lock);
+    nfs_journal.ckpt.cnt = 0;
+    pthread_mutex_unlock(&nfs_journal.lock);
+    nfs_journal.head = 1;
+    return ret;
+}
+
+/**
+ * @brief 把一个事务写入日志区：描述块、块映像、提交块拼成一次顺序写后刷盘；
+ * 写不下时先做检查点再从头写。只由提交者调用
+ * @param txn
+ * @return int
+ */
+static int nfs_journal_write_txn(struct nfs_txn *txn)
+{
+    int need = txn->blks.cnt + 2;
+    uint8_t *buf;
+    struct nfs_jdesc_d *desc;
+    struct nfs_jcommit_d *commit;
+    int ret = NFS_ERROR_NONE;
+
+    if (txn->blks.cnt == 0 && txn->nrevoke == 0)
+    {
+        return NFS_ERROR_NONE;
+    }
+    if (nfs_journal.head + need > nfs_super.journal_blks &&
+        (ret = nfs_journal_checkpoint(txn->seq)) < 0)
+    {
+        return ret;
+    }
+
+    buf = (uint8_t *)calloc(need, NFS_BLK_SZ());
+    desc = (struct nfs_jdesc_d *)buf;
+    desc->magic = NFS_JDESC_MAGIC;
+    desc->seq = txn->seq;
+    desc->cnt = txn->blks.cnt;
+    desc->nrevoke = txn->nrevoke;
+    memcpy(desc->blknos, txn->blks.blknos, txn->blks.cnt * sizeof(int));
+    memcpy(desc->blknos + txn->blks.cnt, txn->revokes, txn->nrevoke * sizeof(int));
+    memcpy(buf + NFS_BLK_SZ(), txn->blks.bufs, NFS_BLKS_SZ(txn->blks.cnt));
+    commit = (struct nfs_jcommit_d *)(buf + NFS_BLKS_SZ(need - 1));
+    commit->magic = NFS_JCOMMIT_MAGIC;
+    commit->seq = txn->seq;
+    commit->csum = nfs_crc32c(buf, NFS_BLKS_SZ(need - 1));
+
+    if (ddriver_pwrite(NFS_DRIVER(), (char *)buf, NFS_BLKS_SZ(need), NFS_JBLK_OFS(nfs_journal.head)) < 0)
+    {
+        ret = -NFS_ERROR_IO;
+    }
+    ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_FLUSH, NULL);
+    nfs_journal.head += need;
+    free(buf);
+    return ret;
+}
+
+/**
+ * @brief 提交running事务，调用者持有nfs_journal.lock、不持有handle，
+ * 且没有其他事务在提交。先等事务中的操作全部结束，随即换上新的running事务，
+ * 写日志期间新的操作照常进行，返回时仍持有锁
+ */
+static void nfs_journal_commit_locked()
+{
+    struct nfs_txn *txn = nfs_journal.running;
+    int ret;
+
+    nfs_journal.locked = TRUE;
+    while (txn->updates > 0)
+    {
+        pthread_cond_wait(&nfs_journal.cond, &nfs_journal.lock);
+    }
+    nfs_journal.committing = txn;
+    nfs_journal.running = txn == &nfs_journal.txns[0] ? &nfs_journal.txns[1] : &nfs_journal.txns[0];
+    nfs_txn_reset(nfs_journal.running, txn->seq + 1);
+    nfs_journal.locked = FALSE;
+    pthread_cond_broadcast(&nfs_journal.cond);
+    pthread_mutex_unlock(&nfs_journal.lock);
+
+    ret = nfs_journal_write_txn(txn);
+
+    /* 提交后映像转入检查点集合，撤销的块从中删除，之后释放的块才允许重新分配和discard */
+    pthread_mutex_lock(&nfs_journal.lock);
+    for (int i = 0; i < txn->blks.cnt; i++)
+    {
+        nfs_jblks_put(&nfs_journal.ckpt, txn->blks.blknos[i], txn->blks.bufs + NFS_BLKS_SZ(i));
+    }
+    for (int i = 0; i < txn->nrevoke; i++)
+    {
+        nfs_jblks_del(&nfs_journal.ckpt, txn->revokes[i]);
+    }
+    pthread_mutex_unlock(&nfs_journal.lock);
+    pthread_mutex_lock(&nfs_super.map_lock);
+    for (int i = 0; i < txn->nfreed; i++)
+    {
+        nfs_journal.pending[txn->freed[i] / UINT8_BITS] &= ~(0x1 << (txn->freed[i] % UINT8_BITS));
+        nfs_release_data_blk(txn->freed[i] - NFS_BLK_NO(nfs_super.data_offset));
+    }
+    pthread_mutex_unlock(&nfs_super.map_lock);
+
+    pthread_mutex_lock(&nfs_journal.lock);
+    if (ret < 0)
+    {
+        nfs_journal.err = ret;
+    }
+    nfs_journal.committed_seq = txn->seq;
+    nfs_journal.committing = NULL;
+    pthread_cond_broadcast(&nfs_journal.cond);
+}
+
+/**
+ * @brief 描述块中的块号都应落在日志区之前
+ * @param desc
+ * @return boolean
+ */
+static boolean nfs_jdesc_valid(struct nfs_jdesc_d *desc)
+{
+    for (int i = 0; i < desc->cnt + desc->nrevoke; i++)
+    {
+        if (desc->blknos[i] < 0 || desc->blknos[i] >= nfs_super.journal_offset / NFS_BLK_SZ())
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/**
+ * @brief 重放日志：一次读入整个日志区，从日志超级块记录的位置起逐个校验事务，
+ * 遇到序号不连续或校验和不符即停止；每块取最后一次映像，被之后的事务撤销的跳过，
+ * 写回原位后清空日志
+ * @return int
+ */
+static int nfs_journal_replay()
+{
+    int blks = nfs_super.journal_blks;
+    uint8_t *log = (uint8_t *)malloc(NFS_BLKS_SZ(blks));
+    uint32_t *revoked = (uint32_t *)calloc(nfs_super.journal_offset / NFS_BLK_SZ(), sizeof(uint32_t));
+    struct nfs_journal_d *journal_d = (struct nfs_journal_d *)log;
+    struct nfs_jdesc_d *desc;
+    struct nfs_jcommit_d *commit;
+    struct nfs_jblks home;
+    uint32_t seq;
+    int pos, end, cnt = 0, ret = NFS_ERROR_NONE;
+
+    if (ddriver_pread(NFS_DRIVER(), (char *)log, NFS_BLKS_SZ(blks), NFS_JBLK_OFS(0)) < 0)
+    {
+        free(log);
+        free(revoked);
+        return -NFS_ERROR_IO;
+    }
+    if (journal_d->magic != NFS_JOURNAL_MAGIC || journal_d->start < 1 || journal_d->start >= blks)
+    {
+        NFS_DBG("[%s] bad journal super, reset\n", __func__);
+        nfs_journal.head = 1;
+        nfs_journal.committed_seq = 0;
+        free(log);
+        free(revoked);
+        return nfs_journal_write_super(1, 1);
+    }
+
+    /* 第一遍：找出完整的事务，记下每块最后被撤销的事务 */
+    seq = journal_d->seq;
+    for (pos = journal_d->start; pos + 2 <= blks; pos = end, seq++)
+    {
+        desc = (struct nfs_jdesc_d *)(log + NFS_BLKS_SZ(pos));
+        if (desc->magic != NFS_JDESC_MAGIC || desc->seq != seq || desc->cnt < 0 || desc->nrevoke < 0 ||
+            desc->cnt + desc->nrevoke > NFS_JDESC_CAP() || pos + desc->cnt + 2 > blks)
+        {
+            break;
+        }
+        end = pos + desc->cnt + 2;
+        commit = (struct nfs_jcommit_d *)(log + NFS_BLKS_SZ(end - 1));
+        if (commit->magic != NFS_JCOMMIT_MAGIC || commit->seq != seq ||
+            commit->csum != nfs_crc32c((uint8_t *)desc, NFS_BLKS_SZ(end - 1 - pos)) ||
+            !nfs_jdesc_valid(desc))
+        {
+            break;
+        }
+        for (int i = 0; i < desc->nrevoke; i++)
+        {
+            revoked[desc->blknos[desc->cnt + i]] = seq;
+        }
+        cnt++;
+    }
+
+    /* 第二遍：按顺序收集映像，后面的覆盖前面的 */
+    nfs_jblks_init(&home, blks);
+    seq = journal_d->seq;
+    for (pos = journal_d->start; cnt-- > 0; pos += desc->cnt + 2, seq++)
+    {
+        desc = (struct nfs_jdesc_d *)(log + NFS_BLKS_SZ(pos));
+        for (int i = 0; i < desc->cnt; i++)
+        {
+            if (revoked[desc->blknos[i]] < seq)
+            {
+                nfs_jblks_put(&home, desc->blknos[i], log + NFS_BLKS_SZ(pos + 1 + i));
+            }
+        }
+    }
+    if (seq != journal_d->seq)
+    {
+        printf("*****journal replay %u transactions, %d blocks\n", seq - journal_d->seq, home.cnt);
+        ret = nfs_journal_write_home(&home);
+        if (ret == NFS_ERROR_NONE)
+        {
+            ret = nfs_journal_write_super(seq, 1);
+        }
+        pos = 1;
+    }
+    else
+    {
+        pos = journal_d->start;
+    }
+    nfs_journal.head = pos;
+    nfs_journal.committed_seq = seq - 1;
+    nfs_jblks_free(&home);
+    free(log);
+    free(revoked);
+    return ret;
+}
+
+/**
+ * @brief 释放挂载时为日志分配的内存和锁
+ */
+static void nfs_journal_release()
+{
+    for (int i = 0; i < 2; i++)
+    {
+        nfs_jblks_free(&nfs_journal.txns[i].blks);
+        free(nfs_journal.txns[i].revokes);
+        free(nfs_journal.txns[i].freed);
+    }
+    nfs_jblks_free(&nfs_journal.ckpt);
+    free(nfs_journal.pending);
+    pthread_mutex_destroy(&nfs_journal.lock);
+    pthread_cond_destroy(&nfs_journal.cond);
+}
+
+/**
+ * @brief 挂载时建立日志：超级块中日志区大小为0则不使用日志，否则重放未写回原位的事务；
+ * 日志区放不下一个操作时重放后不再使用日志。格式化时已写入空的日志超级块。需在读取位图之前调用
+ * @return int
+ */
+int nfs_journal_mount()
+{
+    int ret = NFS_ERROR_NONE;
+
+    nfs_journal.enabled = FALSE;
+    if (nfs_super.journal_blks == 0)
+    {
+        return NFS_ERROR_NONE;
+    }
+    pthread_mutex_init(&nfs_journal.lock, NULL);
+    pthread_cond_init(&nfs_journal.cond, NULL);
+    nfs_journal.txn_cap = nfs_super.journal_blks - 3 < NFS_JDESC_CAP() ? nfs_super.journal_blks - 3
+                                                                        : NFS_JDESC_CAP();
+    for (int i = 0; i < 2; i++)
+    {
+        nfs_jblks_init(&nfs_journal.txns[i].blks, nfs_journal.txn_cap);
+        nfs_journal.txns[i].revokes = (int *)malloc(nfs_journal.txn_cap * sizeof(int));
+        nfs_journal.txns[i].freed_cap = NFS_DISCARD_BATCH;
+        nfs_journal.txns[i].freed = (int *)malloc(NFS_DISCARD_BATCH * sizeof(int));
+    }
+    nfs_jblks_init(&nfs_journal.ckpt, nfs_super.journal_blks);
+    nfs_journal.pending = (uint8_t *)calloc(nfs_super.sz_disk / NFS_BLK_SZ() / UINT8_BITS + 1, 1);
+    nfs_journal.err = NFS_ERROR_NONE;
+    nfs_journal.locked = FALSE;
+    nfs_journal.committing = NULL;
+
+    ret = nfs_journal_replay();
+    if (nfs_journal.txn_cap < NFS_JOURNAL_OP_BLKS)
+    {
+        /* 旧版本格式化的日志区放不下一个操作，重放后不再使用日志，元数据直接写回原位 */
+        printf("*****journal of %d blocks too small, disabled\n", nfs_super.journal_blks);
+        nfs_journal_release();
+        return ret;
+    }
+    nfs_journal.running = &nfs_journal.txns[0];
+    nfs_txn_reset(nfs_journal.running, nfs_journal.committed_seq + 1);
+    nfs_journal.enabled = TRUE;
+    return ret;
+}
+
+/**
+ * @brief 卸载时提交最后的事务并做检查点，之后日志区为空
+ * @return int
+ */
+int nfs_journal_umount()
+{
+    int ret;
+
+    if (!nfs_journal.enabled)
+    {
+        return NFS_ERROR_NONE;
+    }
+    ret = nfs_journal_commit();
+    if (ret == NFS_ERROR_NONE)
+    {
+        ret = nfs_journal_checkpoint(nfs_journal.committed_seq + 1);
+    }
+    nfs_journal.enabled = FALSE;
+    nfs_journal_release();
+    return ret;
+}
+
+boolean nfs_journal_enabled()
+{
+    return nfs_journal.enabled;
+}
+
+/**
+ * @brief 开始一个原子操作：加入running事务并预留credits个块，可嵌套。
+ * 事务剩余空间不足时先提交它。必须在取得任何目录锁、文件锁之前调用，
+ * 否则提交等待本事务的操作结束时可能与持锁的操作互相等待
+ * @param credits 操作最多改动的元数据块数，不超过NFS_JOURNAL_OP_BLKS
+ */
+void nfs_journal_start(int credits)
+{
+    struct nfs_txn *txn;
+
+    if (!nfs_journal.enabled || nfs_jdepth++ > 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&nfs_journal.lock);
+    for (;;)
+    {
+        txn = nfs_journal.running;
+        if (!nfs_journal.locked &&
+            txn->blks.cnt + txn->nrevoke + txn->reserved + credits <= nfs_journal.txn_cap)
+        {
+            break;
+        }
+        if (!nfs_journal.locked && nfs_journal.committing == NULL)
+        {
+            nfs_journal_commit_locked();
+        }
+        else
+        {
+            pthread_cond_wait(&nfs_journal.cond, &nfs_journal.lock);
+        }
+    }
+    txn->updates++;
+    txn->reserved += credits;
+    nfs_jtxn = txn;
+    nfs_jcredits = credits;
+    pthread_mutex_unlock(&nfs_journal.lock);
+}
+
+/**
+ * @brief 结束nfs_journal_start开始的操作，归还未用的预留
+ */
+void nfs_journal_stop()
+{
+    if (!nfs_journal.enabled || --nfs_jdepth > 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&nfs_journal.lock);
+    nfs_jtxn->reserved -= nfs_jcredits;
+    if (--nfs_jtxn->updates == 0)
+    {
+        pthread_cond_broadcast(&nfs_journal.cond);
+    }
+    nfs_jtxn = NULL;
+    pthread_mutex_unlock(&nfs_journal.lock);
+}
+
+/**
+ * @brief 把一个元数据块的当前内容记入本线程handle所在的事务，同一事务内重复记录只保留最后一次；
+ * 调用者持有保护该块内容的锁。不在handle内时自己开始并结束一个，此时不能持有目录锁、文件锁
+ * @param blkno 磁盘块号
+ * @param buf 整块内容
+ * @return uint32_t 所在事务的序号，nfs_journal_sync等待它提交；未使用日志时为0
+ */
+uint32_t nfs_journal_log(int blkno, const uint8_t *buf)
+{
+    struct nfs_txn *txn;
+    uint32_t seq;
+
+    if (!nfs_journal.enabled)
+    {
+        return 0;
+    }
+    if (nfs_jdepth == 0)
+    {
+        nfs_journal_start(1);
+        seq = nfs_journal_log(blkno, buf);
+        nfs_journal_stop();
+        return seq;
+    }
+    pthread_mutex_lock(&nfs_journal.lock);
+    txn = nfs_jtxn;
+    if (nfs_jblks_find(&txn->blks, blkno) < 0 && txn->blks.cnt + txn->nrevoke >= nfs_journal.txn_cap)
+    {
+        /* 操作改动的块超出了预留，这次修改不再是原子的，之后的nfs_journal_sync都报错 */
+        NFS_DBG("[%s] transaction %u overflow, block %d not logged\n", __func__, txn->seq, blkno);
+        nfs_journal.err = -NFS_ERROR_NOSPACE;
+    }
+    else
+    {
+        nfs_jblks_put(&txn->blks, blkno, buf);
+    }
+    txn->since = txn->since != 0 ? txn->since : nfs_now_ms();
+    seq = txn->seq;
+    pthread_mutex_unlock(&nfs_journal.lock);
+    return seq;
+}
+
+/**
+ * @brief 数据块被释放：记入本线程handle所在的事务，提交前不能重新分配；
+ * 丢弃本事务中该块的映像，更早的事务中仍有映像时再记一条撤销。调用者持有map_lock
+ * @param blkno 磁盘块号
+ * @return boolean 是否由日志接管，未使用日志时为FALSE
+ */
+boolean nfs_journal_free(int blkno)
+{
+    struct nfs_txn *txn;
+    boolean logged;
+
+    if (!nfs_journal.enabled)
+    {
+        return FALSE;
+    }
+    pthread_mutex_lock(&nfs_journal.lock);
+    txn = nfs_jdepth > 0 ? nfs_jtxn : nfs_journal.running;
+    nfs_jblks_del(&txn->blks, blkno);
+    logged = nfs_jblks_find(&nfs_journal.ckpt, blkno) >= 0 ||
+             (nfs_journal.committing != NULL && nfs_journal.committing != txn &&
+              nfs_jblks_find(&nfs_journal.committing->blks, blkno) >= 0);
+    if (logged && txn->blks.cnt + txn->nrevoke >= nfs_journal.txn_cap)
+    {
+        NFS_DBG("[%s] transaction %u overflow, block %d not revoked\n", __func__, txn->seq, blkno);
+        nfs_journal.err = -NFS_ERROR_NOSPACE;
+    }
+    else if (logged)
+    {
+        txn->revokes[txn->nrevoke++] = blkno;
+    }
+    if (txn->nfreed == txn->freed_cap)
+    {
+        txn->freed_cap *= 2;
+        txn->freed = (int *)realloc(txn->freed, txn->freed_cap * sizeof(int));
+    }
+    txn->freed[txn->nfreed++] = blkno;
+    txn->since = txn->since != 0 ? txn->since : nfs_now_ms();
+    nfs_journal.pending[blkno / UINT8_BITS] |= (0x1 << (blkno % UINT8_BITS));
+    pthread_mutex_unlock(&nfs_journal.lock);
+    return TRUE;
+}
+
+/**
+ * @brief 块的释放是否尚未提交，分配数据块时跳过。调用者持有map_lock
+ * @param blkno
+ * @return boolean
+ */
+boolean nfs_journal_busy(int blkno)
+{
+    return nfs_journal.enabled && (nfs_journal.pending[blkno / UINT8_BITS] & (0x1 << (blkno % UINT8_BITS)));
+}
+
+/**
+ * @brief 读取元数据块时先看日志：取尚未写回原位的最新映像
+ * @param blkno
+ * @param buf
+ * @return boolean 日志中有该块时为TRUE，否则需从原位读取
+ */
+boolean nfs_journal_read(int blkno, uint8_t *buf)
+{
+    struct nfs_jblks *sets[3];
+    int idx = -1, i;
+
+    if (!nfs_journal.enabled)
+    {
+        return FALSE;
+    }
+    pthread_mutex_lock(&nfs_journal.lock);
+    sets[0] = &nfs_journal.running->blks;
+    sets[1] = nfs_journal.committing != NULL ? &nfs_journal.committing->blks : NULL;
+    sets[2] = &nfs_journal.ckpt;
+    for (i = 0; i < 3 && idx < 0; i++)
+    {
+        if (sets[i] != NULL && (idx = nfs_jblks_find(sets[i], blkno)) >= 0)
+        {
+            memcpy(buf, sets[i]->bufs + NFS_BLKS_SZ(idx), NFS_BLK_SZ());
+        }
+    }
+    pthread_mutex_unlock(&nfs_journal.lock);
+    return idx >= 0;
+}
+
+/**
+ * @brief 等待序号为seq的事务提交；它还在接收操作时由本线程提交，
+ * 期间到来的其他同步请求等这一次提交，不再各自写日志。不能在handle内调用
+ * @param seq nfs_journal_log返回的序号
+ * @return int
+ */
+int nfs_journal_sync(uint32_t seq)
+{
+    int ret;
+
+    if (!nfs_journal.enabled)
+    {
+        return NFS_ERROR_NONE;
+    }
+    pthread_mutex_lock(&nfs_journal.lock);
+    while (nfs_journal.committed_seq < seq)
+    {
+        if (nfs_journal.running->seq == seq && !nfs_journal.locked && nfs_journal.committing == NULL)
+        {
+            nfs_journal_commit_locked();
+        }
+        else
+        {
+            pthread_cond_wait(&nfs_journal.cond, &nfs_journal.lock);
+        }
+    }
+    ret = nfs_journal.err;
+    pthread_mutex_unlock(&nfs_journal.lock);
+    return ret;
+}
+
+/**
+ * @brief 提交当前所有已完成的操作
+ * @return int
+ */
+int nfs_journal_commit()
+{
+    uint32_t seq;
+
+    if (!nfs_journal.enabled)
+    {
+        return NFS_ERROR_NONE;
+    }
+    pthread_mutex_lock(&nfs_journal.lock);
+    seq = nfs_journal.running->seq;
+    pthread_mutex_unlock(&nfs_journal.lock);
+    return nfs_journal_sync(seq);
+}
+
+/**
+ * @brief running事务第一次记入内容已超过expire_ms时提交它，由后台写回线程定期调用
+ * @param expire_ms
+ * @return boolean 是否提交了事务
+ */
+boolean nfs_journal_commit_expired(long expire_ms)
+{
+    uint32_t seq;
+    boolean expired;
+
+    if (!nfs_journal.enabled)
+    {
+        return FALSE;
+    }
+    pthread_mutex_lock(&nfs_journal.lock);
+    seq = nfs_journal.running->seq;
+    expired = nfs_journal.running->since != 0 && nfs_now_ms() - nfs_journal.running->since >= expire_ms;
+    pthread_mutex_unlock(&nfs_journal.lock);
+    return expired && nfs_journal_sync(seq) == NFS_ERROR_NONE;
+}
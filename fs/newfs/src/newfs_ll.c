@@ -0,0 +1,942 @@
+#define _XOPEN_SOURCE 700
+
+#include "newfs.h"
+#include "types.h"
+
+/******************************************************************************
+ * SECTION: 宏定义
+ *******************************************************************************/
+// 内核的根inode号固定为FUSE_ROOT_ID，newfs的ino整体平移
+#define NFS_LL_INO(ino) ((fuse_ino_t)(ino) + FUSE_ROOT_ID)
+// 一个目录项在readdir缓冲区中占用的字节数
+#if FUSE_USE_VERSION >= 30
+#define NFS_LL_DIRENT_SZ(req, fname, plus) \
+	((plus) ? fuse_add_direntry_plus(req, NULL, 0, fname, NULL, 0) \
+			: fuse_add_direntry(req, NULL, 0, fname, NULL, 0))
+#else
+#define NFS_LL_DIRENT_SZ(req, fname, plus) fuse_add_direntry(req, NULL, 0, fname, NULL, 0)
+#endif
+
+/******************************************************************************
+ * SECTION: 全局变量
+ *******************************************************************************/
+extern struct custom_options newfs_options;
+extern struct nfs_super nfs_super;
+static struct fuse_session *nfs_ll_session;
+/******************************************************************************
+ * SECTION: FUSE低层操作定义
+ *******************************************************************************/
+static struct fuse_lowlevel_ops ll_operations = {
+	.init = newfs_ll_init,		 /* mount文件系统 */
+	.destroy = newfs_ll_destroy, /* umount文件系统 */
+	.lookup = newfs_ll_lookup,	 /* 在父目录中查找一级名字 */
+	.forget = newfs_ll_forget,	 /* 内核释放inode引用，驱动inode缓存回收 */
+	.getattr = newfs_ll_getattr, /* 获取文件属性 */
+	.setattr = newfs_ll_setattr, /* 修改属性，touch相关 */
+	.mknod = newfs_ll_mknod,	 /* 创建文件 */
+	.mkdir = newfs_ll_mkdir,	 /* 建目录 */
+	.unlink = newfs_ll_unlink,	 /* 删除文件 */
+	.rmdir = newfs_ll_rmdir,	 /* 删除目录 */
+	.readdir = newfs_ll_readdir, /* 填充dentrys */
+	.open = newfs_ll_open,		 /* 打开文件，建立句柄 */
+	.release = newfs_ll_release, /* 关闭文件，释放句柄 */
+	.flush = newfs_ll_flush,	 /* close时不写回，交给后台线程 */
+	.fsync = newfs_ll_fsync,	 /* 只写该文件自己的脏块和元数据 */
+	.fsyncdir = newfs_ll_fsync,
+	.read = newfs_ll_read,		 /* 读文件，片段直接指向缓存块或设备 */
+	.write_buf = newfs_ll_write_buf, /* 写入文件，数据直接拷入缓存块 */
+	.ioctl = newfs_ll_ioctl,	 /* 读取设备统计，供基准测试使用 */
+#if FUSE_USE_VERSION >= 30
+	.readdirplus = newfs_ll_readdirplus, /* 填充dentrys并带上属性，ls -l无需逐个getattr */
+#endif
+};
+/******************************************************************************
+ * SECTION: 辅助函数
+ *******************************************************************************/
+/**
+ * @brief 由内核inode号找到缓存中的inode；内核只会使用仍持有lookup引用的inode号，
+ * 因此对应inode一定在缓存中
+ *
+ * @param ino 内核inode号
+ * @return struct nfs_inode* 非法时返回NULL
+ */
+static struct nfs_inode *nfs_ll_iget(fuse_ino_t ino)
+{
+	if (ino < FUSE_ROOT_ID || ino - FUSE_ROOT_ID >= (fuse_ino_t)nfs_super.max_ino)
+	{
+		return NULL;
+	}
+	return nfs_super.inodes[ino - FUSE_ROOT_ID];
+}
+
+/**
+ * @brief 填充inode属性，与newfs_getattr保持一致
+ *
+ * @param inode
+ * @param nfs_stat
+ */
+static void nfs_ll_fill_stat(struct nfs_inode *inode, struct stat *nfs_stat)
+{
+	memset(nfs_stat, 0, sizeof(struct stat));
+	nfs_stat->st_ino = NFS_LL_INO(inode->ino);
+	if (NFS_IS_DIR(inode))
+	{
+		nfs_stat->st_mode = S_IFDIR | NFS_DEFAULT_PERM;
+		nfs_dir_lock(inode, FALSE); // dir_cnt由目录自身的锁保护
+		nfs_stat->st_size = inode->dir_cnt * sizeof(struct nfs_dentry_d);
+		nfs_dir_unlock(inode);
+	}
+	else
+	{
+		nfs_stat->st_mode = S_IFREG | NFS_DEFAULT_PERM;
+		pthread_mutex_lock(&inode->lock);
+		nfs_stat->st_size = inode->size;
+		pthread_mutex_unlock(&inode->lock);
+	}
+	nfs_stat->st_nlink = 1;
+	nfs_stat->st_uid = getuid();
+	nfs_stat->st_gid = getgid();
+	nfs_stat->st_blksize = NFS_BLK_SZ();
+	nfs_stat->st_atime = time(NULL);
+	nfs_stat->st_mtime = time(NULL);
+
+	if (inode->ino == NFS_ROOT_INO)
+	{
+		nfs_stat->st_size = nfs_super.sz_usage;
+		nfs_stat->st_blocks = NFS_DISK_SZ() / NFS_BLK_SZ();
+		nfs_stat->st_nlink = 2; /* !特殊，根目录link数为2 */
+	}
+}
+
+/**
+ * @brief 填充返回给内核的entry
+ *
+ * @param inode
+ * @param e
+ */
+static void nfs_ll_fill_entry(struct nfs_inode *inode, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = NFS_LL_INO(inode->ino);
+	e->attr_timeout = newfs_options.attr_timeout;
+	e->entry_timeout = newfs_options.entry_timeout;
+	nfs_ll_fill_stat(inode, &e->attr);
+}
+
+/**
+ * @brief entry交给内核后记一次lookup引用；
+ * 调用者持有父目录的锁，保证期间inode不会被回收
+ *
+ * @param inode
+ */
+static void nfs_ll_hold(struct nfs_inode *inode)
+{
+	pthread_mutex_lock(&nfs_super.icache_lock);
+	inode->nlookup++;
+	pthread_mutex_unlock(&nfs_super.icache_lock);
+}
+
+/**
+ * @brief 释放nlookup个lookup引用，减到0时回收inode：
+ *  - 已被删除(link为0)：释放inode及其磁盘空间
+ *  - 仍在目录树中：在父目录写锁下写回并释放内存
+ * 拿父目录锁之前先自持一个引用并钉住父目录，避免期间被unlink释放或父目录被回收
+ *
+ * @param inode
+ * @param nlookup
+ */
+static void nfs_ll_put(struct nfs_inode *inode, unsigned long nlookup)
+{
+	struct nfs_inode *dir;
+	struct nfs_dentry *dentry = inode->dentry;
+	boolean busy, orphan;
+
+	if (inode->ino == NFS_ROOT_INO)
+	{
+		return; // 根目录常驻内存
+	}
+	nfs_journal_start(NFS_JOURNAL_OP_BLKS); // 释放inode时改动位图，先于目录锁
+	pthread_mutex_lock(&nfs_super.icache_lock);
+	if (inode->nlookup > nlookup)
+	{
+		inode->nlookup -= nlookup;
+		pthread_mutex_unlock(&nfs_super.icache_lock);
+		nfs_journal_stop();
+		return;
+	}
+	if (inode->link == 0)
+	{
+		inode->nlookup = 0;
+		busy = inode->nopen != 0; // 还有打开的句柄时由最后一次release释放
+		pthread_mutex_unlock(&nfs_super.icache_lock);
+		if (!busy)
+		{
+			nfs_free_inode(inode);
+			free(dentry);
+		}
+		nfs_journal_stop();
+		return;
+	}
+	inode->nlookup = 1;
+	dir = dentry->parent->inode;
+	dir->nlookup++;
+	pthread_mutex_unlock(&nfs_super.icache_lock);
+
+	nfs_dir_lock(dir, TRUE);
+	pthread_mutex_lock(&nfs_super.icache_lock);
+	inode->nlookup--;
+	busy = inode->nlookup != 0 || inode->nopen != 0;
+	orphan = inode->link == 0;
+	pthread_mutex_unlock(&nfs_super.icache_lock);
+	if (!busy && orphan)
+	{
+		nfs_free_inode(inode);
+		free(dentry);
+	}
+	else if (!busy)
+	{
+		// 子项仍被缓存的目录返回BUSY，留待子项回收后随父目录一起回收
+		nfs_evict_inode(inode);
+	}
+	nfs_dir_unlock(dir);
+	nfs_journal_stop();
+	nfs_ll_put(dir, 1);
+}
+
+/**
+ * @brief 在父目录下创建文件或目录，mknod和mkdir共用
+ *
+ * @param req
+ * @param parent 父目录inode号
+ * @param name
+ * @param ftype
+ */
+static void nfs_ll_make(fuse_req_t req, fuse_ino_t parent, const char *name, FILE_TYPE ftype)
+{
+	struct nfs_inode *dir = nfs_ll_iget(parent);
+	struct nfs_dentry *dentry;
+	struct fuse_entry_param e;
+	int ret;
+
+	if (dir == NULL || !NFS_IS_DIR(dir))
+	{
+		fuse_reply_err(req, dir == NULL ? ESTALE : ENOTDIR);
+		return;
+	}
+	// 父目录加写锁，检查与创建之间不会有同名项插入
+	nfs_journal_start(NFS_JOURNAL_OP_BLKS);
+	nfs_dir_lock(dir, TRUE);
+	if (nfs_find_dentry(dir, name) != NULL)
+	{
+		ret = -NFS_ERROR_EXISTS;
+	}
+	else
+	{
+		ret = nfs_make_node(dir, name, ftype, &dentry);
+	}
+	if (ret == NFS_ERROR_NONE)
+	{
+		nfs_ll_fill_entry(dentry->inode, &e);
+		nfs_ll_hold(dentry->inode);
+	}
+	nfs_dir_unlock(dir);
+	nfs_journal_stop();
+
+	if (ret != NFS_ERROR_NONE)
+	{
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+/**
+ * @brief 从父目录删除文件或目录，unlink和rmdir共用；
+ * 内核仍持有引用时只摘除目录项，inode及其空间在最后一次forget时释放
+ *
+ * @param req
+ * @param parent 父目录inode号
+ * @param name
+ * @param is_dir
+ */
+static void nfs_ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name, boolean is_dir)
+{
+	struct nfs_inode *dir = nfs_ll_iget(parent);
+	struct nfs_dentry *dentry;
+	struct nfs_inode *inode = NULL;
+	boolean free_now;
+	int ret = NFS_ERROR_NONE;
+
+	if (dir == NULL || !NFS_IS_DIR(dir))
+	{
+		fuse_reply_err(req, dir == NULL ? ESTALE : ENOTDIR);
+		return;
+	}
+	nfs_journal_start(NFS_JOURNAL_OP_BLKS);
+	nfs_dir_lock(dir, TRUE);
+	dentry = nfs_find_dentry(dir, name);
+	if (dentry != NULL)
+	{
+		inode = nfs_load_inode(dentry);
+	}
+	if (inode == NULL)
+	{
+		ret = dentry == NULL ? NFS_ERROR_NOTFOUND : NFS_ERROR_IO;
+		goto out;
+	}
+	if (NFS_IS_DIR(inode) && !is_dir)
+	{
+		ret = NFS_ERROR_ISDIR;
+		goto out;
+	}
+	if (!NFS_IS_DIR(inode) && is_dir)
+	{
+		ret = ENOTDIR;
+		goto out;
+	}
+	if (is_dir)
+	{
+		/* 等待目录内正在进行的操作结束 */
+		nfs_dir_lock(inode, TRUE);
+		if (inode->dir_cnt != 0)
+		{
+			nfs_dir_unlock(inode);
+			ret = NFS_ERROR_NOTEMPTY;
+			goto out;
+		}
+	}
+	nfs_drop_dentry(dir, dentry);
+	if (is_dir)
+	{
+		nfs_dir_unlock(inode);
+	}
+
+	pthread_mutex_lock(&nfs_super.icache_lock);
+	inode->link = 0;
+	free_now = inode->nlookup == 0 && inode->nopen == 0;
+	pthread_mutex_unlock(&nfs_super.icache_lock);
+	if (free_now)
+	{
+		nfs_free_inode(inode);
+		free(dentry);
+	}
+out:
+	nfs_dir_unlock(dir);
+	nfs_journal_stop();
+	fuse_reply_err(req, ret);
+}
+/******************************************************************************
+ * SECTION: 低层操作实现
+ *******************************************************************************/
+/**
+ * @brief 挂载（mount）文件系统
+ *
+ * @param userdata 可忽略
+ * @param conn 可忽略，一些建立连接相关的信息
+ */
+void newfs_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	newfs_conn_init(conn);
+#if FUSE_USE_VERSION >= 30
+	if (conn->capable & FUSE_CAP_READDIRPLUS)
+	{
+		conn->want |= FUSE_CAP_READDIRPLUS;
+	}
+#endif
+	if (nfs_mount(newfs_options) != NFS_ERROR_NONE)
+	{
+		NFS_DBG("[%s] mount error\n", __func__);
+		fuse_session_exit(nfs_ll_session);
+	}
+}
+
+/**
+ * @brief 卸载（umount）文件系统；卸载时内核不再发送forget，
+ * 已删除但仍被引用的inode由nfs_umount释放
+ *
+ * @param userdata 可忽略
+ */
+void newfs_ll_destroy(void *userdata)
+{
+	if (nfs_umount() != NFS_ERROR_NONE)
+	{
+		NFS_DBG("[%s] unmount error\n", __func__);
+	}
+}
+
+/**
+ * @brief 在父目录中查找一级名字，只加父目录的读锁
+ *
+ * @param req
+ * @param parent 父目录inode号
+ * @param name
+ */
+void newfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct nfs_inode *dir = nfs_ll_iget(parent);
+	struct nfs_dentry *dentry;
+	struct nfs_inode *inode = NULL;
+	struct fuse_entry_param e;
+
+	if (dir == NULL || !NFS_IS_DIR(dir))
+	{
+		fuse_reply_err(req, dir == NULL ? ESTALE : ENOTDIR);
+		return;
+	}
+	nfs_dir_lock(dir, FALSE);
+	dentry = nfs_find_dentry(dir, name);
+	if (dentry != NULL)
+	{
+		inode = nfs_load_inode(dentry);
+	}
+	if (inode != NULL)
+	{
+		nfs_ll_fill_entry(inode, &e);
+		nfs_ll_hold(inode);
+	}
+	nfs_dir_unlock(dir);
+
+	if (inode == NULL)
+	{
+		fuse_reply_err(req, dentry == NULL ? NFS_ERROR_NOTFOUND : NFS_ERROR_IO);
+		return;
+	}
+	fuse_reply_entry(req, &e);
+}
+
+/**
+ * @brief 内核释放nlookup个lookup引用
+ *
+ * @param req
+ * @param ino
+ * @param nlookup
+ */
+void newfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	struct nfs_inode *inode = nfs_ll_iget(ino);
+	if (inode != NULL)
+	{
+		nfs_ll_put(inode, nlookup);
+	}
+	fuse_reply_none(req);
+}
+
+/**
+ * @brief 获取文件或目录的属性，直接按inode号取缓存，无需路径解析
+ *
+ * @param req
+ * @param ino
+ * @param fi 可忽略
+ */
+void newfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct nfs_inode *inode = nfs_ll_iget(ino);
+	struct stat nfs_stat;
+
+	if (inode == NULL)
+	{
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	nfs_ll_fill_stat(inode, &nfs_stat);
+	fuse_reply_attr(req, &nfs_stat, newfs_options.attr_timeout);
+}
+
+/**
+ * @brief 修改属性；与newfs_utimens一致忽略时间修改，只处理改变文件大小
+ *
+ * @param req
+ * @param ino
+ * @param attr
+ * @param to_set 需要修改的属性
+ * @param fi 可忽略
+ */
+void newfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+					  struct fuse_file_info *fi)
+{
+	struct nfs_inode *inode = nfs_ll_iget(ino);
+	struct stat nfs_stat;
+	int ret;
+
+	if (inode == NULL)
+	{
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	if (to_set & FUSE_SET_ATTR_SIZE)
+	{
+		if (NFS_IS_DIR(inode))
+		{
+			fuse_reply_err(req, NFS_ERROR_ISDIR);
+			return;
+		}
+		if (attr->st_size > NFS_MAX_FILE_SZ())
+		{
+			fuse_reply_err(req, NFS_ERROR_FBIG);
+			return;
+		}
+		nfs_journal_start(NFS_JOURNAL_OP_BLKS);
+		pthread_mutex_lock(&inode->lock);
+		ret = nfs_file_resize(inode, attr->st_size);
+		pthread_mutex_unlock(&inode->lock);
+		nfs_journal_stop();
+		if (ret < 0)
+		{
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+	nfs_ll_fill_stat(inode, &nfs_stat);
+	fuse_reply_attr(req, &nfs_stat, newfs_options.attr_timeout);
+}
+
+/**
+ * @brief 创建文件
+ *
+ * @param req
+ * @param parent 父目录inode号
+ * @param name
+ * @param mode 创建文件的模式
+ * @param rdev 设备类型，可忽略
+ */
+void newfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+	nfs_ll_make(req, parent, name, S_ISDIR(mode) ? NFS_DIR : NFS_FILE);
+}
+
+/**
+ * @brief 创建目录
+ *
+ * @param req
+ * @param parent 父目录inode号
+ * @param name
+ * @param mode 可忽略
+ */
+void newfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	nfs_ll_make(req, parent, name, NFS_DIR);
+}
+
+/**
+ * @brief 删除文件
+ *
+ * @param req
+ * @param parent 父目录inode号
+ * @param name
+ */
+void newfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	nfs_ll_remove(req, parent, name, FALSE);
+}
+
+/**
+ * @brief 删除空目录
+ *
+ * @param req
+ * @param parent 父目录inode号
+ * @param name
+ */
+void newfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	nfs_ll_remove(req, parent, name, TRUE);
+}
+
+/**
+ * @brief 遍历目录项，一次尽量填满size字节，readdir和readdirplus共用；
+ * 偏移0、1为"."和".."，偏移n(n>=2)对应第n-2个子项
+ * plus时每个子项附带完整entry，放入缓冲区的子项各记一次lookup引用
+ *
+ * @param req
+ * @param ino 目录inode号
+ * @param size 内核缓冲区大小
+ * @param off 从第几个目录项开始
+ * @param plus
+ */
+static void nfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, boolean plus)
+{
+	struct nfs_inode *inode = nfs_ll_iget(ino);
+	struct nfs_dentry *sub_dentry;
+	struct nfs_inode *sub_inode;
+	struct fuse_entry_param e;
+	const char *fname;
+	size_t pos = 0, len;
+	char *buf;
+	off_t cur;
+
+	if (inode == NULL || !NFS_IS_DIR(inode))
+	{
+		fuse_reply_err(req, inode == NULL ? ESTALE : ENOTDIR);
+		return;
+	}
+	buf = (char *)malloc(size);
+
+	nfs_dir_lock(inode, FALSE);
+	sub_dentry = off > 2 ? nfs_get_dentry(inode, off - 2) : inode->dentrys;
+	for (cur = off;; cur++)
+	{
+		if (cur < 2)
+		{
+			fname = cur == 0 ? "." : "..";
+		}
+		else if (sub_dentry != NULL)
+		{
+			fname = sub_dentry->fname;
+		}
+		else
+		{
+			break;
+		}
+		/* 先只算所需空间，放不下就不再加载子inode */
+		len = NFS_LL_DIRENT_SZ(req, fname, plus);
+		if (len > size - pos)
+		{
+			break;
+		}
+
+		sub_inode = NULL;
+		memset(&e, 0, sizeof(struct fuse_entry_param)); // e.ino为0时内核只取名字和类型
+		if (cur < 2)
+		{
+			e.attr.st_mode = S_IFDIR;
+			e.attr.st_ino = (cur == 0 || inode->ino == NFS_ROOT_INO)
+								? ino
+								: NFS_LL_INO(inode->dentry->parent->inode->ino);
+		}
+		else
+		{
+			if (plus)
+			{
+				sub_inode = nfs_load_inode(sub_dentry);
+			}
+			if (sub_inode != NULL)
+			{
+				nfs_ll_fill_entry(sub_inode, &e);
+				nfs_ll_hold(sub_inode);
+			}
+			else
+			{
+				e.attr.st_mode = sub_dentry->ftype == NFS_DIR ? S_IFDIR : S_IFREG;
+				e.attr.st_ino = NFS_LL_INO(sub_dentry->ino);
+			}
+			sub_dentry = sub_dentry->brother;
+		}
+#if FUSE_USE_VERSION >= 30
+		if (plus)
+		{
+			fuse_add_direntry_plus(req, buf + pos, size - pos, fname, &e, cur + 1);
+		}
+		else
+#endif
+		{
+			fuse_add_direntry(req, buf + pos, size - pos, fname, &e.attr, cur + 1);
+		}
+		pos += len;
+	}
+	nfs_dir_unlock(inode);
+
+	fuse_reply_buf(req, buf, pos);
+	free(buf);
+}
+
+/**
+ * @brief 遍历目录项
+ *
+ * @param req
+ * @param ino 目录inode号
+ * @param size 内核缓冲区大小
+ * @param off 从第几个目录项开始
+ * @param fi 可忽略
+ */
+void newfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+					  struct fuse_file_info *fi)
+{
+	nfs_ll_readdir(req, ino, size, off, FALSE);
+}
+
+#if FUSE_USE_VERSION >= 30
+/**
+ * @brief 遍历目录项并附带属性，ls -l不再对每一项单独lookup/getattr
+ *
+ * @param req
+ * @param ino 目录inode号
+ * @param size 内核缓冲区大小
+ * @param off 从第几个目录项开始
+ * @param fi 可忽略
+ */
+void newfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+						  struct fuse_file_info *fi)
+{
+	nfs_ll_readdir(req, ino, size, off, TRUE);
+}
+#endif
+
+/**
+ * @brief 打开文件，为其建立句柄保存在fh中，记录读写位置供预读判断顺序访问；
+ * 内核在打开期间持有lookup引用，inode不会被回收
+ *
+ * @param req
+ * @param ino
+ * @param fi 文件信息
+ */
+void newfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct nfs_inode *inode = nfs_ll_iget(ino);
+
+	if (inode == NULL)
+	{
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	if (NFS_IS_DIR(inode))
+	{
+		fuse_reply_err(req, NFS_ERROR_ISDIR);
+		return;
+	}
+	fi->fh = (uint64_t)(uintptr_t)nfs_file_open(inode);
+	if (fuse_reply_open(req, fi) != 0)
+	{
+		nfs_file_close(NFS_FH(fi)); // 打开被中断，内核不会再发release
+	}
+}
+
+/**
+ * @brief 关闭文件，释放open时建立的句柄
+ *
+ * @param req
+ * @param ino
+ * @param fi 文件信息
+ */
+void newfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	nfs_file_close(NFS_FH(fi));
+	fuse_reply_err(req, NFS_ERROR_NONE);
+}
+
+/**
+ * @brief 关闭文件描述符时调用，不写回，见newfs_flush
+ *
+ * @param req
+ * @param ino
+ * @param fi 文件信息
+ */
+void newfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	fuse_reply_err(req, NFS_ERROR_NONE);
+}
+
+/**
+ * @brief fsync/fdatasync与目录的fsync，只写该inode自己的脏块和改动过的元数据，见nfs_fsync_inode
+ *
+ * @param req
+ * @param ino
+ * @param datasync 非0时为fdatasync
+ * @param fi 文件信息，目录没有句柄
+ */
+void newfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	struct nfs_inode *inode = nfs_ll_iget(ino);
+
+	if (inode == NULL)
+	{
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	fuse_reply_err(req, -nfs_fsync_inode(inode));
+}
+
+/**
+ * @brief 读文件：在文件锁内把缓存块和设备上的干净块直接交给fuse_reply_data，
+ * 它返回前数据已写入/dev/fuse或管道，中间没有额外的缓冲区
+ *
+ * @param req
+ * @param ino
+ * @param size 读取的字节数
+ * @param off 相对文件的偏移
+ * @param fi open过的句柄在fi->fh中，据此判断是否顺序读
+ */
+void newfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+				   struct fuse_file_info *fi)
+{
+	struct nfs_inode *inode = nfs_ll_iget(ino);
+	struct nfs_file *file = fi != NULL && fi->fh != 0 ? NFS_FH(fi) : NULL;
+	struct fuse_bufvec *bufv;
+
+	if (inode == NULL)
+	{
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	if (NFS_IS_DIR(inode))
+	{
+		fuse_reply_err(req, NFS_ERROR_ISDIR);
+		return;
+	}
+	pthread_mutex_lock(&inode->lock);
+	bufv = nfs_file_read_buf(inode, file, size, off, TRUE);
+	if (bufv != NULL)
+	{
+		fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	}
+	else
+	{
+		fuse_reply_err(req, NFS_ERROR_IO);
+	}
+	pthread_mutex_unlock(&inode->lock);
+	free(bufv);
+}
+
+/**
+ * @brief 写入文件：内核开启splice写时bufv是管道fd，数据由管道直接拷入缓存块
+ *
+ * @param req
+ * @param ino
+ * @param bufv 写入的内容
+ * @param off 相对文件的偏移
+ * @param fi open过的句柄在fi->fh中
+ */
+void newfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off,
+						struct fuse_file_info *fi)
+{
+	struct nfs_inode *inode = nfs_ll_iget(ino);
+	struct nfs_file *file = fi != NULL && fi->fh != 0 ? NFS_FH(fi) : NULL;
+	int ret;
+
+	if (inode == NULL)
+	{
+		fuse_reply_err(req, ESTALE);
+		return;
+	}
+	if (NFS_IS_DIR(inode))
+	{
+		fuse_reply_err(req, NFS_ERROR_ISDIR);
+		return;
+	}
+	nfs_journal_start(NFS_JOURNAL_OP_BLKS); // 扩展文件时改动inode和数据位图
+	pthread_mutex_lock(&inode->lock);
+	ret = nfs_file_write_buf(inode, file, bufv, off);
+	pthread_mutex_unlock(&inode->lock);
+	nfs_journal_stop();
+	nfs_balance_dirty(); // 脏块过多时等后台线程写回，再回复内核
+	if (ret < 0)
+	{
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_write(req, ret);
+}
+
+/**
+ * @brief ioctl，只支持读取设备统计，见nfs_driver_ioctl；结果按命令编码的大小整块返回
+ *
+ * @param req
+ * @param ino
+ * @param cmd 命令
+ * @param arg 用户态地址，不使用
+ * @param fi 文件信息
+ * @param flags FUSE_IOCTL_*
+ * @param in_buf 输入数据，读取类命令没有
+ * @param in_bufsz
+ * @param out_bufsz 内核可接收的输出字节数
+ */
+void newfs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi,
+					unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+	uint8_t out[sizeof(struct ddriver_state_ext)]; // 支持的命令中最大的输出
+	size_t size = _IOC_SIZE((unsigned int)cmd);
+	int ret;
+
+	if (flags & FUSE_IOCTL_COMPAT)
+	{
+		fuse_reply_err(req, ENOSYS);
+		return;
+	}
+	if (size > sizeof(out) || size > out_bufsz)
+	{
+		fuse_reply_err(req, NFS_ERROR_NOTTY);
+		return;
+	}
+	ret = nfs_driver_ioctl((unsigned int)cmd, out); // _IOR的最高位为1，不能符号扩展
+	if (ret < 0)
+	{
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_ioctl(req, 0, out, size);
+}
+/******************************************************************************
+ * SECTION: FUSE入口
+ *******************************************************************************/
+/**
+ * @brief 以低层接口挂载并运行会话循环，-s/-f/-d等参数与高层接口一致
+ *
+ * @param args 已去除newfs自定义选项的参数
+ * @return int
+ */
+int newfs_ll_main(struct fuse_args *args)
+{
+#if FUSE_USE_VERSION >= 30
+	struct fuse_cmdline_opts opts;
+	int ret = -1;
+
+	if (fuse_parse_cmdline(args, &opts) != 0)
+	{
+		return 1;
+	}
+	if (opts.show_help || opts.mountpoint == NULL)
+	{
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		free(opts.mountpoint);
+		return opts.show_help ? 0 : 1;
+	}
+	nfs_ll_session = fuse_session_new(args, &ll_operations, sizeof(ll_operations), NULL);
+	if (nfs_ll_session != NULL)
+	{
+		if (fuse_set_signal_handlers(nfs_ll_session) == 0)
+		{
+			if (fuse_session_mount(nfs_ll_session, opts.mountpoint) == 0)
+			{
+				fuse_daemonize(opts.foreground);
+				ret = opts.singlethread ? fuse_session_loop(nfs_ll_session)
+										: fuse_session_loop_mt(nfs_ll_session, opts.clone_fd);
+				fuse_session_unmount(nfs_ll_session);
+			}
+			fuse_remove_signal_handlers(nfs_ll_session);
+		}
+		fuse_session_destroy(nfs_ll_session);
+	}
+	free(opts.mountpoint);
+	return ret ? 1 : 0;
+#else
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int multithreaded, foreground;
+	int ret = -1;
+
+	if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+	{
+		return 1;
+	}
+	ch = fuse_mount(mountpoint, args);
+	if (ch != NULL)
+	{
+		nfs_ll_session = fuse_lowlevel_new(args, &ll_operations, sizeof(ll_operations), NULL);
+		if (nfs_ll_session != NULL)
+		{
+			if (fuse_set_signal_handlers(nfs_ll_session) != -1)
+			{
+				fuse_session_add_chan(nfs_ll_session, ch);
+				fuse_daemonize(foreground);
+				ret = multithreaded ? fuse_session_loop_mt(nfs_ll_session)
+									: fuse_session_loop(nfs_ll_session);
+				fuse_remove_signal_handlers(nfs_ll_session);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(nfs_ll_session);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	return ret ? 1 : 0;
+#endif
+}
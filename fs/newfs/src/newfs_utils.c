@@ -58,18 +58,12 @@ int nfs_driver_read(int offset, uint8_t *out_content, int size)
     int bias = offset - offset_aligned;
     int size_aligned = NFS_ROUND_UP((size + bias), NFS_BLK_SZ());
     uint8_t *temp_content = (uint8_t *)malloc(size_aligned);
-    uint8_t *cur = temp_content;
 
-    // 把磁盘头到down位置
-    ddriver_seek(NFS_DRIVER(), offset_aligned, SEEK_SET);
-
-    // 按照磁盘块大小(512B)去读
-    while (size_aligned != 0)
+    // 定位读，不依赖共享的磁盘头，多线程下可并发调用；整个范围一次下发
+    if (ddriver_pread(NFS_DRIVER(), (char *)temp_content, size_aligned, offset_aligned) < 0)
     {
-        // read(NFS_DRIVER(), cur, NFS_IO_SZ());
-        ddriver_read(NFS_DRIVER(), cur, NFS_IO_SZ());
-        cur += NFS_IO_SZ();
-        size_aligned -= NFS_IO_SZ();
+        free(temp_content);
+        return -NFS_ERROR_IO;
     }
     memcpy(out_content, temp_content + bias, size);
     free(temp_content);
@@ -91,24 +85,45 @@ int nfs_driver_write(int offset, uint8_t *in_content, int size)
     int bias = offset - offset_aligned;
     int size_aligned = NFS_ROUND_UP((size + bias), NFS_BLK_SZ());
     uint8_t *temp_content = (uint8_t *)malloc(size_aligned);
-    uint8_t *cur = temp_content;
+    int ret = NFS_ERROR_NONE;
     // 读出需要的磁盘块到内存
-    nfs_driver_read(offset_aligned, temp_content, size_aligned);
+    if (nfs_driver_read(offset_aligned, temp_content, size_aligned) != NFS_ERROR_NONE)
+    {
+        free(temp_content);
+        return -NFS_ERROR_IO;
+    }
     // 在内存覆盖指定内容
     memcpy(temp_content + bias, in_content, size);
 
-    ddriver_seek(NFS_DRIVER(), offset_aligned, SEEK_SET);
-
-    // 将读出的磁盘块再依次写回到内存
-    while (size_aligned != 0)
+    // 将磁盘块一次写回
+    if (ddriver_pwrite(NFS_DRIVER(), (char *)temp_content, size_aligned, offset_aligned) < 0)
     {
-        ddriver_write(NFS_DRIVER(), cur, NFS_IO_SZ());
-        cur += NFS_IO_SZ();
-        size_aligned -= NFS_IO_SZ();
+        ret = -NFS_ERROR_IO;
     }
 
     free(temp_content);
-    return NFS_ERROR_NONE;
+    return ret;
+}
+
+/**
+ * @brief 转发只读的设备统计类ioctl：ddriver的计数在newfs进程内，
+ * 挂载后别的进程(如tests/bench/meta_bench)经由FUSE ioctl读取
+ *
+ * @param cmd IOC_REQ_DEVICE_STATE、IOC_REQ_DEVICE_STATE_EXT或IOC_REQ_DEVICE_CLOCK
+ * @param arg 大小为_IOC_SIZE(cmd)的输出缓冲区
+ * @return int 0成功，其余命令返回-NFS_ERROR_NOTTY
+ */
+int nfs_driver_ioctl(unsigned long cmd, void *arg)
+{
+    switch (cmd)
+    {
+    case IOC_REQ_DEVICE_STATE:
+    case IOC_REQ_DEVICE_STATE_EXT:
+    case IOC_REQ_DEVICE_CLOCK:
+        return ddriver_ioctl(NFS_DRIVER(), cmd, arg) < 0 ? -NFS_ERROR_IO : NFS_ERROR_NONE;
+    default:
+        return -NFS_ERROR_NOTTY;
+    }
 }
 
 /**
@@ -129,195 +144,1084 @@ int nfs_alloc_dentry(struct nfs_inode *inode, struct nfs_dentry *dentry, int all
         dentry->brother = inode->dentrys;
         inode->dentrys = dentry;
     }
-    printf("*****alloc_dentry for %s  \n", dentry->fname);
-    inode->dir_cnt++;
-    printf("*****%s.dir_cnt=%d\n", inode->dentry->fname ,inode->dir_cnt);
-    // 如果是目录文件，还需要检查当前indn对应的数据块有没有满
-    if (allow_mdata_update==1 && (inode->dir_cnt % NFS_DENTRY_PER_DATABLK() == 1))
+    printf("*****alloc_dentry for %s  \n", dentry->fname);
+    inode->dir_cnt++;
+    printf("*****%s.dir_cnt=%d\n", inode->dentry->fname ,inode->dir_cnt);
+    // 如果是目录文件，还需要检查当前indn对应的数据块有没有满
+    if (allow_mdata_update==1 && (inode->dir_cnt % NFS_DENTRY_D_PER_DATABLK() == 1))
+    {
+        int cur_blk = inode->dir_cnt / NFS_DENTRY_D_PER_DATABLK();
+        int dno;
+        if (cur_blk >= NFS_DATA_PER_FILE || (dno = nfs_alloc_data_blk()) < 0)
+        {
+            inode->dentrys = dentry->brother;
+            dentry->brother = NULL;
+            inode->dir_cnt--;
+            return -NFS_ERROR_NOSPACE;
+        }
+        inode->used_block_num[cur_blk] = dno;
+    }
+    return inode->dir_cnt;
+}
+
+/**
+ * @brief 从目录inode中摘除dentry，与nfs_alloc_dentry对应；
+ * 目录项减少到刚好空出最后一个数据块时释放该块。改动记入日志
+ * @param inode
+ * @param dentry
+ * @return int
+ */
+int nfs_drop_dentry(struct nfs_inode *inode, struct nfs_dentry *dentry)
+{
+    struct nfs_dentry **cursor = &inode->dentrys;
+    while (*cursor != NULL && *cursor != dentry)
+    {
+        cursor = &(*cursor)->brother;
+    }
+    if (*cursor == NULL)
+    {
+        return -NFS_ERROR_NOTFOUND;
+    }
+    *cursor = dentry->brother;
+    dentry->brother = NULL;
+    inode->dir_cnt--;
+    if (inode->dir_cnt % NFS_DENTRY_D_PER_DATABLK() == 0)
+    {
+        nfs_free_data_blk(inode->used_block_num[inode->dir_cnt / NFS_DENTRY_D_PER_DATABLK()]);
+        nfs_log_maps();
+    }
+    nfs_log_inode(inode);
+    return inode->dir_cnt;
+}
+
+/**
+ * @brief 在数据位图上分配一个空闲数据块
+ *
+ * @return int 数据块号，失败返回-NFS_ERROR_NOSPACE
+ */
+int nfs_alloc_data_blk()
+{
+    int byte_cursor, bit_cursor, dno_cursor = 0;
+    pthread_mutex_lock(&nfs_super.map_lock);
+    for (byte_cursor = 0; byte_cursor < NFS_BLKS_SZ(nfs_super.map_data_blks); byte_cursor++)
+    {
+        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++)
+        {
+            if (dno_cursor == nfs_super.max_data)
+            {
+                pthread_mutex_unlock(&nfs_super.map_lock);
+                return -NFS_ERROR_NOSPACE;
+            }
+            // 释放尚未提交的块暂不分配
+            if ((nfs_super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0 &&
+                !nfs_journal_busy(NFS_BLK_NO(NFS_DATA_OFS(dno_cursor))))
+            {
+                nfs_super.map_data[byte_cursor] |= (0x1 << bit_cursor);
+                nfs_dirty_map(TRUE, dno_cursor);
+                pthread_mutex_unlock(&nfs_super.map_lock);
+                printf("*****new databcok bytes:%d bit %d\n", byte_cursor, bit_cursor);
+                return dno_cursor;
+            }
+            dno_cursor++;
+        }
+    }
+    pthread_mutex_unlock(&nfs_super.map_lock);
+    return -NFS_ERROR_NOSPACE;
+}
+
+/**
+ * @brief 释放数据块，清除位图；使用日志时交给日志，等释放它的事务提交后才可重新分配和discard
+ *
+ * @param dno
+ */
+static int nfs_flush_discards_locked();
+
+void nfs_free_data_blk(int dno)
+{
+    pthread_mutex_lock(&nfs_super.map_lock);
+    nfs_super.map_data[dno / UINT8_BITS] &= ~(0x1 << (dno % UINT8_BITS));
+    nfs_dirty_map(TRUE, dno);
+    if (!nfs_journal_free(NFS_BLK_NO(NFS_DATA_OFS(dno))))
+    {
+        nfs_release_data_blk(dno);
+    }
+    pthread_mutex_unlock(&nfs_super.map_lock);
+}
+
+/**
+ * @brief 已释放的数据块记入待discard批次，批次满时统一下发，调用者持有map_lock
+ *
+ * @param dno
+ */
+void nfs_release_data_blk(int dno)
+{
+    nfs_super.discard_dnos[nfs_super.discard_cnt++] = dno;
+    if (nfs_super.discard_cnt == NFS_DISCARD_BATCH)
+    {
+        nfs_flush_discards_locked();
+    }
+}
+
+static int nfs_cmp_dno(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/**
+ * @brief 将待discard的数据块排序，合并成连续区间后下发给设备；
+ * 期间又被重新分配的块跳过
+ * @return int
+ */
+int nfs_flush_discards()
+{
+    int ret;
+    pthread_mutex_lock(&nfs_super.map_lock);
+    ret = nfs_flush_discards_locked();
+    pthread_mutex_unlock(&nfs_super.map_lock);
+    return ret;
+}
+
+/* 调用者持有map_lock */
+static int nfs_flush_discards_locked()
+{
+    struct ddriver_range range;
+    int idx = 0, end, dno;
+    qsort(nfs_super.discard_dnos, nfs_super.discard_cnt, sizeof(int), nfs_cmp_dno);
+    while (idx < nfs_super.discard_cnt)
+    {
+        dno = nfs_super.discard_dnos[idx++];
+        if (nfs_super.map_data[dno / UINT8_BITS] & (0x1 << (dno % UINT8_BITS)))
+        {
+            continue;
+        }
+        end = dno + 1;
+        while (idx < nfs_super.discard_cnt && nfs_super.discard_dnos[idx] <= end &&
+               !(nfs_super.map_data[end / UINT8_BITS] & (0x1 << (end % UINT8_BITS))))
+        {
+            if (nfs_super.discard_dnos[idx++] == end)
+            {
+                end++;
+            }
+        }
+        range.offset = NFS_DATA_OFS(dno);
+        range.len = NFS_BLKS_SZ(end - dno);
+        if (ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_DISCARD, &range) < 0)
+        {
+            NFS_DBG("[%s] discard error\n", __func__);
+        }
+    }
+    nfs_super.discard_cnt = 0;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 分配一个inode，占用索引位图；
+ * 如果dentry是文件类型，还开辟内存，但未修改数据位图
+ * @param dentry 该dentry指向分配的inode
+ * @return nfs_inode
+ */
+struct nfs_inode *nfs_alloc_inode(struct nfs_dentry *dentry)
+{
+    struct nfs_inode *inode;
+    int byte_cursor = 0;
+    int bit_cursor = 0;
+    int ino_cursor = 0; // 记录inode块号
+    boolean is_find_free_entry = FALSE;
+
+    // 在索引节点位图上查找空闲的索引节点
+    pthread_mutex_lock(&nfs_super.map_lock);
+    for (byte_cursor = 0; byte_cursor < NFS_BLKS_SZ(nfs_super.map_inode_blks); byte_cursor++)
+    {
+        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++)
+        {
+            if ((nfs_super.map_inode[byte_cursor] & (0x1 << bit_cursor)) == 0)
+            {
+                /* 当前ino_cursor位置空闲 */
+                // 更新位图
+                nfs_super.map_inode[byte_cursor] |= (0x1 << bit_cursor);
+                is_find_free_entry = TRUE;
+                break;
+            }
+            ino_cursor++;
+        }
+        if (is_find_free_entry)
+        {
+            break;
+        }
+    }
+
+    // 未找到空闲的inode
+    if (!is_find_free_entry || ino_cursor >= nfs_super.max_ino)
+    {
+        if (is_find_free_entry)
+        {
+            nfs_super.map_inode[byte_cursor] &= ~(0x1 << bit_cursor);
+        }
+        pthread_mutex_unlock(&nfs_super.map_lock);
+        return NULL;
+    }
+    nfs_dirty_map(FALSE, ino_cursor);
+    pthread_mutex_unlock(&nfs_super.map_lock);
+
+    // 找到了则为该dentry分配一个inode
+    inode = (struct nfs_inode *)malloc(sizeof(struct nfs_inode));
+    memset(inode, 0, sizeof(struct nfs_inode));
+    inode->ino = ino_cursor;
+    inode->size = 0;
+    inode->link = 1;
+    inode->dir_cnt = 0;
+    inode->dentry = dentry;
+    inode->dentrys = NULL;
+    pthread_rwlock_init(&inode->dir_lock, NULL);
+    pthread_mutex_init(&inode->lock, NULL);
+
+    dentry->inode = inode;
+    dentry->ino = inode->ino;
+    nfs_super.inodes[inode->ino] = inode;
+
+    // 如果是文件类型的话，要分配data指针指向的存储空间
+    if (NFS_IS_REG(inode))
+    {
+        for (int i = 0; i < NFS_DATA_PER_FILE; i++)
+        {
+            inode->data[i] = (uint8_t *)malloc(NFS_BLK_SZ());
+        }
+    }
+    return inode;
+}
+
+/**
+ * @brief 释放inode：清除索引位图，释放其占用的数据块和内存，位图的改动记入日志
+ * 调用者需先将其dentry从父目录摘除，并持有父目录的写锁；使用日志时还需已开始handle
+ * @param inode
+ */
+void nfs_free_inode(struct nfs_inode *inode)
+{
+    int blks;
+    nfs_forget_dirty(inode); // 内容随inode一起丢弃，不再写回
+    if (NFS_IS_DIR(inode))
+    {
+        blks = NFS_ROUND_UP(inode->dir_cnt, NFS_DENTRY_D_PER_DATABLK()) / NFS_DENTRY_D_PER_DATABLK();
+    }
+    else
+    {
+        blks = NFS_ROUND_UP(inode->size, NFS_BLK_SZ()) / NFS_BLK_SZ();
+        for (int i = 0; i < NFS_DATA_PER_FILE; i++)
+        {
+            nfs_clean_blk(inode, i);
+            free(inode->data[i]);
+        }
+    }
+    for (int i = 0; i < blks && i < NFS_DATA_PER_FILE; i++)
+    {
+        nfs_free_data_blk(inode->used_block_num[i]);
+    }
+    pthread_mutex_lock(&nfs_super.map_lock);
+    nfs_super.inodes[inode->ino] = NULL; // 先于位图清除，避免ino被立即复用后误清
+    nfs_super.map_inode[inode->ino / UINT8_BITS] &= ~(0x1 << (inode->ino % UINT8_BITS));
+    nfs_dirty_map(FALSE, inode->ino);
+    pthread_mutex_unlock(&nfs_super.map_lock);
+    nfs_log_maps();
+    inode->dentry->inode = NULL;
+    pthread_rwlock_destroy(&inode->dir_lock);
+    pthread_mutex_destroy(&inode->lock);
+    free(inode);
+}
+
+/**
+ * @brief 将内存inode及其下方结构全部刷回磁盘：每个inode只写它的脏块，
+ * 不使用日志时还有改动过的inode块和目录项块；使用日志时元数据由检查点写回原位
+ *
+ * @param inode
+ * @return int
+ */
+int nfs_sync_inode(struct nfs_inode *inode)
+{
+    struct nfs_dentry *dentry_cursor;
+    int ret;
+
+    printf("*****back to disk fname %s\n", inode->dentry->fname);
+    if (NFS_IS_REG(inode))
+    {
+        pthread_mutex_lock(&inode->lock); // flush时可能与写并发，size和数据块由文件锁保护
+        ret = nfs_write_inode(inode, FALSE);
+        pthread_mutex_unlock(&inode->lock);
+        return ret;
+    }
+    ret = nfs_write_inode(inode, FALSE);
+    if (ret != NFS_ERROR_NONE)
+    {
+        NFS_DBG("[%s] io error\n", __func__);
+        return ret;
+    }
+    // inode是一个指向文件夹的索引，要遍历里面每一个dentry对应的inode。会有递归
+    if (NFS_IS_DIR(inode))
+    {
+        for (dentry_cursor = inode->dentrys; dentry_cursor != NULL; dentry_cursor = dentry_cursor->brother)
+        {
+            if (dentry_cursor->inode != NULL)
+            {
+                nfs_sync_inode(dentry_cursor->inode);
+            }
+        }
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 校验读入的inode块
+ * @param blk
+ * @return boolean
+ */
+boolean nfs_verify_inode_blk(const uint8_t *blk)
+{
+    const struct nfs_inode_d *inode_d = (const struct nfs_inode_d *)blk;
+    return !(nfs_super.features & NFS_FEATURE_CSUM) ||
+           inode_d->csum == nfs_crc32c(blk, offsetof(struct nfs_inode_d, csum));
+}
+
+/**
+ * @brief 校验读入的目录项块，校验和在块的最后4字节
+ * @param blk
+ * @return boolean
+ */
+boolean nfs_verify_dentry_blk(const uint8_t *blk)
+{
+    uint32_t csum;
+    memcpy(&csum, blk + NFS_DENTRY_CSUM_OFS(), sizeof(uint32_t));
+    return !(nfs_super.features & NFS_FEATURE_CSUM) || csum == nfs_crc32c(blk, NFS_DENTRY_CSUM_OFS());
+}
+
+/**
+ * @brief 按磁盘布局生成inode所在的块，目录还有全部目录项块(每块NFS_DENTRY_D_PER_DATABLK项，其余清零)，
+ * 并填上校验和；调用者持有保护inode的锁(目录锁或文件锁)
+ * @param inode
+ * @param bufs 至少1 + NFS_DATA_PER_FILE块
+ * @param blknos 返回每块的磁盘块号
+ * @return int 生成的块数
+ */
+int nfs_pack_inode(struct nfs_inode *inode, uint8_t *bufs, int *blknos)
+{
+    struct nfs_inode_d *inode_d;
+    struct nfs_dentry_d *dentry_d;
+    struct nfs_dentry *dentry_cursor;
+    uint32_t csum;
+    int cnt = 1;
+
+    memset(bufs, 0, NFS_BLK_SZ());
+    inode_d = (struct nfs_inode_d *)bufs;
+    inode_d->ino = inode->ino;
+    inode_d->size = inode->size;
+    pthread_mutex_lock(&nfs_super.icache_lock); // link由icache_lock保护，写回线程只持有文件锁
+    inode_d->link = inode->link;
+    pthread_mutex_unlock(&nfs_super.icache_lock);
+    inode_d->ftype = inode->dentry->ftype;
+    inode_d->dir_cnt = inode->dir_cnt;
+    for (int i = 0; i < NFS_DATA_PER_FILE; i++)
+    {
+        inode_d->used_block_num[i] = inode->used_block_num[i];
+    }
+    if (nfs_super.features & NFS_FEATURE_CSUM)
+    {
+        inode_d->csum = nfs_crc32c(inode_d, offsetof(struct nfs_inode_d, csum));
+    }
+    blknos[0] = NFS_BLK_NO(NFS_INO_OFS(inode->ino));
+
+    if (NFS_IS_DIR(inode))
+    {
+        dentry_cursor = inode->dentrys;
+        for (int i = 0; dentry_cursor != NULL && i < NFS_DATA_PER_FILE; i++, cnt++)
+        {
+            memset(bufs + NFS_BLKS_SZ(cnt), 0, NFS_BLK_SZ());
+            dentry_d = (struct nfs_dentry_d *)(bufs + NFS_BLKS_SZ(cnt));
+            for (int j = 0; dentry_cursor != NULL && j < NFS_DENTRY_D_PER_DATABLK(); j++)
+            {
+                memcpy(dentry_d[j].fname, dentry_cursor->fname, NFS_MAX_FILE_NAME);
+                dentry_d[j].ftype = dentry_cursor->ftype;
+                dentry_d[j].ino = dentry_cursor->ino;
+                dentry_cursor = dentry_cursor->brother;
+            }
+            if (nfs_super.features & NFS_FEATURE_CSUM)
+            {
+                csum = nfs_crc32c(bufs + NFS_BLKS_SZ(cnt), NFS_DENTRY_CSUM_OFS());
+                memcpy(bufs + NFS_BLKS_SZ(cnt) + NFS_DENTRY_CSUM_OFS(), &csum, sizeof(uint32_t));
+            }
+            blknos[cnt] = NFS_BLK_NO(NFS_DATA_OFS(inode->used_block_num[i]));
+        }
+    }
+    return cnt;
+}
+
+/**
+ * @brief 把inode块记入日志，目录还要把全部目录项块按nfs_pack_inode的布局整块记入；
+ * 不使用日志时只标记元数据为脏，由写回线程或sync写回。
+ * 调用者持有保护inode的锁(目录写锁或文件锁)，且已开始handle
+ * @param inode
+ * @return uint32_t 所在事务的序号，未使用日志时为0
+ */
+uint32_t nfs_log_inode(struct nfs_inode *inode)
+{
+    uint8_t *bufs;
+    int blknos[NFS_DATA_PER_FILE + 1];
+    int cnt;
+    uint32_t seq;
+
+    if (!nfs_journal_enabled())
+    {
+        nfs_mark_inode_dirty(inode, NFS_DIRTY_META);
+        return 0;
+    }
+    bufs = (uint8_t *)malloc(NFS_BLKS_SZ(NFS_DATA_PER_FILE + 1));
+    cnt = nfs_pack_inode(inode, bufs, blknos);
+    seq = nfs_journal_log(blknos[0], bufs);
+    for (int i = 1; i < cnt; i++)
+    {
+        nfs_journal_log(blknos[i], bufs + NFS_BLKS_SZ(i));
+    }
+    free(bufs);
+    __atomic_store_n(&inode->jseq, seq, __ATOMIC_RELAXED);
+    return seq;
+}
+
+/**
+ * @brief 位图第bit位所在的块标脏，调用者持有map_lock
+ * @param is_data 数据位图还是inode位图
+ * @param bit
+ */
+void nfs_dirty_map(boolean is_data, int bit)
+{
+    int idx = bit / UINT8_BITS / NFS_BLK_SZ() + (is_data ? nfs_super.map_inode_blks : 0);
+    nfs_super.map_dirty[idx / UINT8_BITS] |= (0x1 << (idx % UINT8_BITS));
+}
+
+/**
+ * @brief 取出位图中改动过的块并清除标记，只有这些块需要写回或记入日志；调用者持有map_lock
+ * @param bufs 至少map_inode_blks + map_data_blks块
+ * @param blknos 返回每块的磁盘块号
+ * @return int 块数
+ */
+int nfs_take_dirty_maps(uint8_t *bufs, int *blknos)
+{
+    int cnt = 0;
+    for (int idx = 0; idx < nfs_super.map_inode_blks + nfs_super.map_data_blks; idx++)
+    {
+        if (!(nfs_super.map_dirty[idx / UINT8_BITS] & (0x1 << (idx % UINT8_BITS))))
+        {
+            continue;
+        }
+        nfs_super.map_dirty[idx / UINT8_BITS] &= ~(0x1 << (idx % UINT8_BITS));
+        if (idx < nfs_super.map_inode_blks)
+        {
+            memcpy(bufs + NFS_BLKS_SZ(cnt), nfs_super.map_inode + NFS_BLKS_SZ(idx), NFS_BLK_SZ());
+            blknos[cnt++] = NFS_BLK_NO(nfs_super.map_inode_offset) + idx;
+        }
+        else
+        {
+            memcpy(bufs + NFS_BLKS_SZ(cnt), nfs_super.map_data + NFS_BLKS_SZ(idx - nfs_super.map_inode_blks),
+                   NFS_BLK_SZ());
+            blknos[cnt++] = NFS_BLK_NO(nfs_super.map_data_offset) + idx - nfs_super.map_inode_blks;
+        }
+    }
+    return cnt;
+}
+
+/**
+ * @brief 取出的位图块没有写成，重新标脏；调用者持有map_lock
+ * @param blknos nfs_take_dirty_maps返回的块号
+ * @param cnt
+ */
+void nfs_redirty_maps(const int *blknos, int cnt)
+{
+    int idx;
+    for (int i = 0; i < cnt; i++)
+    {
+        idx = blknos[i] - NFS_BLK_NO(nfs_super.map_inode_offset);
+        if (idx < 0 || idx >= nfs_super.map_inode_blks)
+        {
+            idx = blknos[i] - NFS_BLK_NO(nfs_super.map_data_offset) + nfs_super.map_inode_blks;
+        }
+        nfs_super.map_dirty[idx / UINT8_BITS] |= (0x1 << (idx % UINT8_BITS));
+    }
+}
+
+/**
+ * @brief 把位图中改动过的块记入日志；不使用日志时什么也不做，脏块由写回线程或卸载写回。
+ * 会取map_lock，调用者不能持有它
+ */
+void nfs_log_maps()
+{
+    int map_blks = nfs_super.map_inode_blks + nfs_super.map_data_blks;
+    uint8_t *bufs;
+    int *blknos;
+    int cnt;
+
+    if (!nfs_journal_enabled())
+    {
+        return;
+    }
+    bufs = (uint8_t *)malloc(NFS_BLKS_SZ(map_blks));
+    blknos = (int *)malloc(map_blks * sizeof(int));
+    nfs_journal_start(NFS_JOURNAL_OP_BLKS); // 先于map_lock，隐式提交时不会等待自己
+    pthread_mutex_lock(&nfs_super.map_lock);
+    cnt = nfs_take_dirty_maps(bufs, blknos);
+    for (int i = 0; i < cnt; i++)
+    {
+        nfs_journal_log(blknos[i], bufs + NFS_BLKS_SZ(i));
+    }
+    pthread_mutex_unlock(&nfs_super.map_lock);
+    nfs_journal_stop();
+    free(bufs);
+    free(blknos);
+}
+
+/**
+ * @brief 回收一个不再被引用的inode：写回磁盘后释放内存，下次访问时由nfs_load_inode重新读入。
+ * 目录只有在子项都未缓存时才能回收，其子dentry一并释放
+ * 调用者持有父目录的写锁
+ * @param inode
+ * @return int
+ */
+int nfs_evict_inode(struct nfs_inode *inode)
+{
+    struct nfs_dentry *dentry_cursor, *next;
+    int ret;
+
+    if (NFS_IS_DIR(inode))
+    {
+        nfs_dir_lock(inode, TRUE);
+        for (dentry_cursor = inode->dentrys; dentry_cursor; dentry_cursor = dentry_cursor->brother)
+        {
+            if (dentry_cursor->inode != NULL)
+            {
+                nfs_dir_unlock(inode);
+                return -NFS_ERROR_BUSY;
+            }
+        }
+        nfs_dir_unlock(inode);
+    }
+    ret = nfs_sync_inode(inode);
+    if (ret != NFS_ERROR_NONE)
+    {
+        return ret;
+    }
+    nfs_forget_dirty(inode);
+
+    if (NFS_IS_DIR(inode))
+    {
+        for (dentry_cursor = inode->dentrys; dentry_cursor; dentry_cursor = next)
+        {
+            next = dentry_cursor->brother;
+            free(dentry_cursor);
+        }
+    }
+    else
+    {
+        for (int i = 0; i < NFS_DATA_PER_FILE; i++)
+        {
+            free(inode->data[i]);
+        }
+    }
+    nfs_super.inodes[inode->ino] = NULL;
+    __atomic_store_n(&inode->dentry->inode, NULL, __ATOMIC_RELEASE);
+    pthread_rwlock_destroy(&inode->dir_lock);
+    pthread_mutex_destroy(&inode->lock);
+    free(inode);
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 在目录中按名字查找目录项，调用者持有该目录的锁
+ *
+ * @param dir 目录inode
+ * @param fname
+ * @return struct nfs_dentry* 未找到返回NULL
+ */
+struct nfs_dentry *nfs_find_dentry(struct nfs_inode *dir, const char *fname)
+{
+    struct nfs_dentry *dentry_cursor;
+    for (dentry_cursor = dir->dentrys; dentry_cursor; dentry_cursor = dentry_cursor->brother)
+    {
+        if (strcmp(dentry_cursor->fname, fname) == 0)
+        {
+            return dentry_cursor;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief 在目录下新建文件或目录：分配inode并挂入父目录，改动记入日志
+ * 调用者持有dir的写锁，且已确认同名项不存在；使用日志时还需已开始handle
+ *
+ * @param dir 父目录inode
+ * @param fname
+ * @param ftype
+ * @param out 返回新建的dentry
+ * @return int
+ */
+int nfs_make_node(struct nfs_inode *dir, const char *fname, FILE_TYPE ftype,
+                  struct nfs_dentry **out)
+{
+    struct nfs_dentry *dentry;
+    struct nfs_inode *inode;
+
+    if (strlen(fname) >= NFS_MAX_FILE_NAME)
+    {
+        return -NFS_ERROR_NAMETOOLONG;
+    }
+    // 限制一个目录下最多能创建的文件数量
+    if ((dir->dir_cnt + 1) > max_dentrys_2_inode)
+    {
+        return -NFS_ERROR_UNSUPPORTED;
+    }
+    dentry = new_dentry((char *)fname, ftype);
+    dentry->parent = dir->dentry;
+
+    inode = nfs_alloc_inode(dentry); // inode位图修改
+    if (inode == NULL)
+    {
+        free(dentry);
+        return -NFS_ERROR_NOSPACE;
+    }
+    if (nfs_alloc_dentry(dir, dentry, 1) < 0) // 数据位图修改
+    {
+        nfs_free_inode(inode);
+        free(dentry);
+        return -NFS_ERROR_NOSPACE;
+    }
+    nfs_log_maps();
+    nfs_log_inode(dir);
+    nfs_log_inode(inode);
+    *out = dentry;
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 读入cnt个数据块到bufs，物理上连续的块合并成一次设备读，模拟磁盘上只寻道一次；
+ * 内存中也连续的直接读入，否则经临时缓冲区分发
+ * @param dnos 数据块号
+ * @param bufs 每块的目标缓冲区
+ * @param cnt
+ * @return int
+ */
+static int nfs_read_data_blks(const int *dnos, uint8_t **bufs, int cnt)
+{
+    int start = 0, end, i;
+    boolean in_place;
+    uint8_t *run;
+
+    while (start < cnt)
+    {
+        in_place = TRUE;
+        for (end = start + 1; end < cnt && dnos[end] == dnos[end - 1] + 1; end++)
+        {
+            in_place = in_place && bufs[end] == bufs[end - 1] + NFS_BLK_SZ();
+        }
+        run = in_place ? bufs[start] : (uint8_t *)malloc(NFS_BLKS_SZ(end - start));
+        if (ddriver_pread(NFS_DRIVER(), (char *)run, NFS_BLKS_SZ(end - start),
+                          NFS_DATA_OFS(dnos[start])) < 0)
+        {
+            if (!in_place)
+            {
+                free(run);
+            }
+            return -NFS_ERROR_IO;
+        }
+        if (!in_place)
+        {
+            for (i = start; i < end; i++)
+            {
+                memcpy(bufs[i], run + NFS_BLKS_SZ(i - start), NFS_BLK_SZ());
+            }
+            free(run);
+        }
+        start = end;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 保证文件的第first到last块在缓存中，超出文件的部分忽略；
+ * 未缓存的块一次性收集后合并读入，调用者持有inode->lock
+ * @param inode
+ * @param first
+ * @param last
+ * @return int
+ */
+static int nfs_file_load(struct nfs_inode *inode, int first, int last)
+{
+    int dnos[NFS_DATA_PER_FILE];
+    uint8_t *bufs[NFS_DATA_PER_FILE];
+    int cnt = 0, blk, ret;
+
+    if (last >= NFS_DATA_BLKS(inode->size))
+    {
+        last = NFS_DATA_BLKS(inode->size) - 1;
+    }
+    for (blk = first; blk <= last; blk++)
+    {
+        if (!(inode->data_flag[blk] & NFS_FLAG_BUF_OCCUPY))
+        {
+            dnos[cnt] = inode->used_block_num[blk];
+            bufs[cnt++] = inode->data[blk];
+        }
+    }
+    if (cnt == 0)
+    {
+        return NFS_ERROR_NONE;
+    }
+    if ((ret = nfs_read_data_blks(dnos, bufs, cnt)) < 0)
+    {
+        return ret;
+    }
+    for (blk = first; blk <= last; blk++)
+    {
+        inode->data_flag[blk] |= NFS_FLAG_BUF_OCCUPY;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 读之前按打开句柄上的访问模式决定预读窗口，并装入需要的块：
+ * 从上次读写结束的位置接着读视为顺序读，窗口从NFS_RA_INIT_BLKS起每次翻倍，直到NFS_RA_MAX_BLKS；
+ * 其他位置视为随机读，窗口清零，只读需要的块。没有句柄时不预读
+ * 设备可splice时干净块由FUSE直接从设备读，这里只更新访问模式
+ * @param inode
+ * @param file 可为NULL
+ * @param size 已截到文件末尾，大于0
+ * @param offset
+ * @return int
+ */
+static int nfs_file_readahead(struct nfs_inode *inode, struct nfs_file *file, size_t size, off_t offset)
+{
+    int first = offset / NFS_BLK_SZ();
+    int last = (offset + size - 1) / NFS_BLK_SZ();
+
+    if (file != NULL)
+    {
+        if (offset == file->pos)
+        {
+            file->ra_blks = file->ra_blks == 0 ? NFS_RA_INIT_BLKS : file->ra_blks * 2;
+            file->ra_blks = file->ra_blks > NFS_RA_MAX_BLKS ? NFS_RA_MAX_BLKS : file->ra_blks;
+        }
+        else
+        {
+            file->ra_blks = 0;
+        }
+        file->pos = offset + size;
+        last += file->ra_blks;
+    }
+    if (nfs_super.splice_fd)
+    {
+        return NFS_ERROR_NONE;
+    }
+    return nfs_file_load(inode, first, last);
+}
+
+/**
+ * @brief 改变普通文件大小，调用者持有inode->lock
+ * 扩展时为新的块分配数据块并清零缓存；缩小时释放多出的块，并把末块中size之后的部分清零，
+ * 保证末块尾部始终为0，之后再扩展不会露出旧数据。
+ * 新的大小和块映射记入日志，使用日志时调用者还需已开始handle
+ * @param inode
+ * @param size 新的大小
+ * @return int
+ */
+int nfs_file_resize(struct nfs_inode *inode, int size)
+{
+    int old_blks = NFS_DATA_BLKS(inode->size);
+    int new_blks = NFS_DATA_BLKS(size);
+    int blk, dno, ret;
+
+    if (size < 0 || size > NFS_MAX_FILE_SZ())
+    {
+        return -NFS_ERROR_FBIG;
+    }
+    // 清零末块尾部前先把它读进来
+    blk = size / NFS_BLK_SZ();
+    if (size < inode->size && size % NFS_BLK_SZ() != 0 && (ret = nfs_file_load(inode, blk, blk)) < 0)
+    {
+        return ret;
+    }
+    for (blk = old_blks; blk < new_blks; blk++)
     {
-        int cur_blk = inode->dir_cnt / NFS_DENTRY_PER_DATABLK();
-        int byte_cursor, bit_cursor, dno_cursor=0;
-        boolean find_free_blk = FALSE;
-        for (byte_cursor = 0; byte_cursor < NFS_BLKS_SZ(nfs_super.map_data_blks); byte_cursor++)
+        if ((dno = nfs_alloc_data_blk()) < 0)
         {
-            for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++)
-            {
-                if ((nfs_super.map_data[byte_cursor] & (0x1 << bit_cursor)) == 0)
-                {
-                    nfs_super.map_data[byte_cursor] |= (0x1 << bit_cursor);
-                    inode->used_block_num[cur_blk] = dno_cursor;
-                    printf("*****new databcok bytes:%d bit %d\n", byte_cursor, bit_cursor);
-                    find_free_blk = TRUE;
-                    break;
-                }
-                dno_cursor++;
-            }
-            if (find_free_blk)
+            while (--blk >= old_blks)
             {
-                break;
+                nfs_free_data_blk(inode->used_block_num[blk]);
+                nfs_clean_blk(inode, blk);
+                inode->data_flag[blk] = 0;
             }
-        }
-        if (!find_free_blk || dno_cursor == nfs_super.max_data)
-        {
             return -NFS_ERROR_NOSPACE;
         }
+        inode->used_block_num[blk] = dno;
+        memset(inode->data[blk], 0, NFS_BLK_SZ());
+        inode->data_flag[blk] = NFS_FLAG_BUF_OCCUPY;
+        nfs_dirty_blk(inode, blk);
     }
-    return inode->dir_cnt;
+    for (blk = new_blks; blk < old_blks; blk++)
+    {
+        nfs_free_data_blk(inode->used_block_num[blk]);
+        nfs_clean_blk(inode, blk);
+        inode->data_flag[blk] = 0;
+    }
+    if (size < inode->size && size % NFS_BLK_SZ() != 0)
+    {
+        blk = size / NFS_BLK_SZ();
+        memset(inode->data[blk] + size % NFS_BLK_SZ(), 0, NFS_BLK_SZ() - size % NFS_BLK_SZ());
+        nfs_dirty_blk(inode, blk);
+    }
+    inode->size = size;
+    if (old_blks != new_blks)
+    {
+        nfs_log_maps();
+    }
+    nfs_log_inode(inode);
+    return NFS_ERROR_NONE;
 }
 
 /**
- * @brief 分配一个inode，占用索引位图；
- * 如果dentry是文件类型，还开辟内存，但未修改数据位图
- * @param dentry 该dentry指向分配的inode
- * @return nfs_inode
+ * @brief 把文件[offset, offset + size)组织成fuse_bufvec交给FUSE，不经过中间缓冲区；
+ * 超出文件末尾的部分被截掉，调用者持有inode->lock
+ *  - 干净且按IO单位对齐的片段指向设备fd上的偏移(仅内核字符设备)，FUSE可直接splice，
+ *    物理上连续的块合并成一段
+ *  - 其余片段pin为TRUE时直接指向缓存块，调用者在FUSE用完之前不得放锁；
+ *    pin为FALSE时复制到新分配的内存，连续的合并成一段，由FUSE释放
+ * 需要的块不在缓存中时读入，并按句柄上的访问模式预读
+ * @param inode
+ * @param file 打开句柄，记录访问模式，可为NULL
+ * @param size
+ * @param offset
+ * @param pin
+ * @return struct fuse_bufvec* 由调用者free，读设备出错时返回NULL
  */
-struct nfs_inode *nfs_alloc_inode(struct nfs_dentry *dentry)
+struct fuse_bufvec *nfs_file_read_buf(struct nfs_inode *inode, struct nfs_file *file,
+                                      size_t size, off_t offset, boolean pin)
 {
-    struct nfs_inode *inode;
-    int byte_cursor = 0;
-    int bit_cursor = 0;
-    int ino_cursor = 0; // 记录inode块号
-    boolean is_find_free_entry = FALSE;
+    struct fuse_bufvec *bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec) +
+                                                            (NFS_DATA_PER_FILE - 1) * sizeof(struct fuse_buf));
+    struct fuse_buf *seg = NULL;
+    size_t done = 0;
+    off_t pos;
+    int blk, bias, len;
+
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = 0;
+    if (offset >= inode->size)
+    {
+        size = 0;
+    }
+    else if (offset + size > (size_t)inode->size)
+    {
+        size = inode->size - offset;
+    }
+    if (size > 0 && nfs_file_readahead(inode, file, size, offset) < 0)
+    {
+        goto err;
+    }
 
-    // 在索引节点位图上查找空闲的索引节点
-    for (byte_cursor = 0; byte_cursor < NFS_BLKS_SZ(nfs_super.map_inode_blks); byte_cursor++)
+    while (done < size)
     {
-        for (bit_cursor = 0; bit_cursor < UINT8_BITS; bit_cursor++)
+        blk = (offset + done) / NFS_BLK_SZ();
+        bias = (offset + done) % NFS_BLK_SZ();
+        len = NFS_BLK_SZ() - bias < size - done ? NFS_BLK_SZ() - bias : size - done;
+        pos = NFS_DATA_OFS(inode->used_block_num[blk]) + bias;
+
+        if (nfs_super.splice_fd && !(inode->data_flag[blk] & NFS_FLAG_BUF_DIRTY) &&
+            bias % NFS_IO_SZ() == 0 && len % NFS_IO_SZ() == 0)
         {
-            if ((nfs_super.map_inode[byte_cursor] & (0x1 << bit_cursor)) == 0)
+            if (seg == NULL || !(seg->flags & FUSE_BUF_IS_FD) || seg->pos + (off_t)seg->size != pos)
             {
-                /* 当前ino_cursor位置空闲 */
-                // 更新位图
-                nfs_super.map_inode[byte_cursor] |= (0x1 << bit_cursor);
-                is_find_free_entry = TRUE;
-                break;
+                seg = &bufv->buf[bufv->count++];
+                seg->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                seg->fd = NFS_DRIVER();
+                seg->pos = pos;
+                seg->mem = NULL;
+                seg->size = 0;
             }
-            ino_cursor++;
+            seg->size += len;
+            done += len;
+            continue;
         }
-        if (is_find_free_entry)
+
+        if (nfs_file_load(inode, blk, blk) < 0)
         {
-            break;
+            goto err;
+        }
+        if (pin)
+        {
+            seg = &bufv->buf[bufv->count++];
+            seg->flags = 0;
+            seg->mem = inode->data[blk] + bias;
+            seg->size = len;
+        }
+        else
+        {
+            if (seg == NULL || (seg->flags & FUSE_BUF_IS_FD))
+            {
+                seg = &bufv->buf[bufv->count++];
+                seg->flags = 0;
+                seg->mem = NULL;
+                seg->size = 0;
+            }
+            seg->mem = realloc(seg->mem, seg->size + len);
+            memcpy((uint8_t *)seg->mem + seg->size, inode->data[blk] + bias, len);
+            seg->size += len;
         }
+        done += len;
     }
 
-    // 未找到空闲的inode
-    if (!is_find_free_entry || ino_cursor == nfs_super.max_ino)
+    if (bufv->count == 0)
     {
-        return -NFS_ERROR_NOSPACE;
+        bufv->count = 1; // 读到文件末尾，交给FUSE一个空片段
     }
+    return bufv;
 
-    // 找到了则为该dentry分配一个inode
-    inode = (struct nfs_inode *)malloc(sizeof(struct nfs_inode));
-    inode->ino = ino_cursor;
-    inode->size = 0;
-    inode->dir_cnt = 0;
-    inode->dentry = dentry;
-    inode->dentrys = NULL;
-
-    dentry->inode = inode;
-    dentry->ino = inode->ino;
-
-    // 如果是文件类型的话，要分配data指针指向的存储空间
-    if (NFS_IS_REG(inode))
+err:
+    for (size_t i = 0; !pin && i < bufv->count; i++)
     {
-        for (int i; i < NFS_DATA_PER_FILE; i++)
-        {
-            inode->data[i] = (uint8_t *)malloc(NFS_BLK_SZ());
-        }
+        free(bufv->buf[i].mem);
     }
-    return inode;
+    free(bufv);
+    return NULL;
 }
 
 /**
- * @brief 将内存inode及其下方结构全部刷回磁盘
- *
+ * @brief 把src中的数据写入文件offset处，调用者持有inode->lock
+ * 目标片段直接指向缓存块，FUSE从splice管道或请求缓冲区一次拷入；实际拷入的块标脏等待写回。
+ * 只写了一部分的块若不在缓存中先读入，整块覆盖的不读
  * @param inode
- * @return int
+ * @param file 打开句柄，记录访问位置，可为NULL
+ * @param src
+ * @param offset
+ * @return int 写入的字节数，失败返回负的错误号
  */
-int nfs_sync_inode(struct nfs_inode *inode)
+int nfs_file_write_buf(struct nfs_inode *inode, struct nfs_file *file,
+                       struct fuse_bufvec *src, off_t offset)
 {
-    struct nfs_inode_d inode_d;
-    struct nfs_dentry *dentry_cursor;
-    struct nfs_dentry_d dentry_d;
-    int ino = inode->ino;
-    inode_d.ino = ino;
-    inode_d.size = inode->size;
-    inode_d.ftype = inode->dentry->ftype;
-    inode_d.dir_cnt = inode->dir_cnt;
-    printf("*****back to disk fname %s\n", inode->dentry->fname);
-    for (int i = 0; i < NFS_DATA_PER_FILE; i++)
+    size_t size = fuse_buf_size(src);
+    struct fuse_bufvec *dst;
+    struct fuse_buf *seg;
+    int old_size = inode->size;
+    size_t done = 0;
+    ssize_t copied;
+    int blk, bias, ret;
+
+    if (size == 0)
     {
-        inode_d.used_block_num[i] = inode->used_block_num[i];
+        return 0;
     }
-    // 将inode_d本身写入磁盘
-    if (nfs_driver_write(NFS_INO_OFS(ino), (uint8_t *)&inode_d,
-                         sizeof(struct nfs_inode_d)) != NFS_ERROR_NONE)
+    if (offset + size > (size_t)NFS_MAX_FILE_SZ())
     {
-        NFS_DBG("[%s] io error\n", __func__);
-        return -NFS_ERROR_IO;
+        return -NFS_ERROR_FBIG;
+    }
+    blk = offset / NFS_BLK_SZ();
+    if (offset % NFS_BLK_SZ() != 0 && (ret = nfs_file_load(inode, blk, blk)) < 0)
+    {
+        return ret;
+    }
+    blk = (offset + size) / NFS_BLK_SZ();
+    if ((offset + size) % NFS_BLK_SZ() != 0 && (ret = nfs_file_load(inode, blk, blk)) < 0)
+    {
+        return ret;
+    }
+    if (offset + size > (size_t)inode->size && (ret = nfs_file_resize(inode, offset + size)) < 0)
+    {
+        return ret;
     }
 
-    // inode是一个指向文件夹的索引，要遍历里面每一个dentry对应的inode。会有递归
-    if (NFS_IS_DIR(inode))
+    dst = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec) +
+                                       (NFS_DATA_PER_FILE - 1) * sizeof(struct fuse_buf));
+    *dst = FUSE_BUFVEC_INIT(0);
+    dst->count = 0;
+    while (done < size)
     {
-        printf("*****back to disk is dir %s\n", inode->dentry->fname);
-        printf("*****inode used_block_num is:");
-        for(int idx=0; idx<6; idx++){
-            printf(" %d", inode->used_block_num[idx]);
-        }
-        printf("\n");
-        int offset;
-        int dentry_d_per_block = NFS_BLK_SZ() / sizeof(struct nfs_dentry_d);
-        int num_dentry_d_in_this_block;
-        int blk_number = 0;
-        dentry_cursor = inode->dentrys;//对于一个inode（目录文件），如果其下的dentrys为空，那么下述两层while循环不会进入
-        // 遍历一个inode对应的所有data块
-        while (blk_number < NFS_DATA_PER_FILE)
-        {
-            offset = NFS_DATA_OFS(inode->used_block_num[blk_number]); // 当前数据块的offset
-            num_dentry_d_in_this_block = 0;
-            // 遍历当前数据块的每一个dentry
-            while ((dentry_cursor != NULL) && (num_dentry_d_in_this_block < dentry_d_per_block))
-            {
-                memcpy(dentry_d.fname, dentry_cursor->fname, NFS_MAX_FILE_NAME);
-                dentry_d.ftype = dentry_cursor->ftype;
-                dentry_d.ino = dentry_cursor->ino;
-                if (nfs_driver_write(offset, (uint8_t *)&dentry_d, sizeof(struct nfs_dentry_d)) != NFS_ERROR_NONE)
-                {
-                    NFS_DBG("[%s] io error\n", __func__);
-                    return -NFS_ERROR_IO;
-                }
-                printf("*****writing dentry named %s, idx %d in this block, in block num %d\n", dentry_d.fname, num_dentry_d_in_this_block+1, inode->used_block_num[blk_number]);
-                if (dentry_cursor->inode != NULL)
-                {
-                    nfs_sync_inode(dentry_cursor->inode);
-                }
-                dentry_cursor = dentry_cursor->brother; // 开始遍历下一个兄弟
-                offset += sizeof(struct nfs_dentry_d);
-                num_dentry_d_in_this_block++;
-            }
-            blk_number++;
+        blk = (offset + done) / NFS_BLK_SZ();
+        bias = (offset + done) % NFS_BLK_SZ();
+        seg = &dst->buf[dst->count++];
+        seg->flags = 0;
+        seg->mem = inode->data[blk] + bias;
+        seg->size = NFS_BLK_SZ() - bias < size - done ? NFS_BLK_SZ() - bias : size - done;
+        done += seg->size;
+    }
+    copied = fuse_buf_copy(dst, src, 0);
+    free(dst);
+
+    // 拷贝之后才按实际拷入的字节标记有效和脏块：没有读入的块只拷了一部分时其余内容未初始化，
+    // 不能写回，写入量退回到该块开头
+    for (done = 0; copied > 0 && done < (size_t)copied; done += NFS_BLK_SZ() - bias)
+    {
+        blk = (offset + done) / NFS_BLK_SZ();
+        bias = (offset + done) % NFS_BLK_SZ();
+        if (!(inode->data_flag[blk] & NFS_FLAG_BUF_OCCUPY) &&
+            (size_t)copied - done < (size_t)(NFS_BLK_SZ() - bias))
+        {
+            copied = done;
+            break;
         }
+        inode->data_flag[blk] |= NFS_FLAG_BUF_OCCUPY;
+        nfs_dirty_blk(inode, blk);
     }
-    else if (NFS_IS_REG(inode))
+    if (copied == 0)
     {
-        printf("*****back to disk is file %s\n", inode->dentry->fname);
-        //此处是将普通文件inode的数据块刷回磁盘，但由于used_block_num默认值的问题，可能回造成其他区域被覆盖。
-        //如果考虑普通文件的刷回，还需要一个指示变量。
-        // for (int i = 0; i < NFS_DATA_PER_FILE; i++)
-        // {   
-        //     if (nfs_driver_write(NFS_DATA_OFS(inode->used_block_num[i]), inode->data[i], NFS_BLK_SZ()) != NFS_ERROR_NONE)
-        //     {
-        //         NFS_DBG("[%s] io error\n", __func__);
-        //         return -NFS_ERROR_IO;
-        //     }
-        // }
+        copied = -NFS_ERROR_IO;
     }
-    else
+
+    // 扩展了文件却没有拷满时退回到实际写到的位置，不留下多余的0；失败时恢复原大小。
+    // 未扩展时inode不变，不必记录
+    done = copied > 0 && offset + copied > old_size ? offset + copied : old_size;
+    if (inode->size > old_size && done < (size_t)inode->size)
     {
-        printf("*****%s is nono type\n", inode->dentry->fname);
+        nfs_file_resize(inode, done);
     }
-    return NFS_ERROR_NONE;
+    if (file != NULL && copied > 0)
+    {
+        file->pos = offset + copied;
+    }
+    return copied;
+}
+
+/**
+ * @brief 为inode建立打开句柄并持有一个引用，
+ * 调用者持有其父目录的锁，保证期间不会被删除
+ * @param inode
+ * @return struct nfs_file*
+ */
+struct nfs_file *nfs_file_open(struct nfs_inode *inode)
+{
+    struct nfs_file *file = (struct nfs_file *)malloc(sizeof(struct nfs_file));
+    file->inode = inode;
+    file->pos = 0;
+    file->ra_blks = 0;
+    pthread_mutex_lock(&nfs_super.icache_lock);
+    inode->nopen++;
+    pthread_mutex_unlock(&nfs_super.icache_lock);
+    return file;
+}
+
+/**
+ * @brief 关闭句柄并释放其引用；文件已被删除且这是最后一个引用时释放inode，
+ * 低层接口下还要等内核的lookup引用也释放完
+ * @param file
+ */
+void nfs_file_close(struct nfs_file *file)
+{
+    struct nfs_inode *inode = file->inode;
+    struct nfs_dentry *dentry = inode->dentry;
+    boolean free_now;
+
+    pthread_mutex_lock(&nfs_super.icache_lock);
+    free_now = --inode->nopen == 0 && inode->link == 0 && inode->nlookup == 0;
+    pthread_mutex_unlock(&nfs_super.icache_lock);
+    if (free_now)
+    {
+        nfs_journal_start(NFS_JOURNAL_OP_BLKS);
+        nfs_free_inode(inode);
+        nfs_journal_stop();
+        free(dentry);
+    }
+    free(file);
 }
 
 struct nfs_dentry *nfs_get_dentry(struct nfs_inode *inode, int dir)
@@ -336,96 +1240,161 @@ struct nfs_dentry *nfs_get_dentry(struct nfs_inode *inode, int dir)
     return NULL;
 }
 
-struct nfs_dentry *nfs_lookup(const char *path, boolean *is_find, boolean *is_root)
+/**
+ * @brief 目录加锁，excl为TRUE时加写锁
+ *
+ * @param inode 目录inode
+ * @param excl
+ */
+void nfs_dir_lock(struct nfs_inode *inode, boolean excl)
+{
+    if (excl)
+    {
+        pthread_rwlock_wrlock(&inode->dir_lock);
+    }
+    else
+    {
+        pthread_rwlock_rdlock(&inode->dir_lock);
+    }
+}
+
+void nfs_dir_unlock(struct nfs_inode *inode)
+{
+    pthread_rwlock_unlock(&inode->dir_lock);
+}
+
+/**
+ * @brief Cache机制，dentry对应的inode为空时从磁盘中读取；
+ * 调用者持有dentry所在目录的锁(读锁即可)，多个线程同时未命中时只读一次
+ * @param dentry
+ * @return struct nfs_inode*
+ */
+struct nfs_inode *nfs_load_inode(struct nfs_dentry *dentry)
+{
+    struct nfs_inode *inode = __atomic_load_n(&dentry->inode, __ATOMIC_ACQUIRE);
+    if (inode == NULL)
+    {
+        pthread_mutex_lock(&nfs_super.load_lock);
+        inode = dentry->inode;
+        if (inode == NULL)
+        {
+            inode = nfs_read_inode(dentry, dentry->ino);
+            __atomic_store_n(&dentry->inode, inode, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&nfs_super.load_lock);
+    }
+    return inode;
+}
+
+/**
+ * @brief 路径查找，逐级加目录读锁并采用锁耦合(先锁子目录再放父目录)，
+ * 返回时仍持有一把目录锁，由*locked给出，调用者用完后nfs_dir_unlock：
+ *  - 根目录：持有根目录自身的锁
+ *  - 找到：持有其父目录的锁，期间该dentry不会被删除
+ *  - 父目录存在但目标不存在：返回父目录，持有父目录的锁
+ *  - 中间某级不存在或不是目录：返回NULL，不持有锁
+ *  - 目标或中间某级的inode读不出(I/O错误或校验失败)：返回NULL，不持有锁，*is_find为TRUE，
+ *    调用者据此返回-NFS_ERROR_IO
+ * excl为TRUE时最后持有的那把锁是写锁，供创建、删除使用
+ *
+ * @param path
+ * @param is_find
+ * @param is_root
+ * @param locked 返回时持有的目录锁
+ * @param excl
+ * @return struct nfs_dentry*
+ */
+struct nfs_dentry *nfs_lookup(const char *path, boolean *is_find, boolean *is_root,
+                              struct nfs_inode **locked, boolean excl)
 {
-    struct nfs_dentry *dentry_cursor = nfs_super.root_dentry;
-    struct nfs_dentry *dentry_ret = NULL;
+    struct nfs_inode *dir = nfs_super.root_dentry->inode;
+    struct nfs_dentry *dentry_cursor;
     struct nfs_inode *inode;
     int total_lvl = nfs_calc_lvl(path);
     int lvl = 0;
-    boolean is_hit;
     char *fname = NULL;
-    char *path_cpy = (char *)malloc(sizeof(path));
+    char *saveptr = NULL;
+    char *path_cpy;
+
+    *is_find = FALSE;
     *is_root = FALSE;
-    strcpy(path_cpy, path);
+    *locked = NULL;
 
     /* 如果路径的级数为0，则说明是根目录，直接返回根目录项即可 */
     if (total_lvl == 0)
     {
+        nfs_dir_lock(dir, excl);
         *is_find = TRUE;
         *is_root = TRUE;
-        dentry_ret = nfs_super.root_dentry;
+        *locked = dir;
+        return nfs_super.root_dentry;
     }
 
+    path_cpy = (char *)malloc(strlen(path) + 1);
+    strcpy(path_cpy, path);
+    nfs_dir_lock(dir, excl && total_lvl == 1);
+
     /* 获取最外层文件夹名称 */
-    fname = strtok(path_cpy, "/");
+    fname = strtok_r(path_cpy, "/", &saveptr);
     while (fname)
     {
         lvl++;
 
-        /* Cache机制，如果当前dentry对应的inode为空，则从磁盘中读取 */
-        if (dentry_cursor->inode == NULL)
-        {
-            nfs_read_inode(dentry_cursor, dentry_cursor->ino);
-        }
-
-        /* 当前dentry对应的inode */
-        inode = dentry_cursor->inode;
+        /* 遍历该目录下所有目录项，名称匹配则命中 */
+        dentry_cursor = nfs_find_dentry(dir, fname);
 
-        /* 若当前inode对应文件类型，且还没查找到对应层数，说明路径错误，跳出循环 */
-        if (NFS_IS_REG(inode) && lvl < total_lvl)
+        if (lvl == total_lvl)
         {
-            NFS_DBG("[%s] not a dir\n", __func__);
-            dentry_ret = inode->dentry;
-            break;
-        }
-        /* 若当前inode对应文件夹 */
-        if (NFS_IS_DIR(inode))
-        {
-            dentry_cursor = inode->dentrys;
-            is_hit = FALSE;
-
-            /* 遍历该目录下所有目录项 */
-            while (dentry_cursor)
-            {
-                /* 如果名称匹配，则命中 */
-                if (memcmp(dentry_cursor->fname, fname, strlen(fname)) == 0)
-                {
-                    is_hit = TRUE;
-                    break;
-                }
-                // 否则查找下一个目录项
-                dentry_cursor = dentry_cursor->brother;
-            }
-
-            /* 若未命中 */
-            if (!is_hit)
+            if (dentry_cursor == NULL)
             {
-                *is_find = FALSE;
+                /* 目标不存在，返回父目录 */
                 NFS_DBG("[%s] not found %s\n", __func__, fname);
-                dentry_ret = inode->dentry;
-                break;
+                *locked = dir;
+                free(path_cpy);
+                return dir->dentry;
             }
-
-            /* 若命中 */
-            if (is_hit && lvl == total_lvl)
+            *is_find = TRUE;
+            if (nfs_load_inode(dentry_cursor) == NULL)
             {
-                *is_find = TRUE;
-                dentry_ret = dentry_cursor;
+                NFS_DBG("[%s] inode of %s unreadable\n", __func__, fname);
                 break;
             }
+            *locked = dir;
+            free(path_cpy);
+            return dentry_cursor;
         }
-        /* 获取下一层文件夹名称 */
-        fname = strtok(NULL, "/");
-    }
 
-    /* 如果对应dentry的inode还没读进来，则重新读 */
-    if (dentry_ret->inode == NULL)
-    {
-        dentry_ret->inode = nfs_read_inode(dentry_ret, dentry_ret->ino);
+        /* 中间一级不存在或不是目录，说明路径错误 */
+        if (dentry_cursor == NULL)
+        {
+            NFS_DBG("[%s] not found %s\n", __func__, fname);
+            break;
+        }
+        inode = nfs_load_inode(dentry_cursor);
+        if (inode == NULL)
+        {
+            NFS_DBG("[%s] inode of %s unreadable\n", __func__, fname);
+            *is_find = TRUE;
+            break;
+        }
+        if (NFS_IS_REG(inode))
+        {
+            NFS_DBG("[%s] not a dir\n", __func__);
+            break;
+        }
+
+        /* 锁耦合：子目录加锁后再释放父目录 */
+        nfs_dir_lock(inode, excl && lvl + 1 == total_lvl);
+        nfs_dir_unlock(dir);
+        dir = inode;
+
+        /* 获取下一层文件夹名称 */
+        fname = strtok_r(NULL, "/", &saveptr);
     }
 
-    return dentry_ret;
+    nfs_dir_unlock(dir);
+    free(path_cpy);
+    return NULL;
 }
 
 /**
@@ -441,19 +1410,13 @@ int nfs_mount(struct custom_options options)
     struct nfs_super_d nfs_super_d;
     struct nfs_dentry *root_dentry;
     struct nfs_inode *root_inode;
-
-    // inode
-    int inode_num;
-    int map_inode_blks;
-
-    // data
-    int data_num;
-    int map_data_blks;
-
-    int super_blks;
-    boolean is_init = FALSE;
+    struct stat dev_stat;
 
     nfs_super.is_mounted = FALSE;
+    pthread_mutex_init(&nfs_super.map_lock, NULL);
+    pthread_mutex_init(&nfs_super.load_lock, NULL);
+    pthread_mutex_init(&nfs_super.icache_lock, NULL);
+    nfs_wb_init(options);
 
     driver_fd = ddriver_open(options.device);
 
@@ -464,6 +1427,9 @@ int nfs_mount(struct custom_options options)
 
     // 往超级块中写入信息 fd + 三个大小
     nfs_super.fd = driver_fd;
+    // 内核ddriver字符设备自己做模拟和统计，FUSE从它splice不会绕过计数；
+    // 镜像文件绕过用户态模拟，块设备以O_DIRECT打开，都不能直接交给FUSE
+    nfs_super.splice_fd = fstat(driver_fd, &dev_stat) == 0 && S_ISCHR(dev_stat.st_mode);
     ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_SIZE, &nfs_super.sz_disk);
     ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_IO_SZ, &nfs_super.sz_io);
     nfs_super.sz_blks = 2 * nfs_super.sz_io;
@@ -476,39 +1442,39 @@ int nfs_mount(struct custom_options options)
     {
         return -1;
     }
+    if (nfs_super_d.magic_num == NFS_MAGIC_NUM && !nfs_verify_super(&nfs_super_d))
+    {
+        NFS_DBG("[%s] superblock checksum mismatch\n", __func__);
+        return -NFS_ERROR_IO;
+    }
 
     // 判断是否是是第一次挂载
     if (nfs_super_d.magic_num != NFS_MAGIC_NUM)
-    { // 第一次挂载
-        // 初始化大小
+    { // 第一次挂载：按默认参数格式化(与mkfs.newfs相同)，之后与普通挂载一样读入
         printf("*************************first mount\n");
-        super_blks = NFS_BLKS_SUPER;
-        inode_num = NFS_BLKS_INODE;
-        data_num = NFS_BLKS_DATA;
-        map_data_blks = NFS_BLKS_MAP_DATA;
-        map_inode_blks = NFS_BLKS_MAP_INODE;
-
-        // 初始化布局
-        nfs_super.max_ino = inode_num;
-        nfs_super.max_data = data_num;
-
-        // 更新super_d
-        nfs_super_d.map_inode_blks = map_inode_blks;
-        nfs_super_d.map_data_blks = map_data_blks;
-
-        nfs_super_d.map_inode_offset = NFS_SUPER_OFS + NFS_BLKS_SZ(super_blks);
-        nfs_super_d.map_data_offset = nfs_super_d.map_inode_offset + NFS_BLKS_SZ(map_inode_blks);
-
-        nfs_super_d.inode_offset = nfs_super_d.map_data_offset + NFS_BLKS_SZ(map_data_blks);
-        nfs_super_d.data_offset = nfs_super_d.inode_offset + NFS_BLKS_SZ(inode_num);
-
-        nfs_super_d.sz_usage = 0;
-        nfs_super_d.magic_num = NFS_MAGIC_NUM;
-        is_init = TRUE;
+        if (nfs_plan_layout(&nfs_super_d, nfs_super.sz_disk, nfs_super.sz_io, nfs_super.sz_blks,
+                            NFS_INODE_RATIO, options.journal_blks) != NFS_ERROR_NONE ||
+            nfs_format(driver_fd, &nfs_super_d) != NFS_ERROR_NONE)
+        {
+            NFS_DBG("[%s] format failed\n", __func__);
+            return -NFS_ERROR_IO;
+        }
+    }
+    if (nfs_super_d.sz_blk > 0)
+    {
+        nfs_super.sz_blks = nfs_super_d.sz_blk;
     }
 
     // 建立in memeory结构，即从磁盘中读取的已经完成了初始化。用磁盘中的super块初始化内存中的super块
     nfs_super.sz_usage = nfs_super_d.sz_usage;
+    nfs_super.max_ino = (nfs_super_d.data_offset - nfs_super_d.inode_offset) / NFS_BLK_SZ();
+    nfs_super.journal_offset = nfs_super_d.journal_offset;
+    nfs_super.journal_blks = nfs_super_d.journal_blks;
+    nfs_super.features = nfs_super_d.features;
+    nfs_super.max_data = ((nfs_super.journal_blks > 0 ? nfs_super.journal_offset : nfs_super.sz_disk) -
+                          nfs_super_d.data_offset) / NFS_BLK_SZ();
+    nfs_super.discard_cnt = 0;
+    nfs_super.inodes = (struct nfs_inode **)calloc(nfs_super.max_ino, sizeof(struct nfs_inode *));
 
     // 建立inode位图（仅仅开辟空间）
     nfs_super.map_inode = (uint8_t *)malloc(NFS_BLKS_SZ(nfs_super_d.map_inode_blks));
@@ -524,6 +1490,14 @@ int nfs_mount(struct custom_options options)
     nfs_super.map_data_offset = nfs_super_d.map_data_offset;
     // data区偏移
     nfs_super.data_offset = nfs_super_d.data_offset;
+    nfs_super.map_dirty = (uint8_t *)calloc(NFS_ROUND_UP(nfs_super.map_inode_blks + nfs_super.map_data_blks,
+                                                         UINT8_BITS) / UINT8_BITS, 1);
+
+    // 重放日志，之后位图和inode都是最新的
+    if (nfs_journal_mount() != NFS_ERROR_NONE)
+    {
+        return -NFS_ERROR_IO;
+    }
 
     // 将磁盘中位图信息复制进来
     if (nfs_driver_read(nfs_super_d.map_inode_offset, (uint8_t *)(nfs_super.map_inode), NFS_BLKS_SZ(nfs_super_d.map_inode_blks)) != NFS_ERROR_NONE)
@@ -538,20 +1512,41 @@ int nfs_mount(struct custom_options options)
     }
     printf("*****in data_map reading back:%d\n", nfs_super.map_data[0]);
 
-    // 如果是第一次挂载，为根dentry分配一个指向其的inode
-    if (is_init)
+    // 上次正常卸载时位图应与超级块中的校验和一致；之后直到卸载都记为未正常卸载
+    if (nfs_super.features & NFS_FEATURE_CSUM)
     {
-        root_inode = nfs_alloc_inode(root_dentry);
-        nfs_sync_inode(root_inode);
+        if (nfs_super_d.state == NFS_STATE_CLEAN &&
+            (nfs_super_d.map_inode_csum != nfs_crc32c(nfs_super.map_inode, NFS_BLKS_SZ(nfs_super.map_inode_blks)) ||
+             nfs_super_d.map_data_csum != nfs_crc32c(nfs_super.map_data, NFS_BLKS_SZ(nfs_super.map_data_blks))))
+        {
+            NFS_DBG("[%s] bitmap checksum mismatch\n", __func__);
+            return -NFS_ERROR_IO;
+        }
+        nfs_super_d.state = NFS_STATE_MOUNTED;
+        nfs_csum_super(&nfs_super_d);
+        if (nfs_driver_write(NFS_SUPER_OFS, (uint8_t *)&nfs_super_d, sizeof(struct nfs_super_d)) != NFS_ERROR_NONE)
+        {
+            return -NFS_ERROR_IO;
+        }
     }
+
     // 从磁盘根据传入的ino中读取inode
     // 如果该inode是一个目录文件，将直接的下一级dentry与inode产生关联
     // 如果该inode是一个普通文件，直接读取数据块
     root_inode = nfs_read_inode(root_dentry, NFS_ROOT_INO);
+    if (root_inode == NULL)
+    {
+        NFS_DBG("[%s] root inode unreadable\n", __func__);
+        return -NFS_ERROR_IO;
+    }
     root_dentry->inode = root_inode;
     nfs_super.root_dentry = root_dentry;
     nfs_super.is_mounted = TRUE;
 
+    if (nfs_wb_start() != NFS_ERROR_NONE)
+    {
+        NFS_DBG("[%s] writeback thread not started\n", __func__);
+    }
     return ret;
 }
 
@@ -568,22 +1563,45 @@ struct nfs_inode *nfs_read_inode(struct nfs_dentry *dentry, int ino)
     struct nfs_inode_d inode_d;
     struct nfs_dentry *sub_dentry;
     struct nfs_dentry_d dentry_d;
+    uint8_t *blk = (uint8_t *)malloc(NFS_BLK_SZ());
+    uint8_t *dirbuf = NULL;
     int dir_cnt = 0;
 
-    /* 从磁盘中读取ino对应的inode_d */
-    if (nfs_driver_read(NFS_INO_OFS(ino), (uint8_t *)&inode_d,
-                        sizeof(struct nfs_inode_d)) != NFS_ERROR_NONE)
+    /* 从磁盘中读取ino对应的inode_d，日志中有尚未写回原位的映像时以它为准 */
+    if (!nfs_journal_read(NFS_BLK_NO(NFS_INO_OFS(ino)), blk) &&
+        nfs_driver_read(NFS_INO_OFS(ino), blk, sizeof(struct nfs_inode_d)) != NFS_ERROR_NONE)
     {
         NFS_DBG("[%s] io error\n", __func__);
+        free(blk);
+        free(inode);
+        return NULL;
+    }
+    if (!nfs_verify_inode_blk(blk))
+    {
+        NFS_DBG("[%s] inode %d checksum mismatch\n", __func__, ino);
+        free(blk);
+        free(inode);
         return NULL;
     }
+    memcpy(&inode_d, blk, sizeof(struct nfs_inode_d));
+    free(blk);
 
     /* 根据inode_d更新内存中inode参数 */
     inode->dir_cnt = 0;
     inode->ino = inode_d.ino;
     inode->size = inode_d.size;
+    inode->link = 1;
+    inode->nlookup = 0;
+    inode->nopen = 0;
+    inode->jseq = 0;
+    inode->dirty = 0;
+    inode->dirtied_when = 0;
+    inode->dirty_prev = inode->dirty_next = NULL;
+    inode->wb_busy = FALSE;
     inode->dentry = dentry;
     inode->dentrys = NULL;
+    pthread_rwlock_init(&inode->dir_lock, NULL);
+    pthread_mutex_init(&inode->lock, NULL);
     for (int i = 0; i < NFS_DATA_PER_FILE; i++)
     {
         inode->used_block_num[i] = inode_d.used_block_num[i];
@@ -591,62 +1609,122 @@ struct nfs_inode *nfs_read_inode(struct nfs_dentry *dentry, int ino)
 
     if (NFS_IS_DIR(inode))
     {
-        dir_cnt = inode_d.dir_cnt;
-        int blk_number = 0;
-        int offset;
-        int dentry_d_per_blks = NFS_BLK_SZ()/sizeof(struct nfs_dentry_d);
-        int num_dentry_d;
-        while (dir_cnt > 0 && blk_number < NFS_DATA_PER_FILE)
+        // 一次读入目录的全部块，物理上连续的合并成一次设备读，再逐项解析
+        int dentry_d_per_blks = NFS_DENTRY_D_PER_DATABLK();
+        int blk_cnt = (inode_d.dir_cnt + dentry_d_per_blks - 1) / dentry_d_per_blks;
+        uint8_t *bufs[NFS_DATA_PER_FILE];
+
+        blk_cnt = blk_cnt > NFS_DATA_PER_FILE ? NFS_DATA_PER_FILE : blk_cnt;
+        dirbuf = (uint8_t *)malloc(NFS_BLKS_SZ(blk_cnt));
+        for (int i = 0; i < blk_cnt; i++)
+        {
+            bufs[i] = dirbuf + NFS_BLKS_SZ(i);
+        }
+        if (nfs_read_data_blks(inode->used_block_num, bufs, blk_cnt) != NFS_ERROR_NONE)
+        {
+            NFS_DBG("[%s] io error\n", __func__);
+            goto err;
+        }
+        for (int i = 0; i < blk_cnt; i++)
         {
-            offset = NFS_DATA_OFS(inode->used_block_num[blk_number]);
-            num_dentry_d = 0;
-            while ((dir_cnt > 0) && num_dentry_d < dentry_d_per_blks)
+            nfs_journal_read(NFS_BLK_NO(NFS_DATA_OFS(inode->used_block_num[i])), bufs[i]);
+            if (!nfs_verify_dentry_blk(bufs[i]))
             {
-                if (nfs_driver_read(offset, (uint8_t *)&dentry_d, sizeof(struct nfs_dentry_d)) != NFS_ERROR_NONE)
-                {
-                    NFS_DBG("[%s] io error\n", __func__);
-                    return NULL;
-                }
-                sub_dentry = new_dentry(dentry_d.fname, dentry_d.ftype);
-                sub_dentry->parent = inode->dentry;
-                sub_dentry->ino = dentry_d.ino;
-                nfs_alloc_dentry(inode, sub_dentry, 0);
-
-                offset += sizeof(struct nfs_dentry_d);
-                dir_cnt--;
-                num_dentry_d++;
+                NFS_DBG("[%s] dentry block %d of inode %d checksum mismatch\n", __func__,
+                        inode->used_block_num[i], ino);
+                goto err;
             }
-            blk_number++;
         }
+        for (; dir_cnt < inode_d.dir_cnt && dir_cnt < blk_cnt * dentry_d_per_blks; dir_cnt++)
+        {
+            memcpy(&dentry_d, bufs[dir_cnt / dentry_d_per_blks] +
+                              (dir_cnt % dentry_d_per_blks) * sizeof(struct nfs_dentry_d),
+                   sizeof(struct nfs_dentry_d));
+            sub_dentry = new_dentry(dentry_d.fname, dentry_d.ftype);
+            sub_dentry->parent = inode->dentry;
+            sub_dentry->ino = dentry_d.ino;
+            nfs_alloc_dentry(inode, sub_dentry, 0);
+        }
+        free(dirbuf);
     }
     else if (NFS_IS_REG(inode))
     {
+        // 数据块在第一次读写时才读入(见nfs_file_load)，这里只开辟缓存
         for (int i = 0; i < NFS_DATA_PER_FILE; i++)
         {
             inode->data[i] = (uint8_t *)malloc(NFS_BLK_SZ());
-            if (nfs_driver_read(NFS_DATA_OFS(inode->used_block_num[i]), (uint8_t *)inode->data[i],
-                                NFS_BLK_SZ()) != NFS_ERROR_NONE)
-            {
-                NFS_DBG("[%s] io error\n", __func__);
-                return NULL;
-            }
+            inode->data_flag[i] = 0;
         }
     }
 
+    if (inode->ino < nfs_super.max_ino)
+    {
+        nfs_super.inodes[inode->ino] = inode;
+    }
     return inode;
+
+err:
+    free(dirbuf);
+    pthread_rwlock_destroy(&inode->dir_lock);
+    pthread_mutex_destroy(&inode->lock);
+    free(inode);
+    return NULL;
 }
 
 int nfs_umount()
 {
     struct nfs_super_d nfs_super_d;
+    struct nfs_inode *inode;
+    struct nfs_dentry *dentry;
+    uint8_t *map_bufs;
+    int *map_blknos;
+    int map_cnt;
 
     if (!nfs_super.is_mounted)
     {
         return NFS_ERROR_NONE;
     }
+    // 后台线程已写回大部分脏内容，停下它之后剩下的由下面的sync写回
+    nfs_wb_stop();
+    // 已删除但仍被引用的inode不在目录树中，卸载时不会再有forget或release，在这里释放
+    for (int ino = 0; ino < nfs_super.max_ino; ino++)
+    {
+        inode = nfs_super.inodes[ino];
+        if (inode != NULL && inode->link == 0)
+        {
+            dentry = inode->dentry;
+            nfs_journal_start(NFS_JOURNAL_OP_BLKS);
+            nfs_free_inode(inode);
+            nfs_journal_stop();
+            free(dentry);
+        }
+    }
     // 写回的是索引节点部分和数据块部分
     nfs_sync_inode(nfs_super.root_dentry->inode);
-    // 内存中超级快更新将写回磁盘的超级快，并将super_d写回
+    // 提交最后的事务并把日志全部写回原位
+    if (nfs_journal_umount() != NFS_ERROR_NONE)
+    {
+        return -NFS_ERROR_IO;
+    }
+    // 只写回两张位图中改动过的块；使用日志时它们已由检查点写回
+    printf("*****in data_map writing back:%d\n", nfs_super.map_data[0]);
+    map_bufs = (uint8_t *)malloc(NFS_BLKS_SZ(nfs_super.map_inode_blks + nfs_super.map_data_blks));
+    map_blknos = (int *)malloc((nfs_super.map_inode_blks + nfs_super.map_data_blks) * sizeof(int));
+    map_cnt = nfs_take_dirty_maps(map_bufs, map_blknos);
+    for (int i = 0; i < map_cnt; i++)
+    {
+        if (nfs_driver_write(NFS_BLKS_SZ(map_blknos[i]), map_bufs + NFS_BLKS_SZ(i), NFS_BLK_SZ()) != NFS_ERROR_NONE)
+        {
+            free(map_bufs);
+            free(map_blknos);
+            return -NFS_ERROR_IO;
+        }
+    }
+    free(map_bufs);
+    free(map_blknos);
+
+    // 内存中超级快更新将写回磁盘的超级快，并将super_d写回；位图都已落盘，记为正常卸载
+    memset(&nfs_super_d, 0, sizeof(struct nfs_super_d));
     nfs_super_d.magic_num = NFS_MAGIC_NUM;
     nfs_super_d.sz_usage = nfs_super.sz_usage;
 
@@ -658,25 +1736,26 @@ int nfs_umount()
     nfs_super_d.map_data_offset = nfs_super.map_data_offset;
     nfs_super_d.data_offset = nfs_super.data_offset;
 
-    if (nfs_driver_write(NFS_SUPER_OFS, (uint8_t *)&nfs_super_d, sizeof(struct nfs_super_d)) != NFS_ERROR_NONE)
-    {
-        return -NFS_ERROR_IO;
-    }
+    nfs_super_d.journal_offset = nfs_super.journal_offset;
+    nfs_super_d.journal_blks = nfs_super.journal_blks;
 
-    // 将inode位图写回
-    if (nfs_driver_write(nfs_super_d.map_inode_offset, (uint8_t *)nfs_super.map_inode, NFS_BLKS_SZ(nfs_super_d.map_inode_blks)) != NFS_ERROR_NONE)
-    {
-        return -NFS_ERROR_IO;
-    }
+    nfs_super_d.features = nfs_super.features;
+    nfs_super_d.state = NFS_STATE_CLEAN;
+    nfs_super_d.map_inode_csum = nfs_crc32c(nfs_super.map_inode, NFS_BLKS_SZ(nfs_super.map_inode_blks));
+    nfs_super_d.map_data_csum = nfs_crc32c(nfs_super.map_data, NFS_BLKS_SZ(nfs_super.map_data_blks));
+    nfs_super_d.sz_blk = nfs_super.sz_blks;
+    nfs_csum_super(&nfs_super_d);
 
-    // 将data位图写回
-    printf("*****in data_map writing back:%d\n", nfs_super.map_data[0]);
-    if (nfs_driver_write(nfs_super_d.map_data_offset, (uint8_t *)nfs_super.map_data, NFS_BLKS_SZ(nfs_super_d.map_data_blks)) != NFS_ERROR_NONE)
+    if (nfs_driver_write(NFS_SUPER_OFS, (uint8_t *)&nfs_super_d, sizeof(struct nfs_super_d)) != NFS_ERROR_NONE)
     {
         return -NFS_ERROR_IO;
     }
+    nfs_flush_discards();
+    ddriver_ioctl(NFS_DRIVER(), IOC_REQ_DEVICE_FLUSH, NULL);
     free(nfs_super.map_inode);
     free(nfs_super.map_data);
+    free(nfs_super.map_dirty);
+    free(nfs_super.inodes);
     ddriver_close(NFS_DRIVER());
     return NFS_ERROR_NONE;
 }
@@ -0,0 +1,538 @@
+#include "../include/newfs.h"
+#include <time.h>
+
+extern struct nfs_super nfs_super;
+
+/******************************************************************************
+ * SECTION: 后台写回
+ *
+ * 数据块写入时只标脏，inode第一次变脏时按时间顺序挂到脏inode链表上：
+ *  - 后台线程每NFS_WB_INTERVAL_MS醒来一次，把变脏超过dirty_expire的inode写回；
+ *    脏块超过上限的一半时不看时间，从最早变脏的开始写，直到降到一半以下
+ *  - 一批最多NFS_WB_BATCH个inode，所有要写的块按块号排序，相邻的合并成一次写
+ *  - 后台线程只trylock，正被占用的inode留到下一轮，不会与前台的加锁顺序冲突
+ *  - 脏块超过上限时，写者在返回前等待后台线程写回(nfs_balance_dirty)
+ *  - 使用日志时元数据由日志负责，后台线程只把放了超过dirty_expire的事务提交；
+ *    不使用日志时inode、目录项块和位图也在这里写回
+ *******************************************************************************/
+struct nfs_wb_blk
+{
+    int blkno;
+    uint8_t *buf;
+};
+
+long nfs_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* 从脏inode链表摘除，调用者持有dirty_lock */
+static void nfs_wb_unlink(struct nfs_inode *inode)
+{
+    if (inode->dirty_prev != NULL)
+    {
+        inode->dirty_prev->dirty_next = inode->dirty_next;
+    }
+    else
+    {
+        nfs_super.dirty_head = inode->dirty_next;
+    }
+    if (inode->dirty_next != NULL)
+    {
+        inode->dirty_next->dirty_prev = inode->dirty_prev;
+    }
+    else
+    {
+        nfs_super.dirty_tail = inode->dirty_prev;
+    }
+    inode->dirty_prev = inode->dirty_next = NULL;
+    inode->dirty = 0;
+}
+
+/**
+ * @brief 标记inode有尚未写回的内容，第一次变脏时挂到链表末尾；
+ * 调用者持有保护这些内容的锁(目录写锁或文件锁)
+ * @param inode
+ * @param flags NFS_DIRTY_*
+ */
+void nfs_mark_inode_dirty(struct nfs_inode *inode, int flags)
+{
+    pthread_mutex_lock(&nfs_super.dirty_lock);
+    if (inode->dirty == 0)
+    {
+        inode->dirtied_when = nfs_now_ms();
+        inode->dirty_prev = nfs_super.dirty_tail;
+        inode->dirty_next = NULL;
+        if (nfs_super.dirty_tail != NULL)
+        {
+            nfs_super.dirty_tail->dirty_next = inode;
+        }
+        else
+        {
+            nfs_super.dirty_head = inode;
+        }
+        nfs_super.dirty_tail = inode;
+    }
+    inode->dirty |= flags;
+    pthread_mutex_unlock(&nfs_super.dirty_lock);
+}
+
+/**
+ * @brief 缓存块标脏并计入脏块数，调用者持有inode->lock
+ * @param inode
+ * @param blk 文件内的块序号
+ */
+void nfs_dirty_blk(struct nfs_inode *inode, int blk)
+{
+    if (!(inode->data_flag[blk] & NFS_FLAG_BUF_DIRTY))
+    {
+        inode->data_flag[blk] |= NFS_FLAG_BUF_DIRTY;
+        __atomic_add_fetch(&nfs_super.nr_dirty, 1, __ATOMIC_RELAXED);
+        nfs_mark_inode_dirty(inode, NFS_DIRTY_DATA);
+    }
+}
+
+/**
+ * @brief 缓存块已写回或被丢弃，清除脏标记，调用者持有inode->lock
+ * @param inode
+ * @param blk 文件内的块序号
+ */
+void nfs_clean_blk(struct nfs_inode *inode, int blk)
+{
+    if (inode->data_flag[blk] & NFS_FLAG_BUF_DIRTY)
+    {
+        inode->data_flag[blk] &= ~NFS_FLAG_BUF_DIRTY;
+        __atomic_sub_fetch(&nfs_super.nr_dirty, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief inode即将被释放：等后台线程写完它，再从脏inode链表摘除
+ * @param inode
+ */
+void nfs_forget_dirty(struct nfs_inode *inode)
+{
+    pthread_mutex_lock(&nfs_super.dirty_lock);
+    while (inode->wb_busy)
+    {
+        pthread_cond_wait(&nfs_super.dirty_cond, &nfs_super.dirty_lock);
+    }
+    if (inode->dirty != 0)
+    {
+        nfs_wb_unlink(inode);
+    }
+    pthread_mutex_unlock(&nfs_super.dirty_lock);
+}
+
+static int nfs_cmp_wb_blk(const void *a, const void *b)
+{
+    return ((const struct nfs_wb_blk *)a)->blkno - ((const struct nfs_wb_blk *)b)->blkno;
+}
+
+/**
+ * @brief 按块号排序后下发，块号相邻的拼成一次写
+ * @param blks
+ * @param cnt
+ * @return int
+ */
+static int nfs_wb_submit(struct nfs_wb_blk *blks, int cnt, long *ios)
+{
+    uint8_t *run = (uint8_t *)malloc(NFS_BLKS_SZ(cnt));
+    int start = 0, end, ret = NFS_ERROR_NONE;
+
+    qsort(blks, cnt, sizeof(struct nfs_wb_blk), nfs_cmp_wb_blk);
+    while (start < cnt)
+    {
+        for (end = start + 1; end < cnt && blks[end].blkno == blks[end - 1].blkno + 1; end++)
+            ;
+        for (int i = start; i < end; i++)
+        {
+            memcpy(run + NFS_BLKS_SZ(i - start), blks[i].buf, NFS_BLK_SZ());
+        }
+        if (ddriver_pwrite(NFS_DRIVER(), (char *)run, NFS_BLKS_SZ(end - start),
+                           NFS_BLKS_SZ(blks[start].blkno)) < 0)
+        {
+            ret = -NFS_ERROR_IO;
+            break;
+        }
+        (*ios)++;
+        start = end;
+    }
+    free(run);
+    return ret;
+}
+
+/**
+ * @brief 把一组inode的脏数据块，以及不使用日志时的inode块、目录项块和位图，排序合并后一起写回；
+ * 成功后这些inode变干净。调用者持有每个inode的锁(目录读锁或文件锁)
+ * @param inodes
+ * @param cnt
+ * @param maps 是否带上位图
+ * @param bg 是否由后台线程写回，只统计后台写回
+ * @return int
+ */
+static int nfs_wb_write(struct nfs_inode **inodes, int cnt, boolean maps, boolean bg)
+{
+    int map_blks = nfs_super.map_inode_blks + nfs_super.map_data_blks;
+    struct nfs_wb_blk *blks = (struct nfs_wb_blk *)malloc((cnt * (2 * NFS_DATA_PER_FILE + 1) + map_blks) *
+                                                          sizeof(struct nfs_wb_blk));
+    uint8_t *meta = (uint8_t *)malloc(NFS_BLKS_SZ(cnt * (NFS_DATA_PER_FILE + 1) + map_blks));
+    int blknos[NFS_DATA_PER_FILE + 1];
+    int *map_blknos = (int *)malloc(map_blks * sizeof(int));
+    int nblk = 0, nmeta = 0, nmaps, flags, packed, ret;
+    long ios = 0;
+    boolean journal = nfs_journal_enabled();
+    struct nfs_inode *inode;
+
+    for (int i = 0; i < cnt; i++)
+    {
+        inode = inodes[i];
+        pthread_mutex_lock(&nfs_super.dirty_lock);
+        flags = inode->dirty;
+        pthread_mutex_unlock(&nfs_super.dirty_lock);
+        if (NFS_IS_REG(inode))
+        {
+            for (int b = 0; b < NFS_DATA_BLKS(inode->size); b++)
+            {
+                if (inode->data_flag[b] & NFS_FLAG_BUF_DIRTY)
+                {
+                    blks[nblk].blkno = NFS_BLK_NO(NFS_DATA_OFS(inode->used_block_num[b]));
+                    blks[nblk++].buf = inode->data[b];
+                }
+            }
+        }
+        if ((flags & NFS_DIRTY_META) && !journal)
+        {
+            packed = nfs_pack_inode(inode, meta + NFS_BLKS_SZ(nmeta), blknos);
+            for (int j = 0; j < packed; j++)
+            {
+                blks[nblk].blkno = blknos[j];
+                blks[nblk++].buf = meta + NFS_BLKS_SZ(nmeta + j);
+            }
+            nmeta += packed;
+        }
+    }
+    nmaps = 0;
+    if (maps && !journal)
+    {
+        // 只带上改动过的位图块，复制时清除标记，之后的修改会重新标脏
+        pthread_mutex_lock(&nfs_super.map_lock);
+        nmaps = nfs_take_dirty_maps(meta + NFS_BLKS_SZ(nmeta), map_blknos);
+        pthread_mutex_unlock(&nfs_super.map_lock);
+        for (int j = 0; j < nmaps; j++)
+        {
+            blks[nblk].blkno = map_blknos[j];
+            blks[nblk++].buf = meta + NFS_BLKS_SZ(nmeta++);
+        }
+    }
+
+    ret = nfs_wb_submit(blks, nblk, &ios);
+    if (ret == NFS_ERROR_NONE)
+    {
+        for (int i = 0; i < cnt; i++)
+        {
+            inode = inodes[i];
+            if (NFS_IS_REG(inode))
+            {
+                for (int b = 0; b < NFS_DATA_PER_FILE; b++)
+                {
+                    nfs_clean_blk(inode, b);
+                }
+            }
+            pthread_mutex_lock(&nfs_super.dirty_lock);
+            if (inode->dirty != 0)
+            {
+                nfs_wb_unlink(inode);
+            }
+            pthread_mutex_unlock(&nfs_super.dirty_lock);
+        }
+    }
+    else if (nmaps > 0)
+    {
+        pthread_mutex_lock(&nfs_super.map_lock);
+        nfs_redirty_maps(map_blknos, nmaps);
+        pthread_mutex_unlock(&nfs_super.map_lock);
+    }
+    if (bg)
+    {
+        pthread_mutex_lock(&nfs_super.dirty_lock);
+        nfs_super.wb_stats.blocks += ret == NFS_ERROR_NONE ? nblk : 0;
+        nfs_super.wb_stats.ios += ios;
+        pthread_mutex_unlock(&nfs_super.dirty_lock);
+    }
+    free(blks);
+    free(meta);
+    free(map_blknos);
+    return ret;
+}
+
+/**
+ * @brief 同步写回一个inode自己的脏内容，不递归，调用者持有它的锁
+ * @param inode
+ * @param maps 是否带上位图
+ * @return int
+ */
+int nfs_write_inode(struct nfs_inode *inode, boolean maps)
+{
+    return nfs_wb_write(&inode, 1, maps, FALSE);
+}
+
+/**
+ * @brief fsync/fdatasync：只写这个inode自己，不从根目录递归。
+ * 它的脏数据块，加上大小或块映射变化时的inode块(目录还有目录项块)和位图，排序后作为一批下发；
+ * 使用日志时元数据改为等记录它的事务提交，同时到来的同步共用一次提交。
+ * newfs的inode不记时间戳，只有数据变化时inode是干净的，fdatasync与fsync都只写数据块
+ * @param inode
+ * @return int
+ */
+int nfs_fsync_inode(struct nfs_inode *inode)
+{
+    boolean meta;
+    int ret;
+
+    if (NFS_IS_DIR(inode))
+    {
+        nfs_dir_lock(inode, FALSE);
+    }
+    else
+    {
+        pthread_mutex_lock(&inode->lock);
+    }
+    pthread_mutex_lock(&nfs_super.dirty_lock);
+    meta = (inode->dirty & NFS_DIRTY_META) != 0;
+    pthread_mutex_unlock(&nfs_super.dirty_lock);
+    ret = nfs_wb_write(&inode, 1, meta, FALSE);
+    if (NFS_IS_DIR(inode))
+    {
+        nfs_dir_unlock(inode);
+    }
+    else
+    {
+        pthread_mutex_unlock(&inode->lock);
+    }
+    if (ret != NFS_ERROR_NONE)
+    {
+        return ret;
+    }
+    return nfs_journal_sync(__atomic_load_n(&inode->jseq, __ATOMIC_RELAXED));
+}
+
+/* 位图是否有未写回的块，只在不使用日志时有 */
+static boolean nfs_wb_maps_dirty()
+{
+    boolean dirty = FALSE;
+
+    pthread_mutex_lock(&nfs_super.map_lock);
+    for (int i = 0; i < NFS_ROUND_UP(nfs_super.map_inode_blks + nfs_super.map_data_blks, UINT8_BITS) / UINT8_BITS; i++)
+    {
+        dirty = dirty || nfs_super.map_dirty[i] != 0;
+    }
+    pthread_mutex_unlock(&nfs_super.map_lock);
+    return dirty;
+}
+
+static boolean nfs_wb_trylock(struct nfs_inode *inode)
+{
+    if (NFS_IS_DIR(inode))
+    {
+        return pthread_rwlock_tryrdlock(&inode->dir_lock) == 0;
+    }
+    return pthread_mutex_trylock(&inode->lock) == 0;
+}
+
+static void nfs_wb_unlock(struct nfs_inode *inode)
+{
+    if (NFS_IS_DIR(inode))
+    {
+        pthread_rwlock_unlock(&inode->dir_lock);
+    }
+    else
+    {
+        pthread_mutex_unlock(&inode->lock);
+    }
+}
+
+/**
+ * @brief 后台写回一轮：取到期的inode，超过脏块上限的一半时取最早变脏的，一批批写回
+ */
+static void nfs_writeback()
+{
+    struct nfs_inode *batch[NFS_WB_BATCH];
+    struct nfs_inode *inode;
+    int cnt, locked, ret = NFS_ERROR_NONE;
+    boolean over, maps;
+    long now;
+
+    do
+    {
+        now = nfs_now_ms();
+        over = __atomic_load_n(&nfs_super.nr_dirty, __ATOMIC_RELAXED) > nfs_super.dirty_limit / 2;
+        cnt = 0;
+        pthread_mutex_lock(&nfs_super.dirty_lock);
+        for (inode = nfs_super.dirty_head; inode != NULL && cnt < NFS_WB_BATCH; inode = inode->dirty_next)
+        {
+            if (!over && now - inode->dirtied_when < nfs_super.dirty_expire)
+            {
+                break; // 链表按变脏先后排列，之后的都没到期
+            }
+            inode->wb_busy = TRUE;
+            batch[cnt++] = inode;
+        }
+        pthread_mutex_unlock(&nfs_super.dirty_lock);
+        maps = cnt == 0 && nfs_wb_maps_dirty();
+
+        locked = 0;
+        for (int i = 0; i < cnt; i++)
+        {
+            if (nfs_wb_trylock(batch[i]))
+            {
+                batch[locked++] = batch[i];
+                continue;
+            }
+            pthread_mutex_lock(&nfs_super.dirty_lock);
+            batch[i]->wb_busy = FALSE;
+            nfs_super.wb_stats.skipped++;
+            pthread_mutex_unlock(&nfs_super.dirty_lock);
+        }
+        if (locked > 0 || maps)
+        {
+            ret = nfs_wb_write(batch, locked, TRUE, TRUE);
+        }
+        for (int i = 0; i < locked; i++)
+        {
+            nfs_wb_unlock(batch[i]);
+        }
+
+        pthread_mutex_lock(&nfs_super.dirty_lock);
+        for (int i = 0; i < locked; i++)
+        {
+            batch[i]->wb_busy = FALSE;
+        }
+        if (locked > 0)
+        {
+            nfs_super.wb_stats.rounds++;
+            nfs_super.wb_stats.inodes += ret == NFS_ERROR_NONE ? locked : 0;
+        }
+        pthread_cond_broadcast(&nfs_super.dirty_cond);
+        pthread_mutex_unlock(&nfs_super.dirty_lock);
+        // 全部被占用或写出错时等下一轮
+    } while (locked > 0 && ret == NFS_ERROR_NONE);
+}
+
+static void *nfs_wb_main(void *arg)
+{
+    struct timespec ts;
+
+    pthread_mutex_lock(&nfs_super.dirty_lock);
+    while (!nfs_super.wb_stop)
+    {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += NFS_WB_INTERVAL_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&nfs_super.wb_cond, &nfs_super.dirty_lock, &ts);
+        if (nfs_super.wb_stop)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&nfs_super.dirty_lock);
+
+        nfs_writeback();
+        if (nfs_journal_commit_expired(nfs_super.dirty_expire))
+        {
+            pthread_mutex_lock(&nfs_super.dirty_lock);
+            nfs_super.wb_stats.commits++;
+            pthread_mutex_unlock(&nfs_super.dirty_lock);
+        }
+
+        pthread_mutex_lock(&nfs_super.dirty_lock);
+    }
+    pthread_mutex_unlock(&nfs_super.dirty_lock);
+    return NULL;
+}
+
+/**
+ * @brief 挂载时初始化脏inode链表，在任何inode变脏之前调用；
+ * dirty_expire、dirty_ratio不大于0时取默认值
+ * @param options
+ */
+void nfs_wb_init(struct custom_options options)
+{
+    pthread_mutex_init(&nfs_super.dirty_lock, NULL);
+    pthread_cond_init(&nfs_super.dirty_cond, NULL);
+    pthread_cond_init(&nfs_super.wb_cond, NULL);
+    nfs_super.dirty_head = nfs_super.dirty_tail = NULL;
+    nfs_super.nr_dirty = 0;
+    nfs_super.dirty_expire = options.dirty_expire > 0 ? options.dirty_expire : NFS_DIRTY_EXPIRE_MS;
+    nfs_super.dirty_limit = options.dirty_ratio > 0 && options.dirty_ratio <= 100 ? options.dirty_ratio
+                                                                                  : NFS_DIRTY_RATIO;
+    nfs_super.wb_stop = TRUE;
+    memset(&nfs_super.wb_stats, 0, sizeof(struct nfs_wb_stats));
+}
+
+/**
+ * @brief 挂载完成后启动后台写回线程
+ * @return int
+ */
+int nfs_wb_start()
+{
+    nfs_super.dirty_limit = nfs_super.max_data * nfs_super.dirty_limit / 100;
+    nfs_super.dirty_limit = nfs_super.dirty_limit > 0 ? nfs_super.dirty_limit : 1;
+    nfs_super.wb_stop = FALSE;
+    if (pthread_create(&nfs_super.wb_thread, NULL, nfs_wb_main, NULL) != 0)
+    {
+        nfs_super.wb_stop = TRUE;
+        return -NFS_ERROR_IO;
+    }
+    return NFS_ERROR_NONE;
+}
+
+/**
+ * @brief 卸载时停止后台写回线程并打印统计，剩下的脏内容由卸载写回
+ */
+void nfs_wb_stop()
+{
+    pthread_mutex_lock(&nfs_super.dirty_lock);
+    if (nfs_super.wb_stop)
+    {
+        pthread_mutex_unlock(&nfs_super.dirty_lock);
+        return;
+    }
+    nfs_super.wb_stop = TRUE;
+    pthread_cond_broadcast(&nfs_super.wb_cond);
+    pthread_cond_broadcast(&nfs_super.dirty_cond);
+    pthread_mutex_unlock(&nfs_super.dirty_lock);
+    pthread_join(nfs_super.wb_thread, NULL);
+    printf("*****writeback: %ld rounds, %ld inodes, %ld blocks in %ld ios, %ld skipped, %ld commits, "
+           "throttled %ld times for %ld ms\n",
+           nfs_super.wb_stats.rounds, nfs_super.wb_stats.inodes, nfs_super.wb_stats.blocks,
+           nfs_super.wb_stats.ios, nfs_super.wb_stats.skipped, nfs_super.wb_stats.commits,
+           nfs_super.wb_stats.throttled, nfs_super.wb_stats.throttle_ms);
+}
+
+/**
+ * @brief 脏块超过上限时唤醒后台线程，等它写回到上限以下；
+ * 写操作返回前调用，此时不能持有任何锁或日志handle
+ */
+void nfs_balance_dirty()
+{
+    long start;
+
+    if (__atomic_load_n(&nfs_super.nr_dirty, __ATOMIC_RELAXED) <= nfs_super.dirty_limit)
+    {
+        return;
+    }
+    start = nfs_now_ms();
+    pthread_mutex_lock(&nfs_super.dirty_lock);
+    nfs_super.wb_stats.throttled++;
+    while (__atomic_load_n(&nfs_super.nr_dirty, __ATOMIC_RELAXED) > nfs_super.dirty_limit &&
+           !nfs_super.wb_stop)
+    {
+        pthread_cond_signal(&nfs_super.wb_cond);
+        pthread_cond_wait(&nfs_super.dirty_cond, &nfs_super.dirty_lock);
+    }
+    nfs_super.wb_stats.throttle_ms += nfs_now_ms() - start;
+    pthread_mutex_unlock(&nfs_super.dirty_lock);
+}
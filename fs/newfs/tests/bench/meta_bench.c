@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "ddriver_ctl_user.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define DEFAULT_FILES   32   /* 1KB块时一个目录最多6 * 7 = 42项 */
+#define DEFAULT_DEPTH   16
+#define DEFAULT_STATS   10000
+#define DEFAULT_RENAMES 1000
+#define PATH_LEN        1024
+#define SEED            1    /* 随机stat的序列固定，版本之间可比 */
+/******************************************************************************
+* SECTION: Global Data
+*******************************************************************************/
+static const char *mnt, *label = "";
+static int nfiles, depth, nstats, nrenames;
+static int ctl_fd = -1;              /* 挂载点的描述符，经由它读取newfs进程内的ddriver计数 */
+static int have_dev;
+
+/* 一个负载的结果：每次操作的延迟和前后的设备计数 */
+struct result {
+    const char *name;
+    double    *lat;                  /* 秒 */
+    int        ops;
+    int        errs;
+    int        last_err;
+    double     start, elapsed;
+    struct ddriver_state dev0, dev1;
+};
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+static void dev_state(struct ddriver_state *st) {
+    memset(st, 0, sizeof(*st));
+    if (have_dev && ioctl(ctl_fd, IOC_REQ_DEVICE_STATE, st) < 0)
+        have_dev = 0;
+}
+static void begin(struct result *r, const char *name, int max_ops) {
+    memset(r, 0, sizeof(*r));
+    r->name = name;
+    r->lat  = calloc(max_ops > 0 ? max_ops : 1, sizeof(double));
+    dev_state(&r->dev0);
+    r->start = now_sec();
+}
+/**
+ * @brief 计时一次操作，ret < 0时记为失败，errno保留下来输出
+ */
+static void account(struct result *r, double t0, int ret) {
+    double t = now_sec() - t0;
+    if (ret < 0) {
+        r->errs++;
+        r->last_err = errno;
+        return;
+    }
+    r->lat[r->ops++] = t;
+}
+/**
+ * @brief 一个负载一行JSON：吞吐、p50/p99延迟和这段时间内的ddriver读写寻道次数
+ */
+static void end(struct result *r) {
+    double p50 = 0, p99 = 0, max = 0;
+
+    r->elapsed = now_sec() - r->start;
+    dev_state(&r->dev1);
+    if (r->ops > 0) {
+        qsort(r->lat, r->ops, sizeof(double), cmp_double);
+        p50 = r->lat[r->ops * 50 / 100];
+        p99 = r->lat[r->ops * 99 / 100];
+        max = r->lat[r->ops - 1];
+    }
+    printf("{\"label\":\"%s\",\"workload\":\"%s\",\"ops\":%d,\"errors\":%d,\"seconds\":%.6f,"
+           "\"ops_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f",
+           label, r->name, r->ops, r->errs, r->elapsed, r->elapsed > 0 ? r->ops / r->elapsed : 0,
+           p50 * 1e6, p99 * 1e6, max * 1e6);
+    if (r->errs > 0)
+        printf(",\"error\":\"%s\"", strerror(r->last_err));
+    if (have_dev)
+        printf(",\"reads\":%d,\"writes\":%d,\"seeks\":%d", r->dev1.read_cnt - r->dev0.read_cnt,
+               r->dev1.write_cnt - r->dev0.write_cnt, r->dev1.seek_cnt - r->dev0.seek_cnt);
+    else
+        printf(",\"reads\":null,\"writes\":null,\"seeks\":null");
+    printf("}\n");
+    fflush(stdout);
+    free(r->lat);
+}
+static void file_path(char *path, const char *prefix, int i) {
+    snprintf(path, PATH_LEN, "%s/mb/c/%s%d", mnt, prefix, i);
+}
+/**
+ * @brief 第level层目录的路径 mb/d/d/.../d，level从1开始
+ */
+static void deep_path(char *path, int level) {
+    int len = snprintf(path, PATH_LEN, "%s/mb", mnt);
+    for (int i = 0; i < level && len < PATH_LEN - 3; i++)
+        len += snprintf(path + len, PATH_LEN - len, "/d");
+}
+/******************************************************************************
+* SECTION: Workloads
+*******************************************************************************/
+/**
+ * @brief 在同一目录下创建nfiles个空文件，目录满时提前结束；返回建成的个数
+ */
+static int bench_create(void) {
+    struct result r;
+    char path[PATH_LEN];
+    double t0;
+    int fd;
+
+    begin(&r, "create", nfiles);
+    for (int i = 0; i < nfiles; i++) {
+        file_path(path, "f", i);
+        t0 = now_sec();
+        fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd >= 0)
+            close(fd);
+        account(&r, t0, fd);
+        if (fd < 0 && errno == ENOSPC)
+            break;
+    }
+    end(&r);
+    return r.ops;
+}
+static void bench_stat(int created) {
+    struct result r;
+    struct stat st;
+    char path[PATH_LEN];
+    unsigned int seed = SEED;
+    double t0;
+
+    begin(&r, "stat_random", nstats);
+    for (int i = 0; created > 0 && i < nstats; i++) {
+        file_path(path, "f", rand_r(&seed) % created);
+        t0 = now_sec();
+        account(&r, t0, stat(path, &st));
+    }
+    end(&r);
+}
+/**
+ * @brief 每次操作是一次完整的opendir/readdir/closedir
+ */
+static void bench_readdir(int created) {
+    struct result r;
+    char path[PATH_LEN];
+    struct dirent *de;
+    DIR *dir;
+    double t0;
+    int rounds = nstats / (created + 1) + 1, cnt;
+
+    snprintf(path, PATH_LEN, "%s/mb/c", mnt);
+    begin(&r, "readdir", rounds);
+    for (int i = 0; i < rounds; i++) {
+        t0 = now_sec();
+        dir = opendir(path);
+        if (dir == NULL) {
+            account(&r, t0, -1);
+            continue;
+        }
+        for (cnt = 0; (de = readdir(dir)) != NULL; cnt++)
+            ;
+        closedir(dir);
+        if (cnt < created)
+            errno = ENOENT; /* 少了项也算失败 */
+        account(&r, t0, cnt < created ? -1 : 0);
+    }
+    end(&r);
+}
+/**
+ * @brief 逐层mkdir出深度为depth的目录链，返回建成的层数
+ */
+static int bench_mkdir_deep(void) {
+    struct result r;
+    char path[PATH_LEN];
+    double t0;
+    int ret;
+
+    begin(&r, "mkdir_deep", depth);
+    for (int level = 1; level <= depth; level++) {
+        deep_path(path, level);
+        t0 = now_sec();
+        ret = mkdir(path, 0755);
+        account(&r, t0, ret);
+        if (ret < 0)
+            break;
+    }
+    end(&r);
+    return r.ops;
+}
+static void bench_stat_deep(int levels) {
+    struct result r;
+    struct stat st;
+    char path[PATH_LEN];
+    double t0;
+
+    deep_path(path, levels);
+    begin(&r, "stat_deep", nstats);
+    for (int i = 0; levels > 0 && i < nstats; i++) {
+        t0 = now_sec();
+        account(&r, t0, stat(path, &st));
+    }
+    end(&r);
+}
+/**
+ * @brief 同一目录内反复改名，每次把f<i>改成r<i>再改回来，算两次操作
+ */
+static void bench_rename(int created) {
+    struct result r;
+    char from[PATH_LEN], to[PATH_LEN];
+    double t0;
+    int i, ret;
+
+    begin(&r, "rename", nrenames);
+    for (int n = 0; created > 0 && n + 1 < nrenames; n += 2) {
+        i = n / 2 % created;
+        file_path(from, "f", i);
+        file_path(to, "r", i);
+        t0 = now_sec();
+        ret = rename(from, to);
+        account(&r, t0, ret);
+        if (ret < 0 && (errno == ENOSYS || errno == EPERM))
+            break; /* 不支持rename时不必重复失败 */
+        t0 = now_sec();
+        account(&r, t0, rename(to, from));
+    }
+    end(&r);
+}
+static void bench_unlink(int created) {
+    struct result r;
+    char path[PATH_LEN];
+    double t0;
+
+    begin(&r, "unlink", created);
+    for (int i = 0; i < created; i++) {
+        file_path(path, "f", i);
+        t0 = now_sec();
+        account(&r, t0, unlink(path));
+    }
+    end(&r);
+}
+static void bench_rmdir_deep(int levels) {
+    struct result r;
+    char path[PATH_LEN];
+    double t0;
+
+    begin(&r, "rmdir_deep", levels);
+    for (int level = levels; level >= 1; level--) {
+        deep_path(path, level);
+        t0 = now_sec();
+        account(&r, t0, rmdir(path));
+    }
+    end(&r);
+}
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n files] [-d depth] [-s stats] [-r renames] [-l label] <mountpoint>\n", prog);
+}
+/******************************************************************************
+* SECTION: Main
+*******************************************************************************/
+/**
+ * @brief 元数据基准：在挂载点下依次跑create、随机stat、readdir、深目录mkdir/stat、rename、unlink、rmdir，
+ * 每个负载输出一行JSON(ops/s、p50/p99延迟、ddriver读写寻道次数)，便于不同版本之间比较
+ *
+ * usage: meta_bench [-n files] [-d depth] [-s stats] [-r renames] [-l label] <mountpoint>
+ * -n 同一目录下创建的文件数；-d 目录链深度；-s 随机stat和深路径stat的次数，readdir按同样的总项数折算；
+ * -r rename次数；-l 写入每行的标签，如版本号
+ * 设备计数经挂载点上的ioctl(IOC_REQ_DEVICE_STATE)从newfs进程读出，写回线程延后的写入计在之后的负载里；
+ * 不是newfs时输出null
+ */
+int main(int argc, char **argv) {
+    struct ddriver_state probe;
+    char path[PATH_LEN];
+    int opt, created, levels;
+
+    nfiles   = DEFAULT_FILES;
+    depth    = DEFAULT_DEPTH;
+    nstats   = DEFAULT_STATS;
+    nrenames = DEFAULT_RENAMES;
+    while ((opt = getopt(argc, argv, "n:d:s:r:l:")) != -1) {
+        switch (opt) {
+        case 'n': nfiles = atoi(optarg); break;
+        case 'd': depth = atoi(optarg); break;
+        case 's': nstats = atoi(optarg); break;
+        case 'r': nrenames = atoi(optarg); break;
+        case 'l': label = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || nfiles <= 0 || depth <= 0 || nstats <= 0 || nrenames < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    mnt = argv[optind];
+
+    ctl_fd = open(mnt, O_RDONLY | O_DIRECTORY);
+    if (ctl_fd < 0) {
+        fprintf(stderr, "open %s: %s\n", mnt, strerror(errno));
+        return 1;
+    }
+    have_dev = 1;
+    dev_state(&probe); /* 不支持时have_dev清零 */
+
+    snprintf(path, PATH_LEN, "%s/mb", mnt);
+    if (mkdir(path, 0755) < 0) {
+        fprintf(stderr, "mkdir %s: %s (remove it from an earlier run)\n", path, strerror(errno));
+        return 1;
+    }
+    snprintf(path, PATH_LEN, "%s/mb/c", mnt);
+    if (mkdir(path, 0755) < 0) {
+        fprintf(stderr, "mkdir %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    created = bench_create();
+    bench_stat(created);
+    bench_readdir(created);
+    levels = bench_mkdir_deep();
+    bench_stat_deep(levels);
+    bench_rename(created);
+    bench_unlink(created);
+    bench_rmdir_deep(levels);
+
+    snprintf(path, PATH_LEN, "%s/mb/c", mnt);
+    rmdir(path);
+    snprintf(path, PATH_LEN, "%s/mb", mnt);
+    rmdir(path);
+    close(ctl_fd);
+    return 0;
+}
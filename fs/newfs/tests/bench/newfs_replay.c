@@ -0,0 +1,341 @@
+#include <time.h>
+#include <getopt.h>
+#include "newfs.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define DEFAULT_DIRS    8
+#define DEFAULT_FILES   16      /* 每个目录；1KB块时一个目录最多42项 */
+#define DEFAULT_IO      2048    /* 每个文件写入、读出的字节数 */
+#define DEFAULT_ROUNDS  4       /* readdir/getattr/read轮数 */
+#define MAX_IO          (1 << 20)
+#define LINE_LEN        1024
+#define SEED            1
+/******************************************************************************
+* SECTION: Global Data
+*******************************************************************************/
+extern struct custom_options newfs_options;
+
+enum op_type {
+    OP_MKDIR, OP_MKNOD, OP_GETATTR, OP_READDIR, OP_WRITE, OP_READ, OP_TRUNCATE, OP_UNLINK, OP_RMDIR, OP_NR
+};
+static const char *op_name[OP_NR] = {
+    "mkdir", "mknod", "getattr", "readdir", "write", "read", "truncate", "unlink", "rmdir",
+};
+
+/* 轨迹中的一项：write/read为 路径 偏移 字节数，truncate为 路径 大小 */
+struct op {
+    enum op_type type;
+    char        *path;
+    long         a, b;
+};
+
+/* 一类操作的累计：线程CPU时间、墙钟时间和期间ddriver的读写寻道次数 */
+struct op_stat {
+    long   count, errs;
+    double cpu, wall;
+    long   reads, writes, seeks;
+};
+
+static struct op *ops;
+static int nops, cap;
+static struct op_stat stats[OP_NR];
+static FILE *report;
+static const char *label = "";
+static char *iobuf;
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+static double cpu_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+static void dev_state(struct ddriver_state *st) {
+    memset(st, 0, sizeof(*st));
+    nfs_driver_ioctl(IOC_REQ_DEVICE_STATE, st);
+}
+static void add_op(enum op_type type, const char *path, long a, long b) {
+    if (nops == cap) {
+        cap = cap > 0 ? cap * 2 : 1024;
+        ops = realloc(ops, cap * sizeof(struct op));
+    }
+    ops[nops].type = type;
+    ops[nops].path = strdup(path);
+    ops[nops].a    = a;
+    ops[nops].b    = b;
+    nops++;
+}
+/**
+ * @brief 读入轨迹文件，每行 op path [a [b]]，#开头为注释
+ */
+static int load_trace(const char *file) {
+    char line[LINE_LEN], name[32], path[LINE_LEN];
+    long a, b;
+    int lineno = 0, type, n;
+    FILE *fp = fopen(file, "r");
+
+    if (fp == NULL) {
+        fprintf(stderr, "open %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        a = b = 0;
+        n = sscanf(line, "%31s %1023s %ld %ld", name, path, &a, &b);
+        if (n <= 0 || name[0] == '#')
+            continue;
+        for (type = 0; type < OP_NR && strcmp(name, op_name[type]) != 0; type++)
+            ;
+        if (type == OP_NR || n < 2 || path[0] != '/' ||
+            ((type == OP_WRITE || type == OP_READ) && (n < 4 || a < 0 || b < 0 || b > MAX_IO)) ||
+            (type == OP_TRUNCATE && (n < 3 || a < 0))) {
+            fprintf(stderr, "%s:%d: bad op: %s", file, lineno, line);
+            fclose(fp);
+            return -1;
+        }
+        add_op(type, path, a, b);
+    }
+    fclose(fp);
+    return 0;
+}
+/**
+ * @brief 合成轨迹：建dirs个目录、每个files个文件并写入io字节，
+ * 再做rounds轮readdir、随机getattr和整文件读，最后全部删除
+ */
+static void gen_trace(int dirs, int files, int io, int rounds) {
+    char path[LINE_LEN];
+    unsigned int seed = SEED;
+    int d, f, r, i;
+
+    for (d = 0; d < dirs; d++) {
+        snprintf(path, LINE_LEN, "/r%d", d);
+        add_op(OP_MKDIR, path, 0, 0);
+        for (f = 0; f < files; f++) {
+            snprintf(path, LINE_LEN, "/r%d/f%d", d, f);
+            add_op(OP_MKNOD, path, 0, 0);
+            add_op(OP_WRITE, path, 0, io);
+        }
+    }
+    for (r = 0; r < rounds; r++) {
+        for (d = 0; d < dirs; d++) {
+            snprintf(path, LINE_LEN, "/r%d", d);
+            add_op(OP_READDIR, path, 0, 0);
+            for (f = 0; f < files; f++) {
+                i = rand_r(&seed) % (dirs * files);
+                snprintf(path, LINE_LEN, "/r%d/f%d", i / files, i % files);
+                add_op(OP_GETATTR, path, 0, 0);
+                snprintf(path, LINE_LEN, "/r%d/f%d", d, f);
+                add_op(OP_READ, path, 0, io);
+            }
+        }
+    }
+    for (d = 0; d < dirs; d++) {
+        for (f = 0; f < files; f++) {
+            snprintf(path, LINE_LEN, "/r%d/f%d", d, f);
+            add_op(OP_UNLINK, path, 0, 0);
+        }
+        snprintf(path, LINE_LEN, "/r%d", d);
+        add_op(OP_RMDIR, path, 0, 0);
+    }
+}
+static int write_trace(const char *file) {
+    FILE *fp = fopen(file, "w");
+
+    if (fp == NULL) {
+        fprintf(stderr, "open %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < nops; i++) {
+        if (ops[i].type == OP_WRITE || ops[i].type == OP_READ)
+            fprintf(fp, "%s %s %ld %ld\n", op_name[ops[i].type], ops[i].path, ops[i].a, ops[i].b);
+        else if (ops[i].type == OP_TRUNCATE)
+            fprintf(fp, "%s %s %ld\n", op_name[ops[i].type], ops[i].path, ops[i].a);
+        else
+            fprintf(fp, "%s %s\n", op_name[ops[i].type], ops[i].path);
+    }
+    fclose(fp);
+    return 0;
+}
+#if FUSE_USE_VERSION >= 30
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off,
+                       enum fuse_fill_dir_flags flags) {
+#else
+static int count_entry(void *buf, const char *name, const struct stat *st, off_t off) {
+#endif
+    (*(int *)buf)++;
+    return 0;
+}
+/**
+ * @brief newfs_readdir每次按偏移填一项，像libfuse一样从0开始调用到不再填充为止
+ */
+static int read_dir(const char *path) {
+    int filled, ret;
+    off_t off = 0;
+
+    do {
+        filled = 0;
+        ret = newfs_readdir(path, &filled, count_entry, off, NULL);
+        off += filled;
+    } while (ret == 0 && filled > 0);
+    return ret;
+}
+static int run_op(struct op *op) {
+    struct stat st;
+
+    switch (op->type) {
+    case OP_MKDIR:    return newfs_mkdir(op->path, S_IFDIR | 0755);
+    case OP_MKNOD:    return newfs_mknod(op->path, S_IFREG | 0644, 0);
+    case OP_GETATTR:  return newfs_getattr(op->path, &st);
+    case OP_READDIR:  return read_dir(op->path);
+    case OP_WRITE:    return newfs_write(op->path, iobuf, op->b, op->a, NULL);
+    case OP_READ:     return newfs_read(op->path, iobuf, op->b, op->a, NULL);
+    case OP_TRUNCATE: return newfs_truncate(op->path, op->a);
+    case OP_UNLINK:   return newfs_unlink(op->path);
+    case OP_RMDIR:    return newfs_rmdir(op->path);
+    default:          return -EINVAL;
+    }
+}
+/**
+ * @brief 一类操作一行JSON，dev为0时该行没有设备计数
+ */
+static void print_stat(const char *name, struct op_stat *s, int dev) {
+    fprintf(report, "{\"label\":\"%s\",\"op\":\"%s\",\"count\":%ld,\"errors\":%ld,\"cpu_us\":%.1f,"
+                    "\"cpu_us_per_op\":%.2f,\"wall_us_per_op\":%.2f",
+            label, name, s->count, s->errs, s->cpu * 1e6, s->count > 0 ? s->cpu * 1e6 / s->count : 0,
+            s->count > 0 ? s->wall * 1e6 / s->count : 0);
+    if (dev)
+        fprintf(report, ",\"reads\":%ld,\"writes\":%ld,\"seeks\":%ld", s->reads, s->writes, s->seeks);
+    fprintf(report, "}\n");
+}
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-g dirs,files,io,rounds] [-w trace_out] [-j journal_blks] [-l label] [-V] [-v] "
+                    "device [trace]\n", prog);
+}
+/******************************************************************************
+* SECTION: Main
+*******************************************************************************/
+/**
+ * @brief 进程内回放newfs操作轨迹：直接调用newfs_mkdir/newfs_mknod/newfs_getattr/newfs_readdir/
+ * newfs_write/newfs_read等，不经过内核FUSE，按操作类型统计线程CPU时间、墙钟时间和ddriver读写寻道次数
+ *
+ * usage: newfs_replay [-g dirs,files,io,rounds] [-w trace_out] [-j journal_blks] [-l label] [-V] [-v] device [trace]
+ * 给出trace时回放该文件，每行 op path [a [b]]：mkdir/mknod/getattr/readdir/unlink/rmdir只有路径，
+ * write/read带偏移和字节数，truncate带大小；否则按-g合成轨迹(默认8,16,2048,4)，-w把轨迹写出以便修改后回放
+ * -V 使用ddriver虚拟时钟，不再按模拟延迟sleep；-v 保留newfs自己的调试输出(默认丢弃，结果写在stdout)
+ * 操作之间后台写回线程做的I/O单独记为background一行
+ */
+int main(int argc, char **argv) {
+    struct ddriver_state d0, d1, mounted;
+    struct op_stat total = { 0 }, bg = { 0 }, mount_st = { 0 }, umount_st = { 0 };
+    const char *trace_out = NULL;
+    int dirs = DEFAULT_DIRS, files = DEFAULT_FILES, io = DEFAULT_IO, rounds = DEFAULT_ROUNDS;
+    int journal = -1, verbose = 0, opt, ret;
+    double c0, w0, start;
+
+    while ((opt = getopt(argc, argv, "g:w:j:l:Vv")) != -1) {
+        switch (opt) {
+        case 'g':
+            if (sscanf(optarg, "%d,%d,%d,%d", &dirs, &files, &io, &rounds) != 4) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'w': trace_out = optarg; break;
+        case 'j': journal = atoi(optarg); break;
+        case 'l': label = optarg; break;
+        case 'V': setenv("DDRIVER_VCLOCK", "1", 1); break;
+        case 'v': verbose = 1; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc || argc - optind > 2 || dirs <= 0 || files <= 0 || io < 0 || io > MAX_IO || rounds < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (argc - optind == 2 ? load_trace(argv[optind + 1]) < 0 : (gen_trace(dirs, files, io, rounds), 0))
+        return 1;
+    if (trace_out != NULL && write_trace(trace_out) < 0)
+        return 1;
+    iobuf = malloc(MAX_IO);
+    memset(iobuf, 'n', MAX_IO);
+
+    /* newfs在stdout上打印调试信息，结果另用一份stdout的副本输出 */
+    report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!verbose && freopen("/dev/null", "w", stdout) == NULL) {
+        perror("freopen");
+        return 1;
+    }
+
+    newfs_default_options();
+    newfs_options.device = argv[optind];
+    if (journal >= 0)
+        newfs_options.journal_blks = journal;
+    c0 = cpu_sec();
+    w0 = now_sec();
+    ret = nfs_mount(newfs_options);
+    mount_st.cpu = cpu_sec() - c0;
+    mount_st.wall = now_sec() - w0;
+    mount_st.count = 1;
+    if (ret != NFS_ERROR_NONE) {
+        fprintf(stderr, "mount %s: %s\n", argv[optind], strerror(-ret));
+        return 1;
+    }
+    dev_state(&mounted);
+    mount_st.reads = mounted.read_cnt;
+    mount_st.writes = mounted.write_cnt;
+    mount_st.seeks = mounted.seek_cnt;
+
+    start = now_sec();
+    for (int i = 0; i < nops; i++) {
+        struct op_stat *s = &stats[ops[i].type];
+        dev_state(&d0);
+        c0 = cpu_sec();
+        w0 = now_sec();
+        ret = run_op(&ops[i]);
+        s->cpu += cpu_sec() - c0;
+        s->wall += now_sec() - w0;
+        dev_state(&d1);
+        s->count++;
+        s->errs += ret < 0;
+        s->reads += d1.read_cnt - d0.read_cnt;
+        s->writes += d1.write_cnt - d0.write_cnt;
+        s->seeks += d1.seek_cnt - d0.seek_cnt;
+    }
+    total.wall = now_sec() - start;
+    dev_state(&d1);
+
+    c0 = cpu_sec();
+    w0 = now_sec();
+    nfs_umount();
+    umount_st.cpu = cpu_sec() - c0;
+    umount_st.wall = now_sec() - w0;
+    umount_st.count = 1;
+
+    print_stat("mount", &mount_st, 1);
+    for (int t = 0; t < OP_NR; t++) {
+        if (stats[t].count == 0)
+            continue;
+        print_stat(op_name[t], &stats[t], 1);
+        total.count += stats[t].count;
+        total.errs += stats[t].errs;
+        total.cpu += stats[t].cpu;
+        total.reads += stats[t].reads;
+        total.writes += stats[t].writes;
+        total.seeks += stats[t].seeks;
+    }
+    /* 回放期间的总I/O减去计在各操作上的，其余是后台写回线程在操作之间做的 */
+    bg.reads = d1.read_cnt - mounted.read_cnt - total.reads;
+    bg.writes = d1.write_cnt - mounted.write_cnt - total.writes;
+    bg.seeks = d1.seek_cnt - mounted.seek_cnt - total.seeks;
+    print_stat("background", &bg, 1);
+    print_stat("umount", &umount_st, 0); /* 卸载后设备已关闭，读不到计数 */
+    print_stat("total", &total, 1);
+    fclose(report);
+    return total.errs > 0;
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define DEFAULT_THREADS 4
+#define DEFAULT_FILES   16
+#define DEFAULT_ROUNDS  200
+#define PATH_LEN        512
+/******************************************************************************
+* SECTION: Global Data
+*******************************************************************************/
+static const char *mnt;
+static int nfiles, rounds;
+
+struct worker {
+    pthread_t tid;
+    int       id;
+    long      ops;
+    long      errs;
+};
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+/**
+ * @brief 在挂载点下为每个线程建立独立子树 t<id>/f<i>
+ */
+static int setup(int nthreads) {
+    char path[PATH_LEN];
+    int t, i, fd;
+
+    for (t = 0; t < nthreads; t++) {
+        snprintf(path, PATH_LEN, "%s/t%d", mnt, t);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            fprintf(stderr, "mkdir %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        for (i = 0; i < nfiles; i++) {
+            snprintf(path, PATH_LEN, "%s/t%d/f%d", mnt, t, i);
+            fd = open(path, O_CREAT | O_RDONLY, 0644);
+            if (fd < 0) {
+                fprintf(stderr, "create %s: %s\n", path, strerror(errno));
+                return -1;
+            }
+            close(fd);
+        }
+    }
+    return 0;
+}
+/**
+ * @brief 线程主体: 反复对自己的子树做 stat / readdir / read
+ *
+ * read 尚未实现时会返回 ENOSYS，此时只统计打开的开销
+ */
+static void *run(void *arg) {
+    struct worker *w = arg;
+    char path[PATH_LEN], buf[512];
+    struct stat st;
+    struct dirent *de;
+    DIR *dir;
+    int r, i, fd;
+
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < nfiles; i++) {
+            snprintf(path, PATH_LEN, "%s/t%d/f%d", mnt, w->id, i);
+            if (stat(path, &st) < 0)
+                w->errs++;
+            w->ops++;
+        }
+
+        snprintf(path, PATH_LEN, "%s/t%d", mnt, w->id);
+        dir = opendir(path);
+        if (dir == NULL) {
+            w->errs++;
+        } else {
+            while ((de = readdir(dir)) != NULL)
+                ;
+            closedir(dir);
+        }
+        w->ops++;
+
+        snprintf(path, PATH_LEN, "%s/t%d/f%d", mnt, w->id, r % nfiles);
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            w->errs++;
+        } else {
+            if (read(fd, buf, sizeof(buf)) < 0 && errno != ENOSYS)
+                w->errs++;
+            close(fd);
+        }
+        w->ops++;
+    }
+    return NULL;
+}
+/**
+ * @brief 以 nthreads 个线程跑一轮，返回总 ops/s
+ */
+static double bench(int nthreads, long *errs) {
+    struct worker *ws = calloc(nthreads, sizeof(struct worker));
+    double start, elapsed;
+    long ops = 0;
+    int t;
+
+    start = now_sec();
+    for (t = 0; t < nthreads; t++) {
+        ws[t].id = t;
+        pthread_create(&ws[t].tid, NULL, run, &ws[t]);
+    }
+    for (t = 0; t < nthreads; t++) {
+        pthread_join(ws[t].tid, NULL);
+        ops += ws[t].ops;
+        *errs += ws[t].errs;
+    }
+    elapsed = now_sec() - start;
+    free(ws);
+    return ops / elapsed;
+}
+/******************************************************************************
+* SECTION: Main
+*******************************************************************************/
+/**
+ * @brief 并发 stat / readdir / read 基准，比较 1 线程与 N 线程的吞吐
+ *
+ * usage: parallel_stat <mountpoint> [threads] [files] [rounds]
+ * newfs 需以多线程模式挂载 (不带 -s) 才能看到扩展性
+ */
+int main(int argc, char **argv) {
+    int nthreads, t;
+    double single, multi;
+    long errs = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <mountpoint> [threads] [files] [rounds]\n", argv[0]);
+        return 1;
+    }
+    mnt      = argv[1];
+    nthreads = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+    nfiles   = argc > 3 ? atoi(argv[3]) : DEFAULT_FILES;
+    rounds   = argc > 4 ? atoi(argv[4]) : DEFAULT_ROUNDS;
+    if (nthreads <= 0 || nfiles <= 0 || rounds <= 0) {
+        fprintf(stderr, "threads, files and rounds must be positive\n");
+        return 1;
+    }
+
+    if (setup(nthreads) < 0)
+        return 1;
+
+    /* 单线程也访问全部子树，保证两组工作量一致 */
+    single = 0;
+    for (t = 0; t < nthreads; t++) {
+        struct worker w = { .id = t };
+        double start = now_sec();
+        run(&w);
+        single += now_sec() - start;
+        errs += w.errs;
+    }
+    single = (double)nthreads * rounds * (nfiles + 2) / single;
+    multi  = bench(nthreads, &errs);
+
+    printf("mount %s, %d files/thread, %d rounds\n", mnt, nfiles, rounds);
+    printf("1  thread : %12.1f ops/s\n", single);
+    printf("%-2d threads: %12.1f ops/s (x%.2f)\n", nthreads, multi, multi / single);
+    if (errs) {
+        fprintf(stderr, "%ld operations failed\n", errs);
+        return 1;
+    }
+    return 0;
+}
@@ -68,7 +68,16 @@ function check_bm() {
     _PARAM=$1
     _TEST_CASE=$2
     ROOT_PARENT_PATH=$(cd $(dirname $ROOT_PATH); pwd)
-    python3 "$ROOT_PATH"/checkbm/checkbm.py -l "$ROOT_PARENT_PATH"/include/fs.layout -r "$ROOT_PARENT_PATH"/tests/checkbm/golden.json -n "$filename" > /dev/null
+    GOLDEN="$ROOT_PARENT_PATH"/tests/checkbm/golden.json
+    INSPECT="$ROOT_PARENT_PATH"/build/newfs-inspect
+    if [ -x "$INSPECT" ]; then
+        # 布局取自超级块，期望值仍来自golden.json，退出码与checkbm.py相同
+        VALID_INODE=$(grep -o '"valid_inode": *[0-9]*' "$GOLDEN" | grep -o '[0-9]*$')
+        VALID_DATA=$(grep -o '"valid_data": *[0-9]*' "$GOLDEN" | grep -o '[0-9]*$')
+        "$INSPECT" -i "$VALID_INODE" -d "$VALID_DATA" -n "$filename" "$HOME"/ddriver > /dev/null
+    else
+        python3 "$ROOT_PATH"/checkbm/checkbm.py -l "$ROOT_PARENT_PATH"/include/fs.layout -r "$GOLDEN" -n "$filename" > /dev/null
+    fi
     RET=$?
     if (( RET == ERR_OK )); then
         return 0
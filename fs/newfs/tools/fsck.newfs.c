@@ -0,0 +1,491 @@
+#include <time.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include "newfs.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define CHUNK_INODES    4096 /* 每个线程一次领取的inode数 */
+#define MAX_THREADS     64
+#define MAX_REPORT      20   /* 位图差异只列出前几项 */
+/* e2fsck的退出码 */
+#define EXIT_CLEAN      0
+#define EXIT_FIXED      1
+#define EXIT_UNFIXED    4
+#define EXIT_ERROR      8
+/* inode的状态 */
+#define ST_FREE         0    /* 位图中未分配 */
+#define ST_BAD          1    /* 已分配但无法使用：校验和、编号、类型或目录的块号有误 */
+#define ST_FILE         2
+#define ST_DIR          3
+/* 需要修复的inode */
+#define FIX_DIR         0x1  /* 目录项要重新整理 */
+#define FIX_SIZE        0x2  /* 文件块号越界，截断到第一个坏块 */
+/******************************************************************************
+* SECTION: Global Data
+*******************************************************************************/
+enum problem {
+    P_INODE, P_BLOCK, P_DUP, P_DENTRY_BLK, P_DENTRY, P_TYPE, P_NAME, P_DIR_CNT, P_LINK, P_ORPHAN,
+    P_MAP_INODE, P_MAP_DATA, P_MAP_CSUM, P_NR
+};
+static const char *problem_name[P_NR] = {
+    "bad inodes", "block numbers out of range", "blocks claimed twice", "bad dentry blocks",
+    "dangling entries", "type mismatches", "bad or duplicate names", "wrong dir_cnt",
+    "extra links", "unreferenced inodes", "inode bitmap differences", "data bitmap differences",
+    "bitmap checksum mismatches",
+};
+static long problems[P_NR];
+
+static uint8_t *img;                    /* 整个镜像的映射 */
+static struct nfs_super_d *super_d;
+static int blk, per_blk, max_ino, max_data, nthreads, repair;
+static uint8_t *state, *nblks, *fix, *reach;
+static int *owner;                      /* 每个数据块第一个认领它的ino + 1 */
+static int next_chunk;
+
+#define INODE_D(ino)  ((struct nfs_inode_d *)(img + super_d->inode_offset + (long)(ino) * blk))
+#define DATA_BLK(dno) (img + super_d->data_offset + (long)(dno) * blk)
+#define DENTRY_D(dir, i) \
+    ((struct nfs_dentry_d *)DATA_BLK(INODE_D(dir)->used_block_num[(i) / per_blk]) + (i) % per_blk)
+#define BIT(map, i)   (((map)[(i) / UINT8_BITS] >> ((i) % UINT8_BITS)) & 0x1)
+#define SET_BIT(map, i) ((map)[(i) / UINT8_BITS] |= (0x1 << ((i) % UINT8_BITS)))
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+static void report(enum problem p, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void report(enum problem p, const char *fmt, ...) {
+    va_list ap;
+    char line[256];
+
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    __atomic_fetch_add(&problems[p], 1, __ATOMIC_RELAXED);
+    printf("%s\n", line);
+}
+static int csum_on(void) {
+    return super_d->features & NFS_FEATURE_CSUM;
+}
+static int dentry_blk_ok(int dno) {
+    uint32_t csum;
+    memcpy(&csum, DATA_BLK(dno) + blk - sizeof(uint32_t), sizeof(uint32_t));
+    return !csum_on() || csum == nfs_crc32c(DATA_BLK(dno), blk - sizeof(uint32_t));
+}
+/**
+ * @brief 目录第i项是否可用：所在块校验正确，名字非空，指向类型相符的可用inode
+ */
+static int entry_ok(int dir, int i) {
+    struct nfs_dentry_d *dentry_d = DENTRY_D(dir, i);
+
+    return !(fix[dir] & FIX_DIR && !dentry_blk_ok(INODE_D(dir)->used_block_num[i / per_blk])) &&
+           dentry_d->fname[0] != '\0' && dentry_d->ino < (uint32_t)max_ino &&
+           (state[dentry_d->ino] == ST_FILE || state[dentry_d->ino] == ST_DIR) &&
+           (dentry_d->ftype == NFS_DIR) == (state[dentry_d->ino] == ST_DIR);
+}
+/**
+ * @brief 从镜像映射中取出的块号有没有超出数据区
+ */
+static int blk_in_range(int dno) {
+    return dno >= 0 && dno < max_data;
+}
+/******************************************************************************
+* SECTION: Scan
+*******************************************************************************/
+/**
+ * @brief 第一遍：检查一个inode，认领它的数据块
+ */
+static void check_inode(int ino) {
+    struct nfs_inode_d *inode_d = INODE_D(ino);
+    int cnt, prev, dno;
+
+    if (csum_on() && inode_d->csum != nfs_crc32c(inode_d, offsetof(struct nfs_inode_d, csum))) {
+        report(P_INODE, "inode %d: checksum mismatch", ino);
+        state[ino] = ST_BAD;
+        return;
+    }
+    if (inode_d->ino != (uint32_t)ino || (inode_d->ftype != NFS_FILE && inode_d->ftype != NFS_DIR)) {
+        report(P_INODE, "inode %d: bad number %u or type %d", ino, inode_d->ino, inode_d->ftype);
+        state[ino] = ST_BAD;
+        return;
+    }
+    if (inode_d->ftype == NFS_FILE) {
+        if (inode_d->size < 0 || inode_d->size > NFS_DATA_PER_FILE * blk) {
+            report(P_INODE, "inode %d: size %d out of range", ino, inode_d->size);
+            state[ino] = ST_BAD;
+            return;
+        }
+        cnt = (inode_d->size + blk - 1) / blk;
+    } else {
+        if (inode_d->dir_cnt < 0 || inode_d->dir_cnt > NFS_DATA_PER_FILE * per_blk) {
+            report(P_INODE, "inode %d: dir_cnt %d out of range", ino, inode_d->dir_cnt);
+            state[ino] = ST_BAD;
+            return;
+        }
+        cnt = (inode_d->dir_cnt + per_blk - 1) / per_blk;
+    }
+    for (int i = 0; i < cnt; i++) {
+        if (!blk_in_range(inode_d->used_block_num[i])) {
+            report(P_BLOCK, "inode %d: block %d is %d, outside the data area", ino, i,
+                   inode_d->used_block_num[i]);
+            if (inode_d->ftype == NFS_DIR) {
+                state[ino] = ST_BAD;
+                return;
+            }
+            fix[ino] |= FIX_SIZE;
+            cnt = i;
+            break;
+        }
+    }
+    for (int i = 0; i < cnt; i++) {
+        dno = inode_d->used_block_num[i];
+        prev = 0;
+        if (!__atomic_compare_exchange_n(&owner[dno], &prev, ino + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            report(P_DUP, "block %d: claimed by inodes %d and %d", dno, prev - 1, ino);
+        }
+    }
+    nblks[ino] = cnt;
+    state[ino] = inode_d->ftype == NFS_DIR ? ST_DIR : ST_FILE;
+}
+/**
+ * @brief 第二遍：检查目录自身的目录项块，每项指向的inode在第一遍已有结论
+ */
+static void check_dir(int dir) {
+    struct nfs_inode_d *inode_d = INODE_D(dir);
+    struct nfs_dentry_d *dentry_d;
+    int cnt = inode_d->dir_cnt;
+
+    for (int i = 0; i < nblks[dir]; i++) {
+        if (!dentry_blk_ok(inode_d->used_block_num[i])) {
+            report(P_DENTRY_BLK, "dir %d: dentry block %d checksum mismatch", dir, inode_d->used_block_num[i]);
+            fix[dir] |= FIX_DIR;
+        }
+    }
+    for (int i = 0; i < nblks[dir] * per_blk; i++) {
+        dentry_d = DENTRY_D(dir, i);
+        if (fix[dir] & FIX_DIR && !dentry_blk_ok(inode_d->used_block_num[i / per_blk])) {
+            continue;
+        }
+        if (i >= cnt) {
+            if (dentry_d->fname[0] != '\0') {
+                report(P_DIR_CNT, "dir %d: dir_cnt %d but entry %d is in use", dir, cnt, i);
+                fix[dir] |= FIX_DIR;
+            }
+            continue;
+        }
+        if (dentry_d->fname[0] == '\0') {
+            report(P_NAME, "dir %d: entry %d has an empty name", dir, i);
+            fix[dir] |= FIX_DIR;
+            continue;
+        }
+        if (dentry_d->ino >= (uint32_t)max_ino || state[dentry_d->ino] < ST_FILE) {
+            report(P_DENTRY, "dir %d: '%.*s' points to %s inode %u", dir, NFS_MAX_FILE_NAME, dentry_d->fname,
+                   dentry_d->ino >= (uint32_t)max_ino || state[dentry_d->ino] == ST_FREE ? "free" : "bad",
+                   dentry_d->ino);
+            fix[dir] |= FIX_DIR;
+            continue;
+        }
+        if ((dentry_d->ftype == NFS_DIR) != (state[dentry_d->ino] == ST_DIR)) {
+            report(P_TYPE, "dir %d: '%.*s' is a %s but inode %u is a %s", dir, NFS_MAX_FILE_NAME,
+                   dentry_d->fname, dentry_d->ftype == NFS_DIR ? "dir" : "file", dentry_d->ino,
+                   state[dentry_d->ino] == ST_DIR ? "dir" : "file");
+            fix[dir] |= FIX_DIR;
+            continue;
+        }
+        for (int j = 0; j < i; j++) {
+            if (entry_ok(dir, j) && strncmp(DENTRY_D(dir, j)->fname, dentry_d->fname, NFS_MAX_FILE_NAME) == 0) {
+                report(P_NAME, "dir %d: '%.*s' appears twice", dir, NFS_MAX_FILE_NAME, dentry_d->fname);
+                fix[dir] |= FIX_DIR;
+                break;
+            }
+        }
+    }
+}
+static void *scan_main(void *arg) {
+    int pass = *(int *)arg, start;
+
+    while ((start = __atomic_fetch_add(&next_chunk, CHUNK_INODES, __ATOMIC_RELAXED)) < max_ino) {
+        for (int ino = start; ino < start + CHUNK_INODES && ino < max_ino; ino++) {
+            if (pass == 1 && BIT(img + super_d->map_inode_offset, ino)) {
+                check_inode(ino);
+            } else if (pass == 2 && state[ino] == ST_DIR) {
+                check_dir(ino);
+            }
+        }
+    }
+    return NULL;
+}
+/**
+ * @brief 以nthreads个线程按CHUNK_INODES一段扫描inode区
+ */
+static void scan(int pass) {
+    pthread_t tids[MAX_THREADS];
+
+    next_chunk = 0;
+    for (int t = 0; t < nthreads; t++) {
+        pthread_create(&tids[t], NULL, scan_main, &pass);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+}
+/**
+ * @brief 第三遍：从根目录广度优先遍历，每个inode只能从一个目录项到达；
+ * 修复时目录按保留下来的项重新排列
+ */
+static void walk(void) {
+    int *queue = malloc(max_ino * sizeof(int));
+    struct nfs_dentry_d *kept = malloc(NFS_DATA_PER_FILE * per_blk * sizeof(struct nfs_dentry_d));
+    struct nfs_dentry_d *dentry_d;
+    int head = 0, tail = 0, dir, nkept;
+
+    reach[NFS_ROOT_INO] = 1;
+    queue[tail++] = NFS_ROOT_INO;
+    while (head < tail) {
+        dir = queue[head++];
+        nkept = 0;
+        for (int i = 0; i < nblks[dir] * per_blk; i++) {
+            dentry_d = DENTRY_D(dir, i);
+            if (!entry_ok(dir, i) || (i >= INODE_D(dir)->dir_cnt && !(fix[dir] & FIX_DIR))) {
+                continue;
+            }
+            if (reach[dentry_d->ino]) {
+                report(P_LINK, "dir %d: '%.*s' links inode %u, already reachable elsewhere", dir,
+                       NFS_MAX_FILE_NAME, dentry_d->fname, dentry_d->ino);
+                fix[dir] |= FIX_DIR;
+                continue;
+            }
+            if (fix[dir] & FIX_DIR) {
+                int dup = 0;
+                for (int j = 0; j < nkept && !dup; j++) {
+                    dup = strncmp(kept[j].fname, dentry_d->fname, NFS_MAX_FILE_NAME) == 0;
+                }
+                if (dup) {
+                    continue;
+                }
+                kept[nkept++] = *dentry_d;
+            }
+            reach[dentry_d->ino] = 1;
+            if (state[dentry_d->ino] == ST_DIR) {
+                queue[tail++] = dentry_d->ino;
+            }
+        }
+        if (repair && fix[dir] & FIX_DIR) {
+            /* 保留的项依次放回原来的块，多出的块不再属于该目录 */
+            struct nfs_inode_d *inode_d = INODE_D(dir);
+            uint32_t csum;
+            nblks[dir] = (nkept + per_blk - 1) / per_blk;
+            for (int b = 0; b < nblks[dir]; b++) {
+                uint8_t *data = DATA_BLK(inode_d->used_block_num[b]);
+                int n = nkept - b * per_blk < per_blk ? nkept - b * per_blk : per_blk;
+                memset(data, 0, blk);
+                memcpy(data, kept + b * per_blk, n * sizeof(struct nfs_dentry_d));
+                if (csum_on()) {
+                    csum = nfs_crc32c(data, blk - sizeof(uint32_t));
+                    memcpy(data + blk - sizeof(uint32_t), &csum, sizeof(uint32_t));
+                }
+            }
+            inode_d->dir_cnt = nkept;
+            if (csum_on()) {
+                inode_d->csum = nfs_crc32c(inode_d, offsetof(struct nfs_inode_d, csum));
+            }
+        }
+    }
+    free(kept);
+    free(queue);
+}
+/**
+ * @brief 数据和索引位图与预期逐64位比较，异或后按popcount计数
+ * @return long 不同的位数
+ */
+static long diff_map(enum problem p, const char *name, uint8_t *disk, const uint8_t *expect, int bytes) {
+    uint64_t d, e, x;
+    long diff = 0;
+    int shown = 0;
+
+    for (int w = 0; w < bytes; w += sizeof(uint64_t)) {
+        memcpy(&d, disk + w, sizeof(uint64_t));
+        memcpy(&e, expect + w, sizeof(uint64_t));
+        x = d ^ e;
+        if (x == 0) {
+            continue;
+        }
+        diff += __builtin_popcountll(x);
+        for (; x != 0 && shown < MAX_REPORT; x &= x - 1, shown++) {
+            int bit = w * UINT8_BITS + __builtin_ctzll(x);
+            printf("%s bit %d: %s\n", name, bit, BIT(disk, bit) ? "set but unused" : "in use but clear");
+        }
+    }
+    if (diff > shown) {
+        printf("%s: %ld more differences\n", name, diff - shown);
+    }
+    problems[p] += diff;
+    if (repair) {
+        memcpy(disk, expect, bytes);
+    }
+    return diff;
+}
+/**
+ * @brief 普通块设备或ddriver字符设备没有文件大小，向驱动询问
+ */
+static long long device_size(int fd, struct stat *st) {
+    long long size = st->st_size;
+    if (size == 0 && ioctl(fd, IOC_REQ_DEVICE_SIZE64, &size) < 0) {
+        size = 0;
+    }
+    return size;
+}
+/******************************************************************************
+* SECTION: Main
+*******************************************************************************/
+/**
+ * @brief newfs一致性检查：
+ * 位图与可达inode是否一致、目录项与inode类型是否一致、dir_cnt、数据块重复认领、不可达的inode
+ *
+ * usage: fsck.newfs [-n | -y] [-t threads] device
+ * -n 只检查(默认)；-y 就地修复：不可达和损坏的inode释放，目录去掉坏项后重新排列，文件截断到第一个越界块，
+ * 位图按可达inode重建；重复认领的块只报告不修复
+ * 镜像整体mmap，inode区按CHUNK_INODES一段由各线程领取扫描
+ * 退出码同e2fsck：0无问题，1已修复，4仍有问题，8无法检查
+ */
+int main(int argc, char **argv) {
+    struct nfs_jdesc_d *desc;
+    struct nfs_journal_d *journal_d;
+    struct stat st;
+    uint8_t *exp_inode, *exp_data;
+    long long size;
+    long total = 0;
+    int fd, opt, map_inode_bytes, map_data_bytes, end;
+    double start = now_sec();
+
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "nyt:")) != -1) {
+        switch (opt) {
+        case 'n': repair = 0; break;
+        case 'y': repair = 1; break;
+        case 't': nthreads = atoi(optarg); break;
+        default: optind = argc; break;
+        }
+    }
+    if (optind != argc - 1 || nthreads <= 0) {
+        fprintf(stderr, "usage: %s [-n | -y] [-t threads] device\n", argv[0]);
+        return EXIT_ERROR;
+    }
+    nthreads = nthreads > MAX_THREADS ? MAX_THREADS : nthreads;
+
+    fd = open(argv[optind], repair ? O_RDWR : O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || (size = device_size(fd, &st)) < NFS_MIN_BLK_SZ) {
+        fprintf(stderr, "open %s: %s\n", argv[optind], fd < 0 ? strerror(errno) : "not a newfs device");
+        return EXIT_ERROR;
+    }
+    size = size > INT_MAX ? INT_MAX : size;
+    img = mmap(NULL, size, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (img == MAP_FAILED) {
+        fprintf(stderr, "mmap %s: %s\n", argv[optind], strerror(errno));
+        return EXIT_ERROR;
+    }
+
+    /* 超级块与布局 */
+    super_d = (struct nfs_super_d *)(img + NFS_SUPER_OFS);
+    if (super_d->magic_num != NFS_MAGIC_NUM || !nfs_verify_super(super_d)) {
+        fprintf(stderr, "%s: bad superblock\n", argv[optind]);
+        return EXIT_ERROR;
+    }
+    blk = super_d->sz_blk > 0 ? super_d->sz_blk : NFS_MIN_BLK_SZ;
+    per_blk = (blk - sizeof(uint32_t)) / sizeof(struct nfs_dentry_d);
+    end = super_d->journal_blks > 0 ? super_d->journal_offset : NFS_ROUND_DOWN((int)size, blk);
+    max_ino = (super_d->data_offset - super_d->inode_offset) / blk;
+    max_data = (end - super_d->data_offset) / blk;
+    map_inode_bytes = super_d->map_inode_blks * blk;
+    map_data_bytes = super_d->map_data_blks * blk;
+    if (max_ino <= 0 || max_data <= 0 || end > size ||
+        (long)map_inode_bytes * UINT8_BITS < max_ino || (long)map_data_bytes * UINT8_BITS < max_data) {
+        fprintf(stderr, "%s: inconsistent layout\n", argv[optind]);
+        return EXIT_ERROR;
+    }
+    if (super_d->journal_blks > 0) {
+        journal_d = (struct nfs_journal_d *)(img + super_d->journal_offset);
+        desc = (struct nfs_jdesc_d *)(img + super_d->journal_offset + (long)journal_d->start * blk);
+        if (journal_d->magic == NFS_JOURNAL_MAGIC && journal_d->start > 0 && journal_d->start < super_d->journal_blks &&
+            desc->magic == NFS_JDESC_MAGIC && desc->seq == journal_d->seq) {
+            fprintf(stderr, "%s: journal holds committed transactions, mount once to replay them\n", argv[optind]);
+            return EXIT_ERROR;
+        }
+    }
+    if (super_d->state != NFS_STATE_CLEAN) {
+        printf("%s was not cleanly unmounted\n", argv[optind]);
+    } else if (csum_on() &&
+               (super_d->map_inode_csum != nfs_crc32c(img + super_d->map_inode_offset, map_inode_bytes) ||
+                super_d->map_data_csum != nfs_crc32c(img + super_d->map_data_offset, map_data_bytes))) {
+        report(P_MAP_CSUM, "bitmap checksums in the superblock do not match");
+    }
+
+    state = calloc(max_ino, 1);
+    nblks = calloc(max_ino, 1);
+    fix = calloc(max_ino, 1);
+    reach = calloc(max_ino, 1);
+    owner = calloc(max_data, sizeof(int));
+    exp_inode = calloc(map_inode_bytes, 1);
+    exp_data = calloc(map_data_bytes, 1);
+
+    scan(1);
+    if (state[NFS_ROOT_INO] != ST_DIR) {
+        fprintf(stderr, "%s: root directory is damaged\n", argv[optind]);
+        return EXIT_UNFIXED;
+    }
+    scan(2);
+    walk();
+
+    for (int ino = 0; ino < max_ino; ino++) {
+        if (state[ino] >= ST_FILE && !reach[ino]) {
+            report(P_ORPHAN, "inode %d: %s not reachable from the root", ino, state[ino] == ST_DIR ? "dir" : "file");
+        }
+        if (!reach[ino]) {
+            continue;
+        }
+        SET_BIT(exp_inode, ino);
+        for (int i = 0; i < nblks[ino]; i++) {
+            SET_BIT(exp_data, INODE_D(ino)->used_block_num[i]);
+        }
+        if (repair && fix[ino] & FIX_SIZE) {
+            INODE_D(ino)->size = nblks[ino] * blk;
+            if (csum_on()) {
+                INODE_D(ino)->csum = nfs_crc32c(INODE_D(ino), offsetof(struct nfs_inode_d, csum));
+            }
+        }
+    }
+    diff_map(P_MAP_INODE, "inode bitmap", img + super_d->map_inode_offset, exp_inode, map_inode_bytes);
+    diff_map(P_MAP_DATA, "data bitmap", img + super_d->map_data_offset, exp_data, map_data_bytes);
+
+    for (int p = 0; p < P_NR; p++) {
+        if (problems[p] > 0) {
+            printf("%8ld %s\n", problems[p], problem_name[p]);
+        }
+        total += problems[p];
+    }
+    if (repair && (total > 0 || super_d->state != NFS_STATE_CLEAN)) {
+        super_d->state = NFS_STATE_CLEAN;
+        super_d->map_inode_csum = nfs_crc32c(img + super_d->map_inode_offset, map_inode_bytes);
+        super_d->map_data_csum = nfs_crc32c(img + super_d->map_data_offset, map_data_bytes);
+        nfs_csum_super(super_d);
+        msync(img, size, MS_SYNC);
+    }
+    printf("%s: %d inodes, %d data blocks, %ld problems%s, %d threads, %.1f ms\n", argv[optind], max_ino,
+           max_data, total, !repair || total == 0 ? "" : problems[P_DUP] > 0 ? ", blocks claimed twice left as is"
+                                                                             : " fixed",
+           nthreads, (now_sec() - start) * 1e3);
+    munmap(img, size);
+    close(fd);
+    if (total == 0) {
+        return EXIT_CLEAN;
+    }
+    return repair && problems[P_DUP] == 0 ? EXIT_FIXED : EXIT_UNFIXED;
+}
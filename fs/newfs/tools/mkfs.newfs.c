@@ -0,0 +1,149 @@
+#include <time.h>
+#include <limits.h>
+#include <getopt.h>
+#include "newfs.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+#define ENV_DISK_SZ "DDRIVER_DISK_SZ" /* 新镜像的大小，见ddriver_open */
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+/**
+ * @brief 解析带K/M/G后缀的大小，出错返回-1
+ */
+static long long parse_size(const char *str) {
+    char *end;
+    long long size = strtoll(str, &end, 10);
+
+    switch (*end) {
+    case 'g': case 'G': size <<= 10; /* fall through */
+    case 'm': case 'M': size <<= 10; /* fall through */
+    case 'k': case 'K': size <<= 10; end++; break;
+    default: break;
+    }
+    return (end == str || *end != '\0' || size <= 0) ? -1 : size;
+}
+/**
+ * @brief 按checkbm.py的格式写出布局文件
+ */
+static int write_layout(const char *path, struct nfs_super_d *super_d) {
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "# Layout File\n#\n# 由mkfs.newfs生成\n\n");
+    fprintf(fp, "| BSIZE = %d B |\n", super_d->sz_blk);
+    fprintf(fp, "| Super(%d) | Inode Map(%d) | DATA Map(%d) | INODE(%d) | DATA(*) |\n",
+            NFS_BLKS_SUPER, super_d->map_inode_blks, super_d->map_data_blks,
+            (super_d->data_offset - super_d->inode_offset) / super_d->sz_blk);
+    fclose(fp);
+    return 0;
+}
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-b block_size] [-i bytes_per_inode] [-j journal_blocks] "
+                    "[-l layout_file] [-K] device [size]\n", prog);
+}
+/******************************************************************************
+* SECTION: Main
+*******************************************************************************/
+/**
+ * @brief 格式化newfs：规划布局后写超级块、位图、根目录和日志超级块，之后挂载时不再隐式格式化
+ *
+ * usage: mkfs.newfs [-b block_size] [-i bytes_per_inode] [-j journal_blocks] [-l layout_file] [-K] device [size]
+ * -b 块大小，默认两倍IO单位；-i 每多少字节分配一个inode，默认7168；-j 日志区块数，默认128，0为不使用日志
+ * -l 写出布局文件供checkbm.py使用；-K 不先discard整个设备
+ * size只用于创建新镜像(同DDRIVER_DISK_SZ)，已有设备必须与之一致
+ */
+int main(int argc, char **argv) {
+    struct nfs_super_d super_d;
+    const char *layout = NULL;
+    long long size = 0, sz_disk;
+    int blk = 0, ratio = NFS_INODE_RATIO, journal = NFS_JOURNAL_DEFAULT_BLKS, discard = 1;
+    int fd, io, ret, opt, blks;
+    double start;
+
+    while ((opt = getopt(argc, argv, "b:i:j:l:K")) != -1) {
+        switch (opt) {
+        case 'b': blk = parse_size(optarg); break;
+        case 'i': ratio = parse_size(optarg); break;
+        case 'j': journal = atoi(optarg); break;
+        case 'l': layout = optarg; break;
+        case 'K': discard = 0; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc || argc - optind > 2 || blk < 0 || ratio <= 0 || journal < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (argc - optind == 2) {
+        size = parse_size(argv[optind + 1]);
+        if (size < 0) {
+            fprintf(stderr, "bad size %s\n", argv[optind + 1]);
+            return 1;
+        }
+        setenv(ENV_DISK_SZ, argv[optind + 1], 1);
+    }
+
+    fd = ddriver_open(argv[optind]);
+    if (fd < 0) {
+        fprintf(stderr, "open %s: %s\n", argv[optind], strerror(-fd));
+        return 1;
+    }
+    if ((ret = ddriver_ioctl(fd, IOC_REQ_DEVICE_SIZE64, &sz_disk)) < 0 ||
+        (ret = ddriver_ioctl(fd, IOC_REQ_DEVICE_IO_SZ, &io)) < 0) {
+        fprintf(stderr, "geometry of %s: %s\n", argv[optind], strerror(-ret));
+        ddriver_close(fd);
+        return 1;
+    }
+    if (size > 0 && size != sz_disk) {
+        fprintf(stderr, "%s is %lld bytes, not %lld\n", argv[optind], sz_disk, size);
+        ddriver_close(fd);
+        return 1;
+    }
+    blk = blk > 0 ? blk : 2 * io;
+    ret = nfs_plan_layout(&super_d, sz_disk, io, blk, ratio, journal);
+    if (ret == -NFS_ERROR_INVAL) {
+        fprintf(stderr, "block size must be a power of two in [%d, %d] and a multiple of %d, "
+                        "bytes per inode at least the block size\n", NFS_MIN_BLK_SZ, NFS_MAX_BLK_SZ, io);
+    } else if (ret < 0) {
+        fprintf(stderr, "%s is too small\n", argv[optind]);
+    }
+    if (ret < 0) {
+        ddriver_close(fd);
+        return 1;
+    }
+
+    start = now_sec();
+    if (discard) {
+        struct ddriver_range range = { 0, sz_disk };
+        ddriver_ioctl(fd, IOC_REQ_DEVICE_DISCARD, &range); /* 不支持时忽略 */
+    }
+    ret = nfs_format(fd, &super_d);
+    ddriver_close(fd);
+    if (ret < 0) {
+        fprintf(stderr, "format %s: %s\n", argv[optind], strerror(-ret));
+        return 1;
+    }
+
+    if (sz_disk > INT_MAX) {
+        printf("newfs addresses at most %d bytes, the rest of %s is unused\n", INT_MAX, argv[optind]);
+        sz_disk = INT_MAX;
+    }
+    blks = super_d.journal_blks > 0 ? super_d.journal_offset / super_d.sz_blk : sz_disk / super_d.sz_blk;
+    printf("%s: %d-byte blocks, %d inodes, %d data blocks, journal %d blocks\n", argv[optind],
+           super_d.sz_blk, (super_d.data_offset - super_d.inode_offset) / super_d.sz_blk,
+           blks - super_d.data_offset / super_d.sz_blk, super_d.journal_blks);
+    printf("formatted in %.3f ms\n", (now_sec() - start) * 1e3);
+    if (layout != NULL && write_layout(layout, &super_d) < 0)
+        return 1;
+    return 0;
+}
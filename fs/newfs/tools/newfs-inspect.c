@@ -0,0 +1,335 @@
+#include <time.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include "newfs.h"
+/******************************************************************************
+* SECTION: Macro definitions
+*******************************************************************************/
+/* 与checkbm.py相同的退出码，tests/stages/remount.sh按它给出提示 */
+#define ERR_OK          0
+#define INODE_MAP_ERR   1
+#define DATA_MAP_ERR    2
+#define LAYOUT_FILE_ERR 3    /* 这里指镜像不是newfs或布局不自洽 */
+#define DATA_ERR        5
+#define MAX_DEPTH       64   /* 目录树遍历的深度上限，损坏的镜像上防止无限递归 */
+/******************************************************************************
+* SECTION: Global Data
+*******************************************************************************/
+static uint8_t *img;                    /* 整个镜像的映射 */
+static struct nfs_super_d *super_d;
+static int blk, per_blk, max_ino, max_data, show_tree;
+static uint8_t *seen;                   /* 遍历中已经到达的inode */
+static long nfiles, ndirs;
+static const char *want_name;           /* -n：要在目录树中找到的名字 */
+static int name_found;
+
+#define INODE_D(ino)  ((struct nfs_inode_d *)(img + super_d->inode_offset + (long)(ino) * blk))
+#define DATA_BLK(dno) (img + super_d->data_offset + (long)(dno) * blk)
+
+typedef long (*popcount_fn)(const uint8_t *, int);
+/******************************************************************************
+* SECTION: Helper Functions
+*******************************************************************************/
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+/**
+ * @brief 按64位字统计置位数；位图大小都是块的整数倍
+ */
+static long popcount_generic(const uint8_t *map, int bytes) {
+    uint64_t w;
+    long cnt = 0;
+
+    for (int i = 0; i < bytes; i += sizeof(uint64_t)) {
+        memcpy(&w, map + i, sizeof(uint64_t));
+        cnt += __builtin_popcountll(w);
+    }
+    return cnt;
+}
+#if defined(__x86_64__) || defined(__i386__)
+/* 同一段代码按popcnt指令编译，由__builtin_cpu_supports决定是否使用 */
+__attribute__((target("popcnt"))) static long popcount_hw(const uint8_t *map, int bytes) {
+    uint64_t w;
+    long cnt = 0;
+
+    for (int i = 0; i < bytes; i += sizeof(uint64_t)) {
+        memcpy(&w, map + i, sizeof(uint64_t));
+        cnt += __builtin_popcountll(w);
+    }
+    return cnt;
+}
+#endif
+static popcount_fn popcount_impl(const char **name) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("popcnt")) {
+        *name = "popcnt";
+        return popcount_hw;
+    }
+#endif
+    *name = "generic";
+    return popcount_generic;
+}
+/**
+ * @brief 第一个置位的位号，没有返回-1
+ */
+static long first_set(const uint8_t *map, int bytes) {
+    uint64_t w;
+
+    for (int i = 0; i < bytes; i += sizeof(uint64_t)) {
+        memcpy(&w, map + i, sizeof(uint64_t));
+        if (w != 0) {
+            return (long)i * UINT8_BITS + __builtin_ctzll(w);
+        }
+    }
+    return -1;
+}
+static const char *json_bool(int b) {
+    return b ? "true" : "false";
+}
+/**
+ * @brief 以JSON字符串输出，最多len字节，遇到'\0'停止
+ */
+static void json_str(const char *s, int len) {
+    putchar('"');
+    for (int i = 0; i < len && s[i] != '\0'; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+static int csum_on(void) {
+    return super_d->features & NFS_FEATURE_CSUM;
+}
+static int dentry_blk_ok(const uint8_t *dentry_blk) {
+    uint32_t csum;
+    memcpy(&csum, dentry_blk + blk - sizeof(uint32_t), sizeof(uint32_t));
+    return !csum_on() || csum == nfs_crc32c(dentry_blk, blk - sizeof(uint32_t));
+}
+static int inode_ok(int ino) {
+    struct nfs_inode_d *inode_d = INODE_D(ino);
+    return inode_d->ino == (uint32_t)ino &&
+           (!csum_on() || inode_d->csum == nfs_crc32c(inode_d, offsetof(struct nfs_inode_d, csum)));
+}
+/**
+ * @brief 文件或目录实际占用的块数，块号越界时截到第一个坏块
+ */
+static int inode_blks(struct nfs_inode_d *inode_d) {
+    int blks = inode_d->ftype == NFS_DIR ? (inode_d->dir_cnt + per_blk - 1) / per_blk
+                                         : (inode_d->size + blk - 1) / blk;
+    blks = blks < 0 ? 0 : blks > NFS_DATA_PER_FILE ? NFS_DATA_PER_FILE : blks;
+    for (int i = 0; i < blks; i++) {
+        if (inode_d->used_block_num[i] < 0 || inode_d->used_block_num[i] >= max_data) {
+            return i;
+        }
+    }
+    return blks;
+}
+/**
+ * @brief 输出一个inode及其下的目录树；不带-T时只计数和查找名字
+ */
+static void walk(const char *name, int len, int ino, int depth) {
+    struct nfs_inode_d *inode_d = INODE_D(ino);
+    int ok = inode_ok(ino), is_dir = inode_d->ftype == NFS_DIR, blks = ok ? inode_blks(inode_d) : 0;
+    int entries = 0;
+
+    seen[ino] = 1;
+    if (show_tree) {
+        printf("{\"name\":");
+        json_str(name, len);
+        printf(",\"ino\":%d,\"type\":\"%s\",\"ok\":%s", ino, is_dir ? "dir" : "file", json_bool(ok));
+    }
+    if (!ok) {
+        if (show_tree) {
+            printf("}");
+        }
+        return;
+    }
+    is_dir ? ndirs++ : nfiles++;
+    if (show_tree) {
+        printf(",\"size\":%d,\"link\":%d,\"blocks\":[", inode_d->size, inode_d->link);
+        for (int i = 0; i < blks; i++) {
+            printf(i == 0 ? "%d" : ",%d", inode_d->used_block_num[i]);
+        }
+        printf("]");
+        if (is_dir) {
+            printf(",\"dir_cnt\":%d,\"entries\":[", inode_d->dir_cnt);
+        }
+    }
+    for (int b = 0; is_dir && b < blks; b++) {
+        uint8_t *dentry_blk = DATA_BLK(inode_d->used_block_num[b]);
+        int blk_ok = dentry_blk_ok(dentry_blk);
+        for (int i = 0; blk_ok && i < per_blk && b * per_blk + i < inode_d->dir_cnt; i++) {
+            struct nfs_dentry_d *dentry_d = (struct nfs_dentry_d *)dentry_blk + i;
+            if (dentry_d->fname[0] == '\0') {
+                continue;
+            }
+            if (want_name != NULL && strncmp(dentry_d->fname, want_name, NFS_MAX_FILE_NAME) == 0) {
+                name_found = 1;
+            }
+            if (show_tree && entries++ > 0) {
+                putchar(',');
+            }
+            if (dentry_d->ino >= (uint32_t)max_ino || seen[dentry_d->ino] || depth >= MAX_DEPTH) {
+                if (show_tree) { /* 悬空、重复或过深的项只列出名字 */
+                    printf("{\"name\":");
+                    json_str(dentry_d->fname, NFS_MAX_FILE_NAME);
+                    printf(",\"ino\":%u,\"ok\":false}", dentry_d->ino);
+                }
+                continue;
+            }
+            walk(dentry_d->fname, NFS_MAX_FILE_NAME, dentry_d->ino, depth + 1);
+        }
+    }
+    if (show_tree) {
+        printf(is_dir ? "]}" : "}");
+    }
+}
+/**
+ * @brief 普通块设备或ddriver字符设备没有文件大小，向驱动询问
+ */
+static long long device_size(int fd, struct stat *st) {
+    long long size = st->st_size;
+    if (size == 0 && ioctl(fd, IOC_REQ_DEVICE_SIZE64, &size) < 0) {
+        size = 0;
+    }
+    return size;
+}
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-T] [-i inodes] [-d data_blocks] [-n name] device\n", prog);
+}
+/******************************************************************************
+* SECTION: Main
+*******************************************************************************/
+/**
+ * @brief 直接解析newfs镜像并以JSON输出超级块、两张位图的使用情况和目录树，取代checkbm.py
+ *
+ * usage: newfs-inspect [-T] [-i inodes] [-d data_blocks] [-n name] device
+ * -T 输出完整目录树；-i/-d 期望的inode/数据位图置位数；-n 期望目录树中有这个名字
+ * 布局取自超级块，不需要fs.layout；镜像只读mmap，位图用popcount按64位统计
+ * 退出码同checkbm.py：0符合期望，1 inode位图不符，2数据位图不符，3不是newfs镜像，5找不到名字
+ */
+int main(int argc, char **argv) {
+    struct nfs_journal_d *journal_d;
+    struct nfs_jdesc_d *desc;
+    struct stat st;
+    popcount_fn popcount;
+    const char *impl;
+    long long size;
+    long used_inode, used_data;
+    int fd, opt, end, map_inode_bytes, map_data_bytes, pending = 0, ret = ERR_OK;
+    int want_inode = -1, want_data = -1;
+    double start = now_sec();
+
+    while ((opt = getopt(argc, argv, "Ti:d:n:")) != -1) {
+        switch (opt) {
+        case 'T': show_tree = 1; break;
+        case 'i': want_inode = atoi(optarg); break;
+        case 'd': want_data = atoi(optarg); break;
+        case 'n': want_name = optarg; break;
+        default: usage(argv[0]); return LAYOUT_FILE_ERR;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return LAYOUT_FILE_ERR;
+    }
+
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0 || (size = device_size(fd, &st)) < NFS_MIN_BLK_SZ) {
+        fprintf(stderr, "open %s: %s\n", argv[optind], fd < 0 ? strerror(errno) : "not a newfs device");
+        return LAYOUT_FILE_ERR;
+    }
+    size = size > INT_MAX ? INT_MAX : size;
+    img = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (img == MAP_FAILED) {
+        fprintf(stderr, "mmap %s: %s\n", argv[optind], strerror(errno));
+        return LAYOUT_FILE_ERR;
+    }
+
+    super_d = (struct nfs_super_d *)(img + NFS_SUPER_OFS);
+    if (super_d->magic_num != NFS_MAGIC_NUM || !nfs_verify_super(super_d)) {
+        fprintf(stderr, "%s: bad superblock\n", argv[optind]);
+        return LAYOUT_FILE_ERR;
+    }
+    blk = super_d->sz_blk > 0 ? super_d->sz_blk : NFS_MIN_BLK_SZ;
+    per_blk = (blk - sizeof(uint32_t)) / sizeof(struct nfs_dentry_d);
+    end = super_d->journal_blks > 0 ? super_d->journal_offset : NFS_ROUND_DOWN((int)size, blk);
+    max_ino = (super_d->data_offset - super_d->inode_offset) / blk;
+    max_data = (end - super_d->data_offset) / blk;
+    map_inode_bytes = super_d->map_inode_blks * blk;
+    map_data_bytes = super_d->map_data_blks * blk;
+    if (max_ino <= 0 || max_data <= 0 || end > size ||
+        (long)map_inode_bytes * UINT8_BITS < max_ino || (long)map_data_bytes * UINT8_BITS < max_data) {
+        fprintf(stderr, "%s: inconsistent layout\n", argv[optind]);
+        return LAYOUT_FILE_ERR;
+    }
+    if (super_d->journal_blks > 0) { /* 有未重放的事务时，位图和inode可能还是旧的 */
+        journal_d = (struct nfs_journal_d *)(img + super_d->journal_offset);
+        desc = (struct nfs_jdesc_d *)(img + super_d->journal_offset + (long)journal_d->start * blk);
+        pending = journal_d->magic == NFS_JOURNAL_MAGIC && journal_d->start > 0 &&
+                  journal_d->start < super_d->journal_blks && desc->magic == NFS_JDESC_MAGIC &&
+                  desc->seq == journal_d->seq;
+    }
+
+    popcount = popcount_impl(&impl);
+    used_inode = popcount(img + super_d->map_inode_offset, map_inode_bytes);
+    used_data = popcount(img + super_d->map_data_offset, map_data_bytes);
+
+    printf("{\"device\":");
+    json_str(argv[optind], PATH_MAX);
+    printf(",\"super\":{\"magic\":%u,\"sz_usage\":%d,\"sz_blk\":%d,"
+           "\"map_inode_offset\":%d,\"map_inode_blks\":%d,\"map_data_offset\":%d,\"map_data_blks\":%d,"
+           "\"inode_offset\":%d,\"data_offset\":%d,\"journal_offset\":%d,\"journal_blks\":%d,"
+           "\"max_ino\":%d,\"max_data\":%d,\"checksums\":%s,\"clean\":%s,\"journal_pending\":%s}",
+           super_d->magic_num, super_d->sz_usage, blk, super_d->map_inode_offset, super_d->map_inode_blks,
+           super_d->map_data_offset, super_d->map_data_blks, super_d->inode_offset, super_d->data_offset,
+           super_d->journal_offset, super_d->journal_blks, max_ino, max_data, json_bool(csum_on()),
+           json_bool(super_d->state == NFS_STATE_CLEAN), json_bool(pending));
+    /* 只有干净卸载的镜像上超级块里的位图校验和才有意义 */
+    printf(",\"inode_map\":{\"used\":%ld,\"first\":%ld", used_inode,
+           first_set(img + super_d->map_inode_offset, map_inode_bytes));
+    if (csum_on() && super_d->state == NFS_STATE_CLEAN) {
+        printf(",\"csum_ok\":%s", json_bool(super_d->map_inode_csum ==
+                                            nfs_crc32c(img + super_d->map_inode_offset, map_inode_bytes)));
+    }
+    printf("},\"data_map\":{\"used\":%ld,\"first\":%ld", used_data,
+           first_set(img + super_d->map_data_offset, map_data_bytes));
+    if (csum_on() && super_d->state == NFS_STATE_CLEAN) {
+        printf(",\"csum_ok\":%s", json_bool(super_d->map_data_csum ==
+                                            nfs_crc32c(img + super_d->map_data_offset, map_data_bytes)));
+    }
+    printf("}");
+
+    seen = calloc(max_ino, 1);
+    if (show_tree) {
+        printf(",\"tree\":");
+    }
+    walk("/", 1, NFS_ROOT_INO, 0);
+    printf(",\"files\":%ld,\"dirs\":%ld", nfiles, ndirs);
+
+    if (want_inode >= 0 && used_inode != want_inode) {
+        ret = INODE_MAP_ERR;
+    } else if (want_data >= 0 && used_data != want_data) {
+        ret = DATA_MAP_ERR;
+    } else if (want_name != NULL && !name_found) {
+        ret = DATA_ERR;
+    }
+    if (want_inode >= 0 || want_data >= 0 || want_name != NULL) {
+        printf(",\"check\":{\"inode_map\":%s,\"data_map\":%s,\"name\":%s}",
+               json_bool(want_inode < 0 || used_inode == want_inode),
+               json_bool(want_data < 0 || used_data == want_data), json_bool(want_name == NULL || name_found));
+    }
+    printf(",\"popcount\":\"%s\",\"elapsed_ms\":%.3f}\n", impl, (now_sec() - start) * 1e3);
+    return ret;
+}